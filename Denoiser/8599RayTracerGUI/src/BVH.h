@@ -11,14 +11,26 @@
 
 #include <vector>
 #include <algorithm>
+#include <memory>
+#include <atomic>
+#include <execution>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <queue>
+#include <numeric>
+#include <typeindex>
 
 #include "BoundingVolume.h"
+#include "BVHStatistics.h"
 #include "Entity.h"
 #include "IntersectionRecord.h"
+#include "RayPacket.h"
 
 namespace AccelerationStructure
 {
 	class BVH_Node
+	// Only used while building, the finished tree is flattened into BVH_LinearNodes.
 	{
 	public:
 
@@ -34,187 +46,2877 @@ namespace AccelerationStructure
 			// we are not deleting the entities in the tree
 		}
 
+		bool is_leaf() const
+		{
+			return (left == nullptr) && (right == nullptr);
+		}
+
 		// Data members:
 		float mesh_area = 0.0f;
 		BVH_Node* left = nullptr;
 		BVH_Node* right = nullptr;
 		AABB_3D bounding_volume = AABB_3D{};
-		Whitted::Entity* entity = nullptr;
+		int first_primitive_index = 0;	// leaf node only: the primitives of the leaf are m_primitive_indices[first_primitive_index, first_primitive_index + primitive_count)
+		int primitive_count = 0;		// 0 for interior nodes
+		int split_axis = X_axis;		// interior node only: the axis along which the primitives of the children were divided
+		std::vector<int> SBVH_primitive_indices;	// spatial split leaves only: the primitives of the leaf, until the leaves are laid out
 	};
 
-	class BVH
+	struct alignas(32) BVH_LinearNode
+	// The node the traversal actually reads. The tree is stored depth-first in one array, so the first child of an interior node
+	// is always the next node in the array and only the second child needs to be stored (as an index into the array).
 	{
-	public:
-		enum class DividingMethod
+		AABB_3D bounding_volume;		// 24 bytes
+		union
 		{
-			Median,
-			Surface_Area_Heuristic	// TODO
+			int first_primitive_index;	// leaf node
+			int second_child_index;		// interior node
 		};
+		uint16_t primitive_count;		// 0 for interior nodes
+		uint8_t split_axis;				// interior node only: lets the traversal visit the child nearer to the ray origin first
+		uint8_t padding;
+	};
+	static_assert(sizeof(BVH_LinearNode) == 32, "two BVH_LinearNodes should share one cache line");
 
-		BVH(
-			std::vector<Whitted::Entity*> primitives
-		)
-			:
-			m_primitives(std::move(primitives))
+	template <typename IntersectLeaf, typename VisitNode>
+	void packet_closest_hits_with(
+		const BVH_LinearNode* nodes,	// a depth-first binary BVH, nodes[0] is the root (BVH::GetNodes())
+		RayPacket& packet,
+		int first_ray_index,
+		int last_ray_index,				// the rays packet.rays[first_ray_index, last_ray_index) are traced
+		IntersectLeaf&& intersect_leaf,
+		VisitNode&& visit_node
+	)
+	// Closest-hit query for a packet: intersect_leaf(first_primitive_index, primitive_count, first_ray_index, last_ray_index) tests the rays
+	// [first_ray_index, last_ray_index) against the primitives of a leaf, and shrinks their t_max to any closer hit. visit_node(node_index)
+	// is called for every node the packet tests the box of.
+	/*
+	Ranged traversal: the packet carries the range of its rays that hit the current node, which only ever narrows on the way down.
+	At a node, the range is narrowed from the front to the first ray that hits the box, and from the back to the last one. If the first
+	ray misses, the interval test over the whole packet may reject the node before the other rays are tried one by one. The children are
+	visited in the order the shared direction signs give, so an incoherent packet falls back to tracing its rays one at a time.
+	*/
+	{
+		if (first_ray_index >= last_ray_index)
+		{
+			return;
+		}
+		constexpr int stack_size = 64;		// the same bound as BVH::traversal_stack_size
+		struct StackEntry
+		{
+			int node_index;
+			int first_ray_index;
+			int last_ray_index;
+		};
+
+		auto traverse = [&](int first_ray_index, int last_ray_index, bool is_coherent)
 		{
-			if (m_primitives.empty())
+			const AccelerationStructure::Ray& first_ray = packet.rays[first_ray_index];
+			std::array<int, 3> ray_direction_is_negative{ first_ray.m_direction.x < 0.0f, first_ray.m_direction.y < 0.0f, first_ray.m_direction.z < 0.0f };
+			std::array<StackEntry, stack_size> entries_to_visit;
+			int entries_to_visit_count = 0;
+			StackEntry entry{ 0, first_ray_index, last_ray_index };
+
+			while (true)
 			{
-				return;
+				const BVH_LinearNode& node = nodes[entry.node_index];
+				visit_node(entry.node_index);
+				auto is_hit_by = [&](int ray_index)
+				{
+					const AccelerationStructure::Ray& ray = packet.rays[ray_index];
+					float t_entry;
+					return node.bounding_volume.intersects_with_ray(ray, ray.direction_reciprocal, ray_direction_is_negative, (float)ray.t_max, t_entry);
+				};
+
+				bool is_hit = is_hit_by(entry.first_ray_index);
+				if ((!is_hit) && ((!is_coherent) || (!packet.misses_bounding_volume(node.bounding_volume))))
+				{
+					while ((!is_hit) && (++entry.first_ray_index < entry.last_ray_index))
+					{
+						is_hit = is_hit_by(entry.first_ray_index);
+					}
+				}
+				if (is_hit)
+				{
+					while (!is_hit_by(entry.last_ray_index - 1))	// stops at first_ray_index at the latest
+					{
+						entry.last_ray_index--;
+					}
+					if (node.primitive_count > 0)
+					{
+						intersect_leaf(node.first_primitive_index, (int)node.primitive_count, entry.first_ray_index, entry.last_ray_index);
+					}
+					else
+					{
+						StackEntry second_child{ node.second_child_index, entry.first_ray_index, entry.last_ray_index };
+						StackEntry first_child{ entry.node_index + 1, entry.first_ray_index, entry.last_ray_index };
+						entries_to_visit[entries_to_visit_count++] = ray_direction_is_negative[node.split_axis] ? first_child : second_child;
+						entry = ray_direction_is_negative[node.split_axis] ? second_child : first_child;
+						continue;
+					}
+				}
+				if (entries_to_visit_count == 0)
+				{
+					break;
+				}
+				entry = entries_to_visit[--entries_to_visit_count];
 			}
-			root = build_BVH(m_primitives);
+		};
+
+		if (packet.IsCoherent())
+		{
+			traverse(first_ray_index, last_ray_index, true);
+			return;
+		}
+		for (int i = first_ray_index; i < last_ray_index; i++)	// case: the rays would disagree on the order of the children
+		{
+			traverse(i, i + 1, false);
 		}
+	}
+
+	constexpr int rays_in_flight = 8;		// per thread, see interleave_traversals()
 
-		~BVH()
+	template <typename Node>
+	inline void prefetch_node(const Node* node)
+	// Ask for every cache line of the node, without waiting for them.
+	{
+		for (size_t offset = 0; offset < sizeof(Node); offset += 64)
 		{
-			delete root;
+#if defined(BOUNDINGVOLUME_HAS_SSE)
+			_mm_prefetch((const char*)node + offset, _MM_HINT_T0);
+#elif defined(__GNUC__)
+			__builtin_prefetch((const char*)node + offset);
+#endif
 		}
+	}
 
-		Whitted::IntersectionRecord traverse_BVH_from_root(const Ray& ray) const
+	template <typename Lane, typename StartRay, typename TakeStep>
+	void interleave_traversals(int ray_count, StartRay&& start_ray, TakeStep&& take_step)
+	// Traverse the rays [0, ray_count) of a batch, rays_in_flight at a time: start_ray(lane, ray_index) sets a Lane up for a ray, and
+	// take_step(lane, ray_index) advances its traversal by one node, prefetches the node it will need next, and returns false once the traversal has ended.
+	/*
+	Software pipelining: a traversal is a small state machine (the node it is at and its stack) kept in a lane, and the lanes take their
+	steps in turn. By the time a lane comes round again, the node it prefetched should be in the cache, so the thread keeps testing boxes
+	while the memory is fetched instead of waiting for every node in turn. A lane whose traversal ends takes the next ray of the batch.
+	This only pays off when the nodes are not in the cache already: for a BVH that fits in the L2 cache, switching lanes costs more than it saves.
+	*/
+	{
+		std::array<Lane, rays_in_flight> lanes;
+		std::array<int, rays_in_flight> ray_indices;	// -1: the lane is idle, the batch has run out of rays
+		int next_ray_index = 0;
+		int active_lane_count = 0;
+		for (int lane = 0; lane < rays_in_flight; lane++)
 		{
-			if (!root)	// no primitives at all in the scene
+			ray_indices[lane] = (next_ray_index < ray_count) ? next_ray_index++ : -1;
+			if (ray_indices[lane] >= 0)
 			{
-				return {};	// no intersection
+				start_ray(lanes[lane], ray_indices[lane]);
+				active_lane_count++;
 			}
+		}
 
-			return traverse_BVH_from_node(root, ray);
+		while (active_lane_count > 0)
+		{
+			for (int lane = 0; lane < rays_in_flight; lane++)
+			{
+				if ((ray_indices[lane] < 0) || take_step(lanes[lane], ray_indices[lane]))
+				{
+					continue;
+				}
+				if (next_ray_index < ray_count)
+				{
+					ray_indices[lane] = next_ray_index++;
+					start_ray(lanes[lane], ray_indices[lane]);
+				}
+				else
+				{
+					ray_indices[lane] = -1;
+					active_lane_count--;
+				}
+			}
 		}
+	}
 
-		Whitted::IntersectionRecord traverse_BVH_from_node(BVH_Node* node, const Ray& ray) const
+	template <typename IntersectLeaf, typename VisitNode>
+	void interleaved_closest_hits_with(
+		const BVH_LinearNode* nodes,	// a depth-first binary BVH, nodes[0] is the root
+		Ray* rays,
+		int ray_count,					// the rays rays[0, ray_count) are traced, and their t_max shrinks to their closest hits
+		IntersectLeaf&& intersect_leaf,
+		VisitNode&& visit_node
+	)
+	// Closest-hit query for a batch of unrelated rays, see interleave_traversals(): intersect_leaf(ray_index, first_primitive_index, primitive_count, bounded_ray)
+	// tests rays[ray_index] (which is bounded_ray) against the primitives of a leaf, and shrinks its t_max to any closer hit. visit_node(node_index)
+	// is called for every node a ray tests the box of. Each ray visits the same nodes in the same order as with BVH::closest_hit_with().
+	{
+		constexpr int stack_size = 64;		// the same bound as BVH::traversal_stack_size
+		struct Lane
 		{
-			std::array<int, 3> ray_direction_is_negative{ray.m_direction.x < 0.0f, ray.m_direction.y < 0.0f, ray.m_direction.z < 0.0f};
-			
-			if (!node->bounding_volume.intersects_with_ray(ray, ray.direction_reciprocal, ray_direction_is_negative))
+			int current_node_index;
+			std::array<int, 3> ray_direction_is_negative;
+			int nodes_to_visit_count;
+			std::array<int, stack_size> nodes_to_visit;
+		};
+
+		interleave_traversals<Lane>(ray_count,
+			[&](Lane& lane, int ray_index)
 			{
-				// case: no intersection:
-				return {};
+				const Ray& ray = rays[ray_index];
+				lane.current_node_index = 0;
+				lane.ray_direction_is_negative = { ray.m_direction.x < 0.0f, ray.m_direction.y < 0.0f, ray.m_direction.z < 0.0f };
+				lane.nodes_to_visit_count = 0;
+			},
+			[&](Lane& lane, int ray_index)
+			{
+				Ray& bounded_ray = rays[ray_index];
+				visit_node(lane.current_node_index);
+				const BVH_LinearNode& node = nodes[lane.current_node_index];
+				float t_entry;
+				bool is_hit = node.bounding_volume.intersects_with_ray(bounded_ray, bounded_ray.direction_reciprocal, lane.ray_direction_is_negative, (float)bounded_ray.t_max, t_entry);
+				if (is_hit && (node.primitive_count == 0))	// case: we are at interior node, visit the nearer child next and the farther child later
+				{
+					if (lane.ray_direction_is_negative[node.split_axis])
+					{
+						lane.nodes_to_visit[lane.nodes_to_visit_count++] = lane.current_node_index + 1;
+						lane.current_node_index = node.second_child_index;
+					}
+					else
+					{
+						lane.nodes_to_visit[lane.nodes_to_visit_count++] = node.second_child_index;
+						lane.current_node_index = lane.current_node_index + 1;
+					}
+				}
+				else
+				{
+					if (is_hit)		// case: we are at leaf node
+					{
+						intersect_leaf(ray_index, node.first_primitive_index, (int)node.primitive_count, bounded_ray);
+					}
+					if (lane.nodes_to_visit_count == 0)
+					{
+						return false;
+					}
+					lane.current_node_index = lane.nodes_to_visit[--lane.nodes_to_visit_count];
+				}
+				prefetch_node(nodes + lane.current_node_index);
+				return true;
 			}
-			// case: has intersection with the box:
-			if ((node->left == nullptr) && (node->right == nullptr))	// case: we are at leaf node
+		);
+	}
+
+	struct BVH_BuildPrimitives
+	// What the builder needs to know about the primitives, computed once (in parallel) so that we don't call the virtual Get3DAABB() over and over.
+	// The builder itself only moves indices into these arrays around.
+	{
+		template <typename PrimitiveSet>
+		BVH_BuildPrimitives(const PrimitiveSet& primitives)
+		{
+			bounding_volumes.resize(primitives.GetPrimitiveCount());
+			centroids.resize(primitives.GetPrimitiveCount());
+			areas.resize(primitives.GetPrimitiveCount());
+			std::for_each(std::execution::par, bounding_volumes.begin(), bounding_volumes.end(),
+				[&](AABB_3D& bounding_volume)
+				{
+					int i = (int)(&bounding_volume - bounding_volumes.data());
+					bounding_volume = primitives.GetPrimitiveAABB(i);
+					centroids[i] = bounding_volume.center_vector();
+					areas[i] = primitives.GetPrimitiveArea(i);
+				}
+			);
+		}
+
+		std::vector<AABB_3D> bounding_volumes;
+		std::vector<glm::vec3> centroids;
+		std::vector<float> areas;
+	};
+
+	template <int Width>
+	struct alignas(64) BVH_WideNode		// a whole number of cache lines
+	// A node of a BVH collapsed to Width children per node. The bounding volumes of all the children are stored
+	// in the node itself, so one SIMD test tells us which children the ray enters.
+	{
+		AABB_3D_SoA<Width> children_bounding_volumes;	// the unused slots hold boxes that contain nothing, so that they never get hit
+		std::array<int, Width> child_index;				// interior child: index of its BVH_WideNode; leaf child: its first primitive index; -1: unused slot
+		std::array<uint16_t, Width> child_primitive_count;	// 0 for interior children
+
+		void set_children_bounding_volumes(const std::array<AABB_3D, Width>& bounding_volumes)
+		{
+			for (int lane = 0; lane < Width; lane++)
 			{
-				return node->entity->GetIntersectionRecord(ray);
+				children_bounding_volumes.set(lane, bounding_volumes[lane]);
 			}
-			// we are not at leaf node:
-			Whitted::IntersectionRecord left_part = traverse_BVH_from_node(node->left, ray);
-			Whitted::IntersectionRecord right_part = traverse_BVH_from_node(node->right, ray);
+		}
 
-			return (left_part.t < right_part.t) ? (left_part) : (right_part);
+		int intersects_with_ray(const Ray& ray, const std::array<int, 3>& ray_direction_is_negative, float t_max, std::array<float, Width>& t_entry) const
+		{
+			return children_bounding_volumes.intersects_with_ray(ray, ray.direction_reciprocal, ray_direction_is_negative, t_max, t_entry);
 		}
+	};
 
-		void Sampling_from_root(Whitted::IntersectionRecord& sample, float& PDF)
+	template <int Width>
+	struct alignas(64) BVH_CompressedWideNode
+	// The same node with the bounding volumes of the children quantized to 8 bits per slab, relative to the box of the node itself
+	// (see Ylitie et al. 2017, "Efficient Incoherent Ray Traversal on GPUs Through Compressed Wide BVHs"). The grid spacing along
+	// each axis is a power of two, so a grid coordinate converts back to exactly the float we checked while quantizing.
+	// The quantized boxes are rounded outwards, hence always contain the exact ones: the traversal may visit a few more
+	// children than with BVH_WideNode, but never misses one.
+	{
+		glm::vec3 origin;							// the min corner of the box of the node
+		std::array<int8_t, 3> exponents;			// slab value = origin + quantized slab value * 2^exponent
+		uint8_t padding;
+		std::array<uint8_t, Width> quantized_min_x;	// an unused slot (or a child that contains nothing) has min 255 and max 0, and is never hit
+		std::array<uint8_t, Width> quantized_min_y;
+		std::array<uint8_t, Width> quantized_min_z;
+		std::array<uint8_t, Width> quantized_max_x;
+		std::array<uint8_t, Width> quantized_max_y;
+		std::array<uint8_t, Width> quantized_max_z;
+		std::array<int, Width> child_index;
+		std::array<uint16_t, Width> child_primitive_count;
+
+		static float dequantize(float origin_value, int quantized_value, float scale)
+		// quantized_value * scale is exact (8 significant bits at most, and scale is a power of two), so the only rounding is in the addition
 		{
-			Sampling_from_node(root, Whitted::get_random_float_0_1() * root->mesh_area, sample, PDF);	// TODO: do we need to sqrt the random float?
-			PDF = 1.0f / (root->mesh_area);
+			return origin_value + (float)quantized_value * scale;
 		}
 
-	public:		// public data members:
-		BVH_Node* root = nullptr;
+		void set_children_bounding_volumes(const std::array<AABB_3D, Width>& bounding_volumes)
+		{
+			AABB_3D node_bounding_volume;
+			for (const AABB_3D& bounding_volume : bounding_volumes)
+			{
+				if (!bounding_volume.is_empty())
+				{
+					node_bounding_volume = node_bounding_volume.Union_with_3D_AABB(bounding_volume);
+				}
+			}
+			origin = node_bounding_volume.is_empty() ? glm::vec3{ 0.0f } : node_bounding_volume.min_slab_values;
+
+			std::array<std::array<uint8_t, Width>*, 3> quantized_mins{ &quantized_min_x, &quantized_min_y, &quantized_min_z };
+			std::array<std::array<uint8_t, Width>*, 3> quantized_maxs{ &quantized_max_x, &quantized_max_y, &quantized_max_z };
+			for (int axis = X_axis; axis <= Z_axis; axis++)
+			{
+				float extent = node_bounding_volume.is_empty() ? 0.0f : (node_bounding_volume.max_slab_values[axis] - origin[axis]);
+				// the smallest grid spacing 2^exponent with 255 * 2^exponent >= extent:
+				int exponent = (extent > 0.0f) ? (int)std::ceil(std::log2(extent / 255.0f)) : (-126);
+				exponent = std::clamp(exponent, -126, 127);
+				while (true)	// rounding in dequantize() may still leave the last grid line a little short, then we take the next larger spacing
+				{
+					float scale = power_of_two(exponent);
+					bool is_conservative = true;
+					for (int lane = 0; lane < Width; lane++)
+					{
+						if (bounding_volumes[lane].is_empty())
+						{
+							(*quantized_mins[axis])[lane] = 255;
+							(*quantized_maxs[axis])[lane] = 0;
+							continue;
+						}
+						int quantized_min = std::clamp((int)std::floor((bounding_volumes[lane].min_slab_values[axis] - origin[axis]) / scale), 0, 255);
+						int quantized_max = std::clamp((int)std::ceil((bounding_volumes[lane].max_slab_values[axis] - origin[axis]) / scale), 0, 255);
+						while ((quantized_min > 0) && (dequantize(origin[axis], quantized_min, scale) > bounding_volumes[lane].min_slab_values[axis]))
+						{
+							quantized_min--;
+						}
+						while ((quantized_max < 255) && (dequantize(origin[axis], quantized_max, scale) < bounding_volumes[lane].max_slab_values[axis]))
+						{
+							quantized_max++;
+						}
+						is_conservative = is_conservative && (dequantize(origin[axis], quantized_min, scale) <= bounding_volumes[lane].min_slab_values[axis])
+							&& (dequantize(origin[axis], quantized_max, scale) >= bounding_volumes[lane].max_slab_values[axis]);
+						(*quantized_mins[axis])[lane] = (uint8_t)quantized_min;
+						(*quantized_maxs[axis])[lane] = (uint8_t)quantized_max;
+					}
+					if (is_conservative || (exponent == 127))
+					{
+						break;
+					}
+					exponent++;
+				}
+				exponents[axis] = (int8_t)exponent;
+			}
+		}
 
-	private:
+		static float power_of_two(int exponent)
+		// 2^exponent for exponent in [-126, 127], built from the bits of the float rather than with std::ldexp, since the traversal calls this a lot
+		{
+			uint32_t bits = (uint32_t)(exponent + 127) << 23;
+			float value;
+			std::memcpy(&value, &bits, sizeof(value));
+			return value;
+		}
 
-		void Sampling_from_node(BVH_Node* node, float probabilistic_area, Whitted::IntersectionRecord& sample, float& PDF)
+		int intersects_with_ray(const Ray& ray, const std::array<int, 3>& ray_direction_is_negative, float t_max, std::array<float, Width>& t_entry) const
+		// Decompress the child boxes (the loops are straight-line float math the compiler vectorizes), then run the same SIMD test as BVH_WideNode.
 		{
-			if ((node->left == nullptr) && (node->right == nullptr))
+			std::array<float, 3> scales{ power_of_two(exponents[0]), power_of_two(exponents[1]), power_of_two(exponents[2]) };
+			AABB_3D_SoA<Width> children_bounding_volumes{ AABB_3D_SoA<Width>::uninitialized };
+			for (int lane = 0; lane < Width; lane++)
 			{
-				node->entity->Sampling(sample, PDF);
-				return;
+				children_bounding_volumes.min_x[lane] = dequantize(origin.x, quantized_min_x[lane], scales[0]);
+				children_bounding_volumes.min_y[lane] = dequantize(origin.y, quantized_min_y[lane], scales[1]);
+				children_bounding_volumes.min_z[lane] = dequantize(origin.z, quantized_min_z[lane], scales[2]);
+				children_bounding_volumes.max_x[lane] = dequantize(origin.x, quantized_max_x[lane], scales[0]);
+				children_bounding_volumes.max_y[lane] = dequantize(origin.y, quantized_max_y[lane], scales[1]);
+				children_bounding_volumes.max_z[lane] = dequantize(origin.z, quantized_max_z[lane], scales[2]);
 			}
-			if (probabilistic_area < (node->left->mesh_area))
+			return children_bounding_volumes.intersects_with_ray(ray, ray.direction_reciprocal, ray_direction_is_negative, t_max, t_entry);
+		}
+	};
+
+	template <int Width, typename WideNode = BVH_WideNode<Width>>
+	class WideBVH
+	// Built by collapsing a finished binary BVH, and traversed with the primitives of that binary BVH.
+	{
+	public:
+		WideBVH(const std::vector<BVH_LinearNode>& binary_nodes)
+		{
+			if (binary_nodes.empty())
 			{
-				Sampling_from_node(node->left, probabilistic_area, sample, PDF);
+				return;
 			}
-			else
+			m_nodes.reserve(binary_nodes.size() / (Width - 1) + 1);
+			m_binary_children.reserve(binary_nodes.size() / (Width - 1) + 1);
+			if (binary_nodes[0].primitive_count > 0)	// case: the whole tree is a single leaf
 			{
-				Sampling_from_node(node->right, probabilistic_area - (node->left->mesh_area), sample, PDF);
+				m_nodes.emplace_back();
+				m_binary_children.emplace_back();
+				m_binary_children[0].fill(-1);
+				m_binary_children[0][0] = 0;
+				m_nodes[0].child_index.fill(-1);
+				m_nodes[0].child_primitive_count.fill(0);
+				m_nodes[0].child_index[0] = binary_nodes[0].first_primitive_index;
+				m_nodes[0].child_primitive_count[0] = binary_nodes[0].primitive_count;
+				refit_node(m_nodes[0], m_binary_children[0], binary_nodes);
+				return;
 			}
+			collapse(binary_nodes, 0);
 		}
 
-		BVH_Node* build_BVH(std::vector<Whitted::Entity*> entities)
-		// Assume entities.size() != 0
+		template <typename IntersectLeaf>
+		void closest_hit_with(const Ray& ray, IntersectLeaf&& intersect_leaf) const
+		// The same query as BVH::closest_hit_with: children are visited nearest-first, and anything beyond the closest hit is skipped.
+		// intersect_leaf(first_primitive_index, primitive_count, bounded_ray) tests the primitives of a leaf, and shrinks bounded_ray.t_max to any closer hit.
 		{
-			/*
-			TODO:
-			stop when each node has less than 5 primitives (right now we stop at 1)
-			*/
+			closest_hit_with(ray, intersect_leaf, [](int) {});
+		}
 
-			BVH_Node* local_root = new BVH_Node();
-			if (entities.size() == 1)	// leaf node
+		template <typename IntersectLeaf, typename VisitNode>
+		void closest_hit_with(const Ray& ray, IntersectLeaf&& intersect_leaf, VisitNode&& visit_node) const
+		// visit_node(node_index) is called for every node the traversal tests the children of (e.g. to count how often each node is visited).
+		{
+			if (m_nodes.empty())
 			{
-				local_root->left = nullptr;
-				local_root->right = nullptr;
-				local_root->entity = entities[0];
-				local_root->bounding_volume = entities[0]->Get3DAABB();
-				local_root->mesh_area = entities[0]->GetArea();
-
-				return local_root;
+				return;
 			}
-			else if (entities.size() == 2)
+
+			std::array<int, 3> ray_direction_is_negative{ray.m_direction.x < 0.0f, ray.m_direction.y < 0.0f, ray.m_direction.z < 0.0f};
+			Ray bounded_ray = ray;
+
+			std::array<StackEntry, traversal_stack_size> entries_to_visit;
+			int entries_to_visit_count = 0;
+			entries_to_visit[entries_to_visit_count++] = StackEntry{ 0, 0, -std::numeric_limits<float>::max() };
+
+			while (entries_to_visit_count > 0)
 			{
-				local_root->left = build_BVH(std::vector<Whitted::Entity*>{entities[0]});
-				local_root->right = build_BVH(std::vector<Whitted::Entity*>{entities[1]});
-				// local_root->entity remains nullptr
-				local_root->bounding_volume = local_root->left->bounding_volume.Union_with_3D_AABB(local_root->right->bounding_volume);
-				local_root->mesh_area = local_root->left->mesh_area + local_root->right->mesh_area;
+				StackEntry entry = entries_to_visit[--entries_to_visit_count];
+				if (entry.t_entry > bounded_ray.t_max)	// a closer hit has been found since the entry was pushed
+				{
+					continue;
+				}
+				if (entry.primitive_count > 0)	// case: leaf
+				{
+					intersect_leaf(entry.index, entry.primitive_count, bounded_ray);
+					continue;
+				}
+
+				// case: interior node, push the children that are hit from the farthest to the nearest, so that the nearest is visited next
+				visit_node(entry.index);
+				const WideNode& node = m_nodes[entry.index];
+				std::array<float, Width> t_entry;
+				int hit_mask = node.intersects_with_ray(ray, ray_direction_is_negative, (float)bounded_ray.t_max, t_entry);
+				int first_pushed = entries_to_visit_count;
+				for (int lane = 0; lane < Width; lane++)
+				{
+					if (!(hit_mask & (1 << lane)))
+					{
+						continue;
+					}
+					// insertion sort (descending t_entry) into the entries pushed for this node:
+					int position = entries_to_visit_count++;
+					while ((position > first_pushed) && (entries_to_visit[position - 1].t_entry < t_entry[lane]))
+					{
+						entries_to_visit[position] = entries_to_visit[position - 1];
+						position--;
+					}
+					entries_to_visit[position] = StackEntry{ node.child_index[lane], node.child_primitive_count[lane], t_entry[lane] };
+				}
+			}
+		}
 
-				return local_root;
+		template <typename IntersectLeaf, typename VisitNode>
+		void interleaved_closest_hits_with(Ray* rays, int ray_count, IntersectLeaf&& intersect_leaf, VisitNode&& visit_node) const
+		// closest_hit_with() for each of the rays rays[0, ray_count), see AccelerationStructure::interleave_traversals(). A step of a lane
+		// takes the entry on top of its stack, and prefetches the node of the entry on top afterwards. The t_max of the rays shrinks to their closest hits.
+		// intersect_leaf(ray_index, first_primitive_index, primitive_count, bounded_ray).
+		{
+			if (m_nodes.empty())
+			{
+				return;
 			}
-			else
+			struct Lane
 			{
-				AABB_3D AABB_of_all_centroids;	// contains nothing at this point
-				for (int i = 0; i < entities.size(); i++)
+				std::array<int, 3> ray_direction_is_negative;
+				int entries_to_visit_count;
+				std::array<StackEntry, traversal_stack_size> entries_to_visit;
+			};
+
+			interleave_traversals<Lane>(ray_count,
+				[&](Lane& lane, int ray_index)
 				{
-					AABB_of_all_centroids = AABB_of_all_centroids.Union_with_point(entities[i]->Get3DAABB().center_vector());
-					// We use AABB of centroids instead of entities' own AABBs because we want partitions according to
-					// entities' number, and thus we don't care about the shape of each entity.
-				}
-				switch (AABB_of_all_centroids.longest_axis())
+					const Ray& ray = rays[ray_index];
+					lane.ray_direction_is_negative = { ray.m_direction.x < 0.0f, ray.m_direction.y < 0.0f, ray.m_direction.z < 0.0f };
+					lane.entries_to_visit_count = 0;
+					lane.entries_to_visit[lane.entries_to_visit_count++] = StackEntry{ 0, 0, -std::numeric_limits<float>::max() };
+				},
+				[&](Lane& lane, int ray_index)
 				{
-					// sort from small to large (see https://cplusplus.com/reference/algorithm/sort/)
-				case X_axis:
-					std::sort(entities.begin(), entities.end(),
-						[](Whitted::Entity* a, Whitted::Entity* b)
+					Ray& bounded_ray = rays[ray_index];
+					StackEntry entry = lane.entries_to_visit[--lane.entries_to_visit_count];
+					if (entry.t_entry > bounded_ray.t_max)	// a closer hit has been found since the entry was pushed
+					{
+						// skip it
+					}
+					else if (entry.primitive_count > 0)	// case: leaf
+					{
+						intersect_leaf(ray_index, entry.index, entry.primitive_count, bounded_ray);
+					}
+					else	// case: interior node, see closest_hit_with()
+					{
+						visit_node(entry.index);
+						const WideNode& node = m_nodes[entry.index];
+						std::array<float, Width> t_entry;
+						int hit_mask = node.intersects_with_ray(bounded_ray, lane.ray_direction_is_negative, (float)bounded_ray.t_max, t_entry);
+						int first_pushed = lane.entries_to_visit_count;
+						for (int child = 0; child < Width; child++)
 						{
-							return (a->Get3DAABB().center_vector().x < b->Get3DAABB().center_vector().x);
+							if (!(hit_mask & (1 << child)))
+							{
+								continue;
+							}
+							int position = lane.entries_to_visit_count++;
+							while ((position > first_pushed) && (lane.entries_to_visit[position - 1].t_entry < t_entry[child]))
+							{
+								lane.entries_to_visit[position] = lane.entries_to_visit[position - 1];
+								position--;
+							}
+							lane.entries_to_visit[position] = StackEntry{ node.child_index[child], node.child_primitive_count[child], t_entry[child] };
 						}
-					);
-					break;
-				case Y_axis:
-					std::sort(entities.begin(), entities.end(),
-						[](Whitted::Entity* a, Whitted::Entity* b)
+					}
+					if (lane.entries_to_visit_count == 0)
+					{
+						return false;
+					}
+					const StackEntry& next_entry = lane.entries_to_visit[lane.entries_to_visit_count - 1];
+					if (next_entry.primitive_count == 0)
+					{
+						prefetch_node(m_nodes.data() + next_entry.index);
+					}
+					return true;
+				}
+			);
+		}
+
+		template <typename IntersectLeaf>
+		bool any_hit_with(const Ray& ray, double maximum_t, IntersectLeaf&& intersects_leaf) const
+		// The same query as BVH::any_hit_with. intersects_leaf(first_primitive_index, primitive_count) returns whether any primitive of a leaf is hit.
+		{
+			return any_hit_with(ray, maximum_t, intersects_leaf, [](int) {});
+		}
+
+		template <typename IntersectLeaf, typename VisitNode>
+		bool any_hit_with(const Ray& ray, double maximum_t, IntersectLeaf&& intersects_leaf, VisitNode&& visit_node) const
+		{
+			if (m_nodes.empty())
+			{
+				return false;
+			}
+
+			std::array<int, 3> ray_direction_is_negative{ray.m_direction.x < 0.0f, ray.m_direction.y < 0.0f, ray.m_direction.z < 0.0f};
+
+			std::array<StackEntry, traversal_stack_size> entries_to_visit;
+			int entries_to_visit_count = 0;
+			entries_to_visit[entries_to_visit_count++] = StackEntry{ 0, 0, 0.0f };
+
+			while (entries_to_visit_count > 0)
+			{
+				StackEntry entry = entries_to_visit[--entries_to_visit_count];
+				if (entry.primitive_count > 0)
+				{
+					if (intersects_leaf(entry.index, entry.primitive_count))
+					{
+						return true;
+					}
+					continue;
+				}
+
+				visit_node(entry.index);
+				const WideNode& node = m_nodes[entry.index];
+				std::array<float, Width> t_entry;
+				int hit_mask = node.intersects_with_ray(ray, ray_direction_is_negative, (float)maximum_t, t_entry);
+				for (int lane = 0; lane < Width; lane++)
+				{
+					if (hit_mask & (1 << lane))
+					{
+						entries_to_visit[entries_to_visit_count++] = StackEntry{ node.child_index[lane], node.child_primitive_count[lane], t_entry[lane] };
+					}
+				}
+			}
+
+			return false;
+		}
+
+		const std::vector<WideNode>& GetNodes() const
+		{
+			return m_nodes;
+		}
+
+		size_t GetMemoryInBytes() const
+		// Of the nodes the ray queries walk through (the table used for refitting is not counted).
+		{
+			return m_nodes.size() * sizeof(WideNode);
+		}
+
+		void refit(const std::vector<BVH_LinearNode>& binary_nodes)
+		// Copy the (refitted) bounding volumes of the binary nodes the wide nodes were collapsed from. The topology stays the same.
+		{
+			std::for_each(std::execution::par, m_nodes.begin(), m_nodes.end(),
+				[&](WideNode& node)
+				{
+					refit_node(node, m_binary_children[&node - m_nodes.data()], binary_nodes);
+				}
+			);
+		}
+
+		// The order of the nodes in memory decides how many cache lines (and pages) a traversal touches. The root stays at m_nodes[0]:
+
+		void reorder_depth_first()
+		// Pre-order, i.e. the order collapse() creates the nodes in: a node is followed by the subtree of its first interior child.
+		{
+			std::vector<int> order;
+			order.reserve(m_nodes.size());
+			std::vector<int> nodes_to_visit{ 0 };
+			while (!nodes_to_visit.empty())
+			{
+				int node_index = nodes_to_visit.back();
+				nodes_to_visit.pop_back();
+				order.push_back(node_index);
+				for (int lane = Width - 1; lane >= 0; lane--)
+				{
+					if (is_interior_child(m_nodes[node_index], lane))
+					{
+						nodes_to_visit.push_back(m_nodes[node_index].child_index[lane]);
+					}
+				}
+			}
+			apply_order(order);
+		}
+
+		void reorder_van_Emde_Boas()
+		// The cache-oblivious layout: cut the tree at half its height, lay out the top tree, then each of the bottom trees, all recursively
+		// the same way. Whatever the size of a cache line or a page, a root-to-leaf path then touches only O(log_B(n)) blocks of B nodes.
+		{
+			if (m_nodes.empty())
+			{
+				return;
+			}
+			std::vector<int> order;
+			order.reserve(m_nodes.size());
+			lay_out_van_Emde_Boas(0, subtree_height(0), order);
+			apply_order(order);
+		}
+
+		void reorder_treelets(const std::vector<float>& node_weights, int nodes_per_treelet)
+		// Pack the tree into treelets of nodes_per_treelet nodes that sit next to each other in memory: starting from the root of a treelet,
+		// repeatedly add the heaviest (e.g. most often visited) node adjacent to the treelet, and once it is full, the nodes still adjacent
+		// to it become the roots of the next treelets. The hot paths from the root then run through few blocks (Aila & Karras 2010).
+		{
+			if (m_nodes.empty())
+			{
+				return;
+			}
+			std::vector<int> order;
+			order.reserve(m_nodes.size());
+			std::deque<int> treelet_roots{ 0 };
+			while (!treelet_roots.empty())
+			{
+				std::priority_queue<std::pair<float, int>> adjacent_nodes;	// the heaviest on top
+				adjacent_nodes.push({ node_weights[treelet_roots.front()], treelet_roots.front() });
+				treelet_roots.pop_front();
+				for (int treelet_size = 0; (treelet_size < nodes_per_treelet) && (!adjacent_nodes.empty()); treelet_size++)
+				{
+					int node_index = adjacent_nodes.top().second;
+					adjacent_nodes.pop();
+					order.push_back(node_index);
+					for (int lane = 0; lane < Width; lane++)
+					{
+						if (is_interior_child(m_nodes[node_index], lane))
 						{
-							return (a->Get3DAABB().center_vector().y < b->Get3DAABB().center_vector().y);
+							adjacent_nodes.push({ node_weights[m_nodes[node_index].child_index[lane]], m_nodes[node_index].child_index[lane] });
 						}
-					);
-					break;
-				case Z_axis:
-					std::sort(entities.begin(), entities.end(),
-						[](Whitted::Entity* a, Whitted::Entity* b)
+					}
+				}
+				for (; !adjacent_nodes.empty(); adjacent_nodes.pop())
+				{
+					treelet_roots.push_back(adjacent_nodes.top().second);
+				}
+			}
+			apply_order(order);
+		}
+
+		std::vector<float> get_surface_area_weights(const std::vector<BVH_LinearNode>& binary_nodes) const
+		// The surface area of the box of every node: proportional to the probability that a random ray through the root visits it.
+		{
+			std::vector<float> node_weights(m_nodes.size(), 0.0f);
+			if (!m_nodes.empty())
+			{
+				node_weights[0] = std::numeric_limits<float>::max();
+			}
+			for (int node_index = 0; node_index < (int)m_nodes.size(); node_index++)
+			{
+				for (int lane = 0; lane < Width; lane++)
+				{
+					if (is_interior_child(m_nodes[node_index], lane))
+					{
+						node_weights[m_nodes[node_index].child_index[lane]] = (float)binary_nodes[m_binary_children[node_index][lane]].bounding_volume.total_area();
+					}
+				}
+			}
+			return node_weights;
+		}
+
+		template <typename IntersectLeaf>
+		std::vector<float> get_visit_counts(const std::vector<Ray>& rays, const IntersectLeaf& intersect_leaf) const
+		// How often tracing the rays (closest hit, see closest_hit_with()) visits each node.
+		{
+			std::vector<std::atomic<int>> visit_counts(m_nodes.size());
+			std::for_each(std::execution::par, rays.begin(), rays.end(),
+				[&](const Ray& ray)
+				{
+					closest_hit_with(ray, intersect_leaf,
+						[&](int node_index)
 						{
-							return (a->Get3DAABB().center_vector().z < b->Get3DAABB().center_vector().z);
+							visit_counts[node_index].fetch_add(1, std::memory_order_relaxed);
 						}
 					);
-					break;
 				}
+			);
+			return std::vector<float>(visit_counts.begin(), visit_counts.end());
+		}
+
+	private:
 
-				auto iterator_head = entities.begin();
-				auto iterator_median = entities.begin() + (entities.size() / 2);
-				auto iterator_tail = entities.end();
+		static bool is_interior_child(const WideNode& node, int lane)
+		{
+			return (node.child_index[lane] >= 0) && (node.child_primitive_count[lane] == 0);
+		}
+
+		int subtree_height(int node_index) const
+		// in wide nodes, a node whose children are all leaves has height 1
+		{
+			int height = 0;
+			for (int lane = 0; lane < Width; lane++)
+			{
+				if (is_interior_child(m_nodes[node_index], lane))
+				{
+					height = std::max(height, subtree_height(m_nodes[node_index].child_index[lane]));
+				}
+			}
+			return height + 1;
+		}
 
-				std::vector<Whitted::Entity*> left_half = std::vector<Whitted::Entity*>(iterator_head, iterator_median);
-				std::vector<Whitted::Entity*> right_half = std::vector<Whitted::Entity*>(iterator_median, iterator_tail);
+		void lay_out_van_Emde_Boas(int node_index, int height, std::vector<int>& order) const
+		// Append the nodes of the subtree of node_index that are less than height levels below it.
+		{
+			if (height == 1)
+			{
+				order.push_back(node_index);
+				return;
+			}
+			int top_height = height / 2;
+			lay_out_van_Emde_Boas(node_index, top_height, order);
 
-				local_root->left = build_BVH(left_half);
-				local_root->right = build_BVH(right_half);
+			// the roots of the bottom trees are the nodes exactly top_height levels below node_index:
+			std::vector<int> bottom_roots{ node_index };
+			for (int level = 0; level < top_height; level++)
+			{
+				std::vector<int> next_level;
+				for (int parent : bottom_roots)
+				{
+					for (int lane = 0; lane < Width; lane++)
+					{
+						if (is_interior_child(m_nodes[parent], lane))
+						{
+							next_level.push_back(m_nodes[parent].child_index[lane]);
+						}
+					}
+				}
+				bottom_roots.swap(next_level);
+			}
+			for (int bottom_root : bottom_roots)
+			{
+				lay_out_van_Emde_Boas(bottom_root, height - top_height, order);
+			}
+		}
 
-				local_root->bounding_volume = local_root->left->bounding_volume.Union_with_3D_AABB(local_root->right->bounding_volume);
+		void apply_order(const std::vector<int>& order)
+		// order[new index] = old index, with order[0] = 0 (the root)
+		{
+			std::vector<int> new_indices(m_nodes.size());
+			for (int new_index = 0; new_index < (int)order.size(); new_index++)
+			{
+				new_indices[order[new_index]] = new_index;
+			}
+			std::vector<WideNode> ordered_nodes(m_nodes.size());
+			std::vector<std::array<int, Width>> ordered_binary_children(m_nodes.size());
+			for (int new_index = 0; new_index < (int)order.size(); new_index++)
+			{
+				ordered_nodes[new_index] = m_nodes[order[new_index]];
+				ordered_binary_children[new_index] = m_binary_children[order[new_index]];
+				for (int lane = 0; lane < Width; lane++)
+				{
+					if (is_interior_child(ordered_nodes[new_index], lane))
+					{
+						ordered_nodes[new_index].child_index[lane] = new_indices[ordered_nodes[new_index].child_index[lane]];
+					}
+				}
+			}
+			m_nodes.swap(ordered_nodes);
+			m_binary_children.swap(ordered_binary_children);
+		}
 
-				local_root->mesh_area = local_root->left->mesh_area + local_root->right->mesh_area;
+		struct StackEntry
+		{
+			int index;				// the same meaning as BVH_WideNode::child_index
+			int primitive_count;	// the same meaning as BVH_WideNode::child_primitive_count
+			float t_entry;
+		};
 
-				return local_root;
+		static void refit_node(WideNode& node, const std::array<int, Width>& binary_children, const std::vector<BVH_LinearNode>& binary_nodes)
+		{
+			std::array<AABB_3D, Width> bounding_volumes;	// the unused slots contain nothing
+			for (int lane = 0; lane < Width; lane++)
+			{
+				if (binary_children[lane] >= 0)
+				{
+					bounding_volumes[lane] = binary_nodes[binary_children[lane]].bounding_volume;
+				}
 			}
+			node.set_children_bounding_volumes(bounding_volumes);
 		}
 
-		// private data members:
-		std::vector<Whitted::Entity*> m_primitives;
+		int collapse(const std::vector<BVH_LinearNode>& binary_nodes, int binary_node_index)
+		// Turn the interior binary node into a wide node, by repeatedly replacing the interior child with the largest
+		// surface area by its own two children until we have Width children (or only leaves left).
+		// Returns the index of the new wide node.
+		{
+			int wide_node_index = (int)m_nodes.size();
+			m_nodes.emplace_back();
+			m_binary_children.emplace_back();
+			m_binary_children[wide_node_index].fill(-1);
+			m_nodes[wide_node_index].child_index.fill(-1);
+			m_nodes[wide_node_index].child_primitive_count.fill(0);
+
+			std::array<int, Width> children;
+			int children_count = 0;
+			children[children_count++] = binary_node_index + 1;
+			children[children_count++] = binary_nodes[binary_node_index].second_child_index;
+			while (children_count < Width)
+			{
+				int largest = -1;
+				double largest_area = -1.0;
+				for (int i = 0; i < children_count; i++)
+				{
+					const BVH_LinearNode& child = binary_nodes[children[i]];
+					if ((child.primitive_count == 0) && (child.bounding_volume.total_area() > largest_area))
+					{
+						largest = i;
+						largest_area = child.bounding_volume.total_area();
+					}
+				}
+				if (largest < 0)	// only leaves left
+				{
+					break;
+				}
+				int opened = children[largest];
+				children[largest] = opened + 1;
+				children[children_count++] = binary_nodes[opened].second_child_index;
+			}
+
+			for (int lane = 0; lane < children_count; lane++)
+			{
+				const BVH_LinearNode& child = binary_nodes[children[lane]];
+				m_binary_children[wide_node_index][lane] = children[lane];
+				if (child.primitive_count > 0)
+				{
+					m_nodes[wide_node_index].child_index[lane] = child.first_primitive_index;
+					m_nodes[wide_node_index].child_primitive_count[lane] = child.primitive_count;
+				}
+				else
+				{
+					int child_wide_node_index = collapse(binary_nodes, children[lane]);	// note that this may reallocate m_nodes
+					m_nodes[wide_node_index].child_index[lane] = child_wide_node_index;
+				}
+			}
+			refit_node(m_nodes[wide_node_index], m_binary_children[wide_node_index], binary_nodes);
+			return wide_node_index;
+		}
+
+		// Data members:
+		std::vector<WideNode> m_nodes;		// m_nodes[0] is the root
+		std::vector<std::array<int, Width>> m_binary_children;	// for refitting: the binary node each child slot was collapsed from (-1: unused slot)
+
+		static constexpr int traversal_stack_size = 64 * (Width - 1) + 1;	// the binary tree is at most 64 deep, and each level pushes at most Width - 1 more entries than it pops
+	};
+
+	template <int Width>
+	using CompressedWideBVH = WideBVH<Width, BVH_CompressedWideNode<Width>>;
+
+	class BVH_PrimitiveSet
+	// What a BVH is built over. The BVH only knows primitive i in [0, GetPrimitiveCount()) by its index, and asks for its bounding volume
+	// and area when (re)building, refitting and sampling, never during the ray queries. That lets e.g. a TriangleMesh keep its triangles
+	// in plain arrays, and test the triangles of a leaf by index with BVH::closest_hit_with() rather than through an Entity each.
+	{
+	public:
+		virtual ~BVH_PrimitiveSet() = default;
+
+		virtual int GetPrimitiveCount() const = 0;
+		virtual AABB_3D GetPrimitiveAABB(int primitive_index) const = 0;
+		virtual float GetPrimitiveArea(int primitive_index) const = 0;
+		virtual AABB_3D GetClippedPrimitiveAABB(int primitive_index, const AABB_3D& box) const = 0;	// for spatial splits, see Entity::GetClippedAABB()
+	};
+
+	class BVH_EntitySet : public BVH_PrimitiveSet
+	// The primitives are Entities, which answer the ray queries themselves (e.g. the entities of the scene BVH).
+	{
+	public:
+		BVH_EntitySet(std::vector<Whitted::Entity*> entities)
+			: m_entities(std::move(entities))
+		{
+		}
+
+		virtual int GetPrimitiveCount() const override
+		{
+			return (int)m_entities.size();
+		}
+
+		virtual AABB_3D GetPrimitiveAABB(int primitive_index) const override
+		{
+			return m_entities[primitive_index]->Get3DAABB();
+		}
+
+		virtual float GetPrimitiveArea(int primitive_index) const override
+		{
+			return m_entities[primitive_index]->GetArea();
+		}
+
+		virtual AABB_3D GetClippedPrimitiveAABB(int primitive_index, const AABB_3D& box) const override
+		{
+			return m_entities[primitive_index]->GetClippedAABB(box);
+		}
+
+		const std::vector<Whitted::Entity*>& GetEntities() const
+		{
+			return m_entities;
+		}
+
+	private:
+		std::vector<Whitted::Entity*> m_entities;
+	};
+
+	struct BVH_Hierarchy
+	// What a build leaves behind for a BVH over a BVH_PrimitiveSet, see BVH::GetNodes() and the like. Enough to restore the BVH
+	// without building it again (e.g. from a scene snapshot), as long as the primitives are the same.
+	{
+		std::vector<int> primitive_indices;
+		std::vector<BVH_LinearNode> nodes;
+		std::vector<float> node_mesh_areas;
+		std::vector<char> is_duplicate_reference;	// empty unless spatial splits referred to a primitive more than once
+	};
+
+	class BVH
+	{
+	public:
+		enum class DividingMethod
+		{
+			Median,
+			Surface_Area_Heuristic,
+			Linear,		// LBVH: sort the primitives along a Morton curve and split at the Morton code bits, cheap enough to rebuild every frame
+			Spatial_Split_SAH	// SBVH: SAH that may also split space and reference a primitive from both sides, for large or long and thin primitives
+		};
+
+		enum class BranchingFactor
+		{
+			Binary = 2,
+			Four = 4,	// SSE
+			Eight = 8	// AVX
+		};
+
+		enum class NodeLayout	// the order of the wide nodes in memory, see SetNodeLayout()
+		{
+			Depth_First,
+			Van_Emde_Boas,
+			Treelets
+		};
+
+#if defined(BOUNDINGVOLUME_HAS_AVX)
+		static constexpr BranchingFactor default_branching_factor = BranchingFactor::Eight;
+#else
+		static constexpr BranchingFactor default_branching_factor = BranchingFactor::Four;
+#endif
+
+		static constexpr uint32_t builder_version = 1;	// bump this whenever the builders change the trees they build (the scene snapshots store the trees)
+
+		BVH(
+			std::vector<Whitted::Entity*> primitives,
+			DividingMethod dividing_method = DividingMethod::Surface_Area_Heuristic,
+			int maximum_primitives_in_leaf = 4,		// pass 1 (with DividingMethod::Median) to get the one-primitive-per-leaf tree we had before SAH
+			BranchingFactor branching_factor = default_branching_factor,
+			float maximum_reference_duplication = 0.3f	// DividingMethod::Spatial_Split_SAH only: at most this many extra references per primitive (on average)
+		)
+			: BVH(std::make_unique<BVH_EntitySet>(std::move(primitives)), nullptr, dividing_method, maximum_primitives_in_leaf, branching_factor, maximum_reference_duplication)
+		{
+		}
+
+		BVH(
+			const BVH_PrimitiveSet* primitive_set,	// not owned, has to outlive the BVH. Use closest_hit_with() and any_hit_with() for the ray queries, and SamplePrimitive() for sampling
+			DividingMethod dividing_method = DividingMethod::Surface_Area_Heuristic,
+			int maximum_primitives_in_leaf = 4,
+			BranchingFactor branching_factor = default_branching_factor,
+			float maximum_reference_duplication = 0.3f
+		)
+			: BVH(nullptr, primitive_set, dividing_method, maximum_primitives_in_leaf, branching_factor, maximum_reference_duplication)
+		{
+		}
+
+		BVH(
+			const BVH_PrimitiveSet* primitive_set,	// as above
+			BVH_Hierarchy hierarchy,				// built before over the same primitives (with dividing_method, maximum_primitives_in_leaf and maximum_reference_duplication), taken as is
+			DividingMethod dividing_method = DividingMethod::Surface_Area_Heuristic,	// for Rebuild()
+			int maximum_primitives_in_leaf = 4,
+			BranchingFactor branching_factor = default_branching_factor,
+			float maximum_reference_duplication = 0.3f
+		)
+			:
+			m_primitive_set(primitive_set),
+			m_primitive_indices(std::move(hierarchy.primitive_indices)),
+			m_nodes(std::move(hierarchy.nodes)),
+			m_node_mesh_areas(std::move(hierarchy.node_mesh_areas)),
+			m_is_duplicate_reference(std::move(hierarchy.is_duplicate_reference)),
+			m_dividing_method(dividing_method),
+			m_maximum_primitives_in_leaf(std::clamp(maximum_primitives_in_leaf, 1, (int)std::numeric_limits<uint16_t>::max())),
+			m_branching_factor(branching_factor),
+			m_maximum_reference_duplication(std::max(maximum_reference_duplication, 0.0f))
+		{
+			// the rest is derived from the binary nodes, as at the end of Rebuild():
+			group_nodes_by_depth();
+			m_SAH_cost_at_rebuild = GetSAHCost();
+			build_wide_BVH();
+		}
+
+		void Rebuild()
+		// (Re)build the whole hierarchy from the current bounding volumes of the primitives, e.g. after some entities have moved.
+		// Not thread-safe with respect to ray queries on this BVH.
+		{
+			m_primitive_indices.clear();
+			m_primitives.clear();
+			m_same_type_run_lengths.clear();
+			m_is_duplicate_reference.clear();
+			m_nodes.clear();
+			m_node_mesh_areas.clear();
+			m_refit_levels.clear();
+			m_SAH_cost_at_rebuild = 0.0f;
+			m_wide_BVH_4.reset();
+			m_wide_BVH_8.reset();
+			m_compressed_BVH_4.reset();
+			m_compressed_BVH_8.reset();
+
+			int primitive_count = m_primitive_set->GetPrimitiveCount();
+			if (primitive_count == 0)
+			{
+				return;
+			}
+
+			BVH_BuildPrimitives build_primitives{ *m_primitive_set };
+
+			// The builder partitions this index array in place, and every node ends up owning a contiguous range of it.
+			// Subtrees work on disjoint ranges, so they can be built in parallel.
+			std::vector<int> primitive_indices(primitive_count);
+			for (int i = 0; i < (int)primitive_indices.size(); i++)
+			{
+				primitive_indices[i] = i;
+			}
+			std::atomic<int> node_count = 0;
+			BVH_Node* root = nullptr;
+			if (m_dividing_method == DividingMethod::Linear)
+			{
+				root = build_LBVH(build_primitives, primitive_indices, node_count);
+			}
+			else if (m_dividing_method == DividingMethod::Spatial_Split_SAH)
+			{
+				root = build_SBVH(build_primitives, primitive_indices, node_count);	// primitive_indices may come back longer, with repeated primitives
+			}
+			else
+			{
+				root = build_BVH(build_primitives, primitive_indices, 0, (int)primitive_indices.size(), 0, node_count);
+			}
+
+			// Only the first reference to a primitive counts for sampling (and for the mesh areas of the nodes):
+			if ((int)primitive_indices.size() > primitive_count)
+			{
+				std::vector<char> is_referenced(primitive_count, 0);
+				m_is_duplicate_reference.resize(primitive_indices.size());
+				for (int i = 0; i < (int)primitive_indices.size(); i++)
+				{
+					m_is_duplicate_reference[i] = is_referenced[primitive_indices[i]];
+					is_referenced[primitive_indices[i]] = 1;
+				}
+			}
+
+			// The leaves refer to contiguous ranges of the index array, and of the entities ordered the same way:
+			m_primitive_indices.swap(primitive_indices);
+			if (m_entity_set)
+			{
+				m_primitives.resize(m_primitive_indices.size());
+				for (int i = 0; i < (int)m_primitive_indices.size(); i++)
+				{
+					m_primitives[i] = m_entity_set->GetEntities()[m_primitive_indices[i]];
+				}
+			}
+
+			// The pointer tree is only a temporary of the builder:
+			m_nodes.resize(node_count);
+			m_node_mesh_areas.resize(node_count);
+			int next_free_node = 0;
+			flatten_BVH(root, next_free_node);
+			delete root;
+
+			if (m_entity_set)
+			{
+				group_leaf_entities_by_type();
+			}
+			group_nodes_by_depth();
+			m_SAH_cost_at_rebuild = GetSAHCost();
+
+			build_wide_BVH();
+		}
+
+		void SetNodeCompression(bool compress_nodes)
+		// Whether the wide BVH stores the boxes of the children quantized to 8 bits (see BVH_CompressedWideNode), which takes
+		// about a third of the memory per node at the cost of decompressing them during traversal and of visiting a few more nodes.
+		// No effect with BranchingFactor::Binary. Not thread-safe with respect to ray queries on this BVH.
+		{
+			if (m_compress_nodes != compress_nodes)
+			{
+				m_compress_nodes = compress_nodes;
+				build_wide_BVH();
+			}
+		}
+
+		BVH_Statistics GetStatistics() const
+		{
+			BVH_Statistics statistics;
+			statistics.primitive_count = m_primitive_set->GetPrimitiveCount();
+			statistics.reference_count = (int)m_primitive_indices.size();
+			statistics.node_count = (int)m_nodes.size();
+			statistics.maximum_depth = std::max((int)m_refit_levels.size() - 1, 0);
+			statistics.leaf_depth_histogram.resize(m_refit_levels.size(), 0);
+			for (int depth = 0; depth < (int)m_refit_levels.size(); depth++)
+			{
+				for (int node_index : m_refit_levels[depth])
+				{
+					if (m_nodes[node_index].primitive_count > 0)
+					{
+						statistics.leaf_depth_histogram[depth]++;
+						statistics.leaf_count++;
+					}
+				}
+			}
+			for_each_wide_BVH(
+				[&](const auto& wide_BVH)
+				{
+					statistics.wide_node_count = (int)wide_BVH.GetNodes().size();
+				}
+			);
+			statistics.SAH_cost = GetSAHCost();
+			statistics.average_leaf_size = (statistics.leaf_count > 0) ? ((float)statistics.reference_count / statistics.leaf_count) : (0.0f);
+			statistics.reference_duplication = (statistics.primitive_count > 0) ? ((float)(statistics.reference_count - statistics.primitive_count) / statistics.primitive_count) : (0.0f);
+			statistics.node_memory_in_bytes = GetNodeMemoryInBytes();
+			return statistics;
+		}
+
+		void SetTraversalCounting(bool count_traversals)
+		// Whether the ray queries count what they cost (see BVH_TraversalStatistics). Off by default: the counters
+		// are shared by all the threads tracing rays through this BVH, so counting slows the queries down a little.
+		{
+			m_counting_traversals = count_traversals;
+		}
+
+		bool IsCountingTraversals() const
+		{
+			return m_counting_traversals;
+		}
+
+		void ResetTraversalStatistics()
+		{
+			m_traversal_counters.query_count = 0;
+			m_traversal_counters.nodes_visited = 0;
+			m_traversal_counters.box_tests = 0;
+			m_traversal_counters.primitive_tests = 0;
+		}
+
+		BVH_TraversalStatistics GetTraversalStatistics() const
+		{
+			return BVH_TraversalStatistics{ m_traversal_counters.query_count, m_traversal_counters.nodes_visited, m_traversal_counters.box_tests, m_traversal_counters.primitive_tests };
+		}
+
+		void SetNodeLayout(NodeLayout node_layout, const std::vector<Ray>& sample_rays = {})
+		// Reorder the wide nodes (which the ray queries walk through) in memory, to touch fewer cache lines and pages per ray.
+		// NodeLayout::Treelets packs page-sized treelets around the most frequently visited nodes: how often tracing sample_rays
+		// visits them (e.g. a sparse set of camera rays), or without sample rays, their surface areas. Rebuilds keep the layout,
+		// but measure the frequencies by surface area. The binary nodes stay depth-first, since sampling and refitting rely on that.
+		// No effect with BranchingFactor::Binary. Not thread-safe with respect to ray queries on this BVH.
+		{
+			SetNodeLayout(node_layout, sample_rays,
+				[&](int first_primitive_index, int primitive_count, Ray& bounded_ray)
+				{
+					Whitted::Hit closest;
+					for (int i = first_primitive_index; (i < first_primitive_index + primitive_count) && m_entity_set; )	// a BVH over a BVH_PrimitiveSet only counts the nodes the rays pass through
+					{
+						int run_length = std::min(m_same_type_run_lengths[i], first_primitive_index + primitive_count - i);
+						m_primitives[i]->GetClosestHitInRange(m_primitives.data() + i, run_length, bounded_ray, closest);
+						i += run_length;
+					}
+				}
+			);
+		}
+
+		template <typename IntersectLeaf>
+		void SetNodeLayout(NodeLayout node_layout, const std::vector<Ray>& sample_rays, const IntersectLeaf& intersect_leaf)
+		// For a BVH over a BVH_PrimitiveSet: intersect_leaf is what its owner passes to closest_hit_with().
+		{
+			m_node_layout = node_layout;
+			for_each_wide_BVH(
+				[&](auto& wide_BVH)
+				{
+					lay_out_wide_BVH(wide_BVH, sample_rays, intersect_leaf);
+				}
+			);
+		}
+
+		NodeLayout GetNodeLayout() const
+		{
+			return m_node_layout;
+		}
+
+		bool IsNodeCompressed() const
+		{
+			return m_compress_nodes && (m_branching_factor != BranchingFactor::Binary);
+		}
+
+		size_t GetNodeMemoryInBytes() const
+		// Of the nodes the ray queries walk through: the wide nodes if there is a wide BVH, the binary nodes otherwise.
+		{
+			if (m_wide_BVH_4)
+			{
+				return m_wide_BVH_4->GetMemoryInBytes();
+			}
+			if (m_wide_BVH_8)
+			{
+				return m_wide_BVH_8->GetMemoryInBytes();
+			}
+			if (m_compressed_BVH_4)
+			{
+				return m_compressed_BVH_4->GetMemoryInBytes();
+			}
+			if (m_compressed_BVH_8)
+			{
+				return m_compressed_BVH_8->GetMemoryInBytes();
+			}
+			return m_nodes.size() * sizeof(BVH_LinearNode);
+		}
+
+		void Refit()
+		// Update the bounding volumes and mesh areas of all the nodes from the current bounding volumes of the primitives,
+		// keeping the topology (i.e. which primitives are in which leaf). Much cheaper than Rebuild(), and enough when the
+		// primitives only move a little (e.g. a deforming mesh), but the tree gets worse the further they move from where
+		// they were at the last rebuild: compare GetSAHCost() with GetSAHCostAtRebuild() to decide when to rebuild.
+		// The leaves of a spatial split BVH are refitted to whole primitives, i.e. they lose their clipping until the next rebuild.
+		// Not thread-safe with respect to ray queries on this BVH.
+		{
+			// The nodes of one depth only depend on the deeper ones, so we go up level by level and refit each level in parallel:
+			for (int depth = (int)m_refit_levels.size() - 1; depth >= 0; depth--)
+			{
+				std::for_each(std::execution::par, m_refit_levels[depth].begin(), m_refit_levels[depth].end(),
+					[&](int node_index)
+					{
+						BVH_LinearNode& node = m_nodes[node_index];
+						if (node.primitive_count > 0)	// case: leaf
+						{
+							AABB_3D bounding_volume;
+							float mesh_area = 0.0f;
+							for (int i = node.first_primitive_index; i < node.first_primitive_index + node.primitive_count; i++)
+							{
+								bounding_volume = bounding_volume.Union_with_3D_AABB(m_primitive_set->GetPrimitiveAABB(m_primitive_indices[i]));
+								mesh_area += IsDuplicateReference(i) ? 0.0f : m_primitive_set->GetPrimitiveArea(m_primitive_indices[i]);
+							}
+							node.bounding_volume = bounding_volume;
+							m_node_mesh_areas[node_index] = mesh_area;
+						}
+						else
+						{
+							node.bounding_volume = m_nodes[node_index + 1].bounding_volume.Union_with_3D_AABB(m_nodes[node.second_child_index].bounding_volume);
+							m_node_mesh_areas[node_index] = m_node_mesh_areas[node_index + 1] + m_node_mesh_areas[node.second_child_index];
+						}
+					}
+				);
+			}
+
+			if (m_wide_BVH_4)
+			{
+				m_wide_BVH_4->refit(m_nodes);
+			}
+			if (m_wide_BVH_8)
+			{
+				m_wide_BVH_8->refit(m_nodes);
+			}
+			if (m_compressed_BVH_4)
+			{
+				m_compressed_BVH_4->refit(m_nodes);
+			}
+			if (m_compressed_BVH_8)
+			{
+				m_compressed_BVH_8->refit(m_nodes);
+			}
+		}
+
+		float GetSAHCost() const
+		// The quality metric of the tree: the expected cost of tracing a random ray that hits the root box,
+		// in units of one primitive intersection test (the same cost model find_SAH_split minimizes). Lower is better.
+		{
+			if (m_nodes.empty())
+			{
+				return 0.0f;
+			}
+			double root_area = m_nodes[0].bounding_volume.total_area();
+			if (!(root_area > 0.0))
+			{
+				return SAH_intersection_cost * m_primitive_indices.size();
+			}
+			double cost = 0.0;
+			for (const BVH_LinearNode& node : m_nodes)
+			{
+				double node_cost = (node.primitive_count > 0) ? (SAH_intersection_cost * node.primitive_count) : (SAH_traversal_cost);
+				cost += node_cost * node.bounding_volume.total_area() / root_area;
+			}
+			return (float)cost;
+		}
+
+		float GetSAHCostAtRebuild() const
+		{
+			return m_SAH_cost_at_rebuild;
+		}
+
+		DividingMethod GetDividingMethod() const
+		{
+			return m_dividing_method;
+		}
+
+		const std::vector<BVH_LinearNode>& GetNodes() const
+		{
+			return m_nodes;
+		}
+
+		const std::vector<float>& GetNodeMeshAreas() const
+		{
+			return m_node_mesh_areas;
+		}
+
+		BVH_Hierarchy GetHierarchy() const
+		// A copy, to restore this BVH over a copy of the primitives.
+		{
+			return BVH_Hierarchy{ m_primitive_indices, m_nodes, m_node_mesh_areas, m_is_duplicate_reference };
+		}
+
+		const std::vector<Whitted::Entity*>& GetPrimitives() const
+		// In the order the leaves refer to them. With spatial splits, a primitive may appear more than once. Empty for a BVH over a BVH_PrimitiveSet.
+		{
+			return m_primitives;
+		}
+
+		const std::vector<int>& GetPrimitiveIndices() const
+		// The indices (into the BVH_PrimitiveSet, or the entities the BVH was built over) of the primitives, in the order the leaves refer to them.
+		// The leaf callbacks of closest_hit_with() and any_hit_with() get ranges of this array.
+		{
+			return m_primitive_indices;
+		}
+
+		bool IsDuplicateReference(int primitive_index) const
+		// Whether GetPrimitiveIndices()[primitive_index] is a repeated reference to a primitive (spatial splits only), which should be ignored when summing areas.
+		{
+			return (!m_is_duplicate_reference.empty()) && m_is_duplicate_reference[primitive_index];
+		}
+
+		AABB_3D GetClippedBoundingVolume(const AABB_3D& box) const
+		// The bounding volume of the parts of the primitives inside the box. Subtrees entirely inside the box contribute their bounding volumes as a whole.
+		{
+			AABB_3D clipped_bounding_volume;	// contains nothing
+			if (m_nodes.empty())
+			{
+				return clipped_bounding_volume;
+			}
+
+			std::array<int, traversal_stack_size> nodes_to_visit;
+			int nodes_to_visit_count = 0;
+			int current_node_index = 0;
+
+			while (true)
+			{
+				const BVH_LinearNode& node = m_nodes[current_node_index];
+				if (node.bounding_volume.intersects_with_3D_AABB(box))
+				{
+					if (box.contains_3D_AABB(node.bounding_volume))
+					{
+						clipped_bounding_volume = clipped_bounding_volume.Union_with_3D_AABB(node.bounding_volume);
+					}
+					else if (node.primitive_count > 0)
+					{
+						for (int i = node.first_primitive_index; i < node.first_primitive_index + node.primitive_count; i++)
+						{
+							clipped_bounding_volume = clipped_bounding_volume.Union_with_3D_AABB(m_primitive_set->GetClippedPrimitiveAABB(m_primitive_indices[i], box));
+						}
+					}
+					else
+					{
+						nodes_to_visit[nodes_to_visit_count++] = node.second_child_index;
+						current_node_index = current_node_index + 1;
+						continue;
+					}
+				}
+				if (nodes_to_visit_count == 0)
+				{
+					break;
+				}
+				current_node_index = nodes_to_visit[--nodes_to_visit_count];
+			}
+			return clipped_bounding_volume;
+		}
+
+		Whitted::IntersectionRecord traverse_BVH_from_root(const Ray& ray) const
+		// Closest-hit query: the children are visited front-to-back, and once we have a hit,
+		// any box the ray enters beyond it cannot contain a closer one and is skipped. BVHs over entities only.
+		// Only a Whitted::Hit is kept while traversing, the full record is filled in once, by the entity hit closest.
+		// The entities of a leaf are tested a run of same-type entities at a time (see group_leaf_entities_by_type()).
+		{
+			Whitted::Hit closest;
+			int closest_primitive_index = -1;
+			closest_hit_with(ray,
+				[&](int first_primitive_index, int primitive_count, Ray& bounded_ray)
+				{
+					for (int i = first_primitive_index; i < first_primitive_index + primitive_count; )
+					{
+						int run_length = std::min(m_same_type_run_lengths[i], first_primitive_index + primitive_count - i);
+						int hit_index = m_primitives[i]->GetClosestHitInRange(m_primitives.data() + i, run_length, bounded_ray, closest);
+						if (hit_index >= 0)
+						{
+							closest_primitive_index = i + hit_index;
+						}
+						i += run_length;
+					}
+				}
+			);
+			if (closest_primitive_index < 0)
+			{
+				return Whitted::IntersectionRecord{};	// no intersection
+			}
+			return m_primitives[closest_primitive_index]->GetSurfaceInteraction(ray, closest);
+		}
+
+		bool is_occluded_from_root(const Ray& ray, double maximum_t) const
+		// Any-hit query for shadow rays: returns as soon as any primitive is hit in [ray.t_min, maximum_t). BVHs over entities only.
+		{
+			return any_hit_with(ray, maximum_t,
+				[&](int first_primitive_index, int primitive_count)
+				{
+					for (int i = first_primitive_index; i < first_primitive_index + primitive_count; )
+					{
+						int run_length = std::min(m_same_type_run_lengths[i], first_primitive_index + primitive_count - i);
+						if (m_primitives[i]->IntersectsWithinRange(m_primitives.data() + i, run_length, ray, maximum_t))
+						{
+							return true;
+						}
+						i += run_length;
+					}
+					return false;
+				}
+			);
+		}
+
+		template <typename IntersectLeaf>
+		void closest_hit_with(const Ray& ray, IntersectLeaf&& intersect_leaf) const
+		// The traversal of traverse_BVH_from_root, with the primitive tests left to the caller, so that an entity can test
+		// its leaves against its own (e.g. compressed) copy of the primitives. intersect_leaf(first_primitive_index, primitive_count, bounded_ray)
+		// tests the primitives GetPrimitiveIndices()[first_primitive_index, first_primitive_index + primitive_count), and shrinks bounded_ray.t_max to any closer hit.
+		{
+			if (!m_counting_traversals)
+			{
+				closest_hit_visiting(ray, intersect_leaf, [](int) {});
+				return;
+			}
+			BVH_TraversalStatistics statistics;
+			closest_hit_visiting(ray,
+				[&](int first_primitive_index, int primitive_count, Ray& bounded_ray)
+				{
+					statistics.primitive_tests += primitive_count;
+					intersect_leaf(first_primitive_index, primitive_count, bounded_ray);
+				},
+				[&](int)
+				{
+					statistics.nodes_visited++;
+				}
+			);
+			count_traversal(statistics);
+		}
+
+		template <typename IntersectLeaf>
+		void closest_hits_with(RayPacket& packet, int first_ray_index, int last_ray_index, IntersectLeaf&& intersect_leaf) const
+		// closest_hit_with() for the rays packet.rays[first_ray_index, last_ray_index), see packet_closest_hits_with(). The packet walks the binary nodes,
+		// so it is not affected by SetNodeCompression() or SetNodeLayout(). intersect_leaf(first_primitive_index, primitive_count, first_ray_index, last_ray_index).
+		{
+			if (m_nodes.empty())
+			{
+				return;
+			}
+			if (!m_counting_traversals)
+			{
+				packet_closest_hits_with(m_nodes.data(), packet, first_ray_index, last_ray_index, intersect_leaf, [](int) {});
+				return;
+			}
+			BVH_TraversalStatistics statistics;
+			packet_closest_hits_with(m_nodes.data(), packet, first_ray_index, last_ray_index,
+				[&](int first_primitive_index, int primitive_count, int first_active_ray_index, int last_active_ray_index)
+				{
+					statistics.primitive_tests += (uint64_t)primitive_count * (last_active_ray_index - first_active_ray_index);
+					intersect_leaf(first_primitive_index, primitive_count, first_active_ray_index, last_active_ray_index);
+				},
+				[&](int)
+				{
+					statistics.nodes_visited++;
+				}
+			);
+			count_traversal(statistics, std::max(last_ray_index - first_ray_index, 0), true);
+		}
+
+		template <typename IntersectLeaf>
+		void interleaved_closest_hits_with(Ray* rays, int ray_count, IntersectLeaf&& intersect_leaf) const
+		// closest_hit_with() for each of the rays rays[0, ray_count), with rays_in_flight of them traversed at a time on the same nodes
+		// (see AccelerationStructure::interleave_traversals()). The t_max of the rays shrinks to their closest hits.
+		// intersect_leaf(ray_index, first_primitive_index, primitive_count, bounded_ray) tests rays[ray_index], which is bounded_ray.
+		{
+			if (!m_counting_traversals)
+			{
+				interleaved_closest_hits_visiting(rays, ray_count, intersect_leaf, [](int) {});
+				return;
+			}
+			BVH_TraversalStatistics statistics;
+			interleaved_closest_hits_visiting(rays, ray_count,
+				[&](int ray_index, int first_primitive_index, int primitive_count, Ray& bounded_ray)
+				{
+					statistics.primitive_tests += primitive_count;
+					intersect_leaf(ray_index, first_primitive_index, primitive_count, bounded_ray);
+				},
+				[&](int)
+				{
+					statistics.nodes_visited++;
+				}
+			);
+			count_traversal(statistics, ray_count);
+		}
+
+		void traverse_rays_from_root(Ray* rays, int ray_count, Whitted::IntersectionRecord* records) const
+		// traverse_BVH_from_root() for each of the rays rays[0, ray_count) (records[i] for rays[i]), with the nodes fetched
+		// in the background (see interleaved_closest_hits_with()). The t_max of the rays shrinks to their closest hits. BVHs over entities only.
+		{
+			std::vector<Whitted::Hit> closest(ray_count);
+			std::vector<int> closest_primitive_indices(ray_count, -1);
+			interleaved_closest_hits_with(rays, ray_count,
+				[&](int ray_index, int first_primitive_index, int primitive_count, Ray& bounded_ray)
+				{
+					for (int i = first_primitive_index; i < first_primitive_index + primitive_count; )
+					{
+						int run_length = std::min(m_same_type_run_lengths[i], first_primitive_index + primitive_count - i);
+						int hit_index = m_primitives[i]->GetClosestHitInRange(m_primitives.data() + i, run_length, bounded_ray, closest[ray_index]);
+						if (hit_index >= 0)
+						{
+							closest_primitive_indices[ray_index] = i + hit_index;
+						}
+						i += run_length;
+					}
+				}
+			);
+			for (int ray_index = 0; ray_index < ray_count; ray_index++)
+			{
+				int i = closest_primitive_indices[ray_index];
+				records[ray_index] = (i < 0) ? Whitted::IntersectionRecord{} : m_primitives[i]->GetSurfaceInteraction(rays[ray_index], closest[ray_index]);
+			}
+		}
+
+		void traverse_packet_from_root(RayPacket& packet, std::array<Whitted::IntersectionRecord, ray_packet_size>& records) const
+		// traverse_BVH_from_root() for every ray of the packet (records[i] for packet.rays[i]), with the entities tested a packet at a time
+		// (see Whitted::Entity::GetClosestHitsInPacket). BVHs over entities only.
+		{
+			std::array<Whitted::Hit, ray_packet_size> closest;
+			std::array<int, ray_packet_size> closest_primitive_indices;
+			closest_primitive_indices.fill(-1);
+			closest_hits_with(packet, 0, packet.GetRayCount(),
+				[&](int first_primitive_index, int primitive_count, int first_ray_index, int last_ray_index)
+				{
+					for (int i = first_primitive_index; i < first_primitive_index + primitive_count; i++)
+					{
+						uint64_t hit_mask = m_primitives[i]->GetClosestHitsInPacket(packet, first_ray_index, last_ray_index, closest.data());
+						for (int ray_index = first_ray_index; (ray_index < last_ray_index) && (hit_mask >> ray_index); ray_index++)
+						{
+							if ((hit_mask >> ray_index) & 1)
+							{
+								closest_primitive_indices[ray_index] = i;
+							}
+						}
+					}
+				}
+			);
+			for (int ray_index = 0; ray_index < packet.GetRayCount(); ray_index++)
+			{
+				int i = closest_primitive_indices[ray_index];
+				records[ray_index] = (i < 0) ? Whitted::IntersectionRecord{} : m_primitives[i]->GetSurfaceInteraction(packet.rays[ray_index], closest[ray_index]);
+			}
+		}
+
+		template <typename IntersectLeaf>
+		bool any_hit_with(const Ray& ray, double maximum_t, IntersectLeaf&& intersects_leaf) const
+		// The traversal of is_occluded_from_root, with the primitive tests left to the caller:
+		// intersects_leaf(first_primitive_index, primitive_count) returns whether any primitive of the leaf is hit in [ray.t_min, maximum_t).
+		{
+			if (!m_counting_traversals)
+			{
+				return any_hit_visiting(ray, maximum_t, intersects_leaf, [](int) {});
+			}
+			BVH_TraversalStatistics statistics;
+			bool is_hit = any_hit_visiting(ray, maximum_t,
+				[&](int first_primitive_index, int primitive_count)
+				{
+					statistics.primitive_tests += primitive_count;
+					return intersects_leaf(first_primitive_index, primitive_count);
+				},
+				[&](int)
+				{
+					statistics.nodes_visited++;
+				}
+			);
+			count_traversal(statistics);
+			return is_hit;
+		}
+
+		void Sampling_from_root(Whitted::IntersectionRecord& sample, float& PDF)
+		// BVHs over entities only.
+		{
+			float total_mesh_area = m_node_mesh_areas[0];
+			m_primitives[sample_reference(Whitted::get_random_float_0_1() * total_mesh_area)]->Sampling(sample, PDF);	// TODO: do we need to sqrt the random float?
+			PDF = 1.0f / total_mesh_area;
+		}
+
+		int SamplePrimitive(float& PDF) const
+		// Pick a primitive with a probability proportional to its area, and return its index into the BVH_PrimitiveSet.
+		// PDF: of a point sampled uniformly on the picked primitive, with respect to area, i.e. 1 / the total area.
+		{
+			float total_mesh_area = m_node_mesh_areas[0];
+			PDF = 1.0f / total_mesh_area;
+			return m_primitive_indices[sample_reference(Whitted::get_random_float_0_1() * total_mesh_area)];
+		}
+
+		static uint32_t left_shift_3(uint32_t x)
+		// Spread the lower 10 bits of x out so that there are two zero bits between every two of them (see pbrt-v3, section 4.3.3)
+		{
+			if (x == (1 << 10))
+			{
+				x--;
+			}
+			x = (x | (x << 16)) & 0b00000011000000000000000011111111;
+			x = (x | (x << 8)) & 0b00000011000000001111000000001111;
+			x = (x | (x << 4)) & 0b00000011000011000011000011000011;
+			x = (x | (x << 2)) & 0b00001001001001001001001001001001;
+			return x;
+		}
+
+		static uint32_t Morton_code_of(const glm::vec3& point_scaled_by_the_box)
+		// 30-bit Morton code of a point in [0,1]^3: bit 3k is the k-th bit of x, bit 3k+1 of y and bit 3k+2 of z.
+		// Used by the LBVH builder, and by the renderer to sort rays by their origins.
+		{
+			constexpr float Morton_scale = 1 << 10;
+			glm::vec3 quantized = glm::clamp(point_scaled_by_the_box * Morton_scale, glm::vec3{ 0.0f }, glm::vec3{ Morton_scale - 1.0f });
+			return (left_shift_3((uint32_t)quantized.z) << 2) | (left_shift_3((uint32_t)quantized.y) << 1) | left_shift_3((uint32_t)quantized.x);
+		}
+
+		struct MortonPrimitive
+		{
+			uint32_t Morton_code;
+			int primitive_index;
+		};
+
+		static void radix_sort(std::vector<MortonPrimitive>& Morton_primitives)
+		// Parallel LSD radix sort on the 30-bit Morton codes, 10 bits per pass (any other 30-bit keys sort just as well).
+		// Every pass counts the digits of each chunk in parallel, turns the counts into per-chunk write offsets,
+		// and then scatters every chunk in parallel. Each chunk keeps its own order, so every pass is stable.
+		{
+			constexpr int bits_per_pass = 10;
+			constexpr int bucket_count = 1 << bits_per_pass;
+			constexpr int chunk_size = 1 << 16;
+
+			int primitive_count = (int)Morton_primitives.size();
+			int chunk_count = (primitive_count + chunk_size - 1) / chunk_size;
+			std::vector<int> chunks(chunk_count);
+			for (int i = 0; i < chunk_count; i++)
+			{
+				chunks[i] = i;
+			}
+
+			std::vector<MortonPrimitive> sorted(primitive_count);
+			std::vector<std::array<int, bucket_count>> chunk_offsets(chunk_count);
+			for (int shift = 0; shift < 30; shift += bits_per_pass)
+			{
+				auto digit_of = [shift](const MortonPrimitive& Morton_primitive)
+				{
+					return (Morton_primitive.Morton_code >> shift) & (bucket_count - 1);
+				};
+
+				std::for_each(std::execution::par, chunks.begin(), chunks.end(),
+					[&](int chunk)
+					{
+						std::array<int, bucket_count>& counts = chunk_offsets[chunk];
+						counts.fill(0);
+						for (int i = chunk * chunk_size; i < std::min(primitive_count, (chunk + 1) * chunk_size); i++)
+						{
+							counts[digit_of(Morton_primitives[i])]++;
+						}
+					}
+				);
+
+				int running_offset = 0;
+				for (int bucket = 0; bucket < bucket_count; bucket++)
+				{
+					for (int chunk = 0; chunk < chunk_count; chunk++)
+					{
+						int count = chunk_offsets[chunk][bucket];
+						chunk_offsets[chunk][bucket] = running_offset;
+						running_offset += count;
+					}
+				}
+
+				std::for_each(std::execution::par, chunks.begin(), chunks.end(),
+					[&](int chunk)
+					{
+						std::array<int, bucket_count>& offsets = chunk_offsets[chunk];
+						for (int i = chunk * chunk_size; i < std::min(primitive_count, (chunk + 1) * chunk_size); i++)
+						{
+							sorted[offsets[digit_of(Morton_primitives[i])]++] = Morton_primitives[i];
+						}
+					}
+				);
+
+				Morton_primitives.swap(sorted);
+			}
+		}
+
+	private:
+
+		BVH(
+			std::unique_ptr<BVH_EntitySet> entity_set,
+			const BVH_PrimitiveSet* primitive_set,
+			DividingMethod dividing_method,
+			int maximum_primitives_in_leaf,
+			BranchingFactor branching_factor,
+			float maximum_reference_duplication
+		)
+			:
+			m_entity_set(std::move(entity_set)),
+			m_primitive_set(m_entity_set ? m_entity_set.get() : primitive_set),
+			m_dividing_method(dividing_method), 
+			m_maximum_primitives_in_leaf(std::clamp(maximum_primitives_in_leaf, 1, (int)std::numeric_limits<uint16_t>::max())),
+			m_branching_factor(branching_factor),
+			m_maximum_reference_duplication(std::max(maximum_reference_duplication, 0.0f))
+		{
+			Rebuild();
+		}
+
+		void count_traversal(const BVH_TraversalStatistics& statistics, int query_count = 1, bool walks_binary_nodes = false) const
+		// add the cost of one query (or of a packet of query_count rays) to the counters (one atomic add per counter, rather than one per node)
+		{
+			int box_tests_per_node = ((m_branching_factor == BranchingFactor::Binary) || walks_binary_nodes) ? 1 : (int)m_branching_factor;
+			m_traversal_counters.query_count.fetch_add(query_count, std::memory_order_relaxed);
+			m_traversal_counters.nodes_visited.fetch_add(statistics.nodes_visited, std::memory_order_relaxed);
+			m_traversal_counters.box_tests.fetch_add(statistics.nodes_visited * box_tests_per_node, std::memory_order_relaxed);
+			m_traversal_counters.primitive_tests.fetch_add(statistics.primitive_tests, std::memory_order_relaxed);
+		}
+
+		template <typename IntersectLeaf, typename VisitNode>
+		void closest_hit_visiting(const Ray& ray, IntersectLeaf&& intersect_leaf, VisitNode&& visit_node) const
+		// see closest_hit_with(), visit_node(node_index) is called for every node the traversal tests the children (wide) or the box (binary) of
+		{
+			if (m_wide_BVH_8)
+			{
+				return m_wide_BVH_8->closest_hit_with(ray, intersect_leaf, visit_node);
+			}
+			if (m_wide_BVH_4)
+			{
+				return m_wide_BVH_4->closest_hit_with(ray, intersect_leaf, visit_node);
+			}
+			if (m_compressed_BVH_8)
+			{
+				return m_compressed_BVH_8->closest_hit_with(ray, intersect_leaf, visit_node);
+			}
+			if (m_compressed_BVH_4)
+			{
+				return m_compressed_BVH_4->closest_hit_with(ray, intersect_leaf, visit_node);
+			}
+
+			if (m_nodes.empty())	// no primitives at all in the scene
+			{
+				return;
+			}
+
+			std::array<int, 3> ray_direction_is_negative{ray.m_direction.x < 0.0f, ray.m_direction.y < 0.0f, ray.m_direction.z < 0.0f};
+
+			// The interval of the ray shrinks as we find hits. We also hand it to the primitives
+			// so that an entity with its own BVH (i.e. TriangleMesh) can prune with it as well.
+			Ray bounded_ray = ray;
+
+			// the nodes we still need to visit (the build keeps the depth of the tree below traversal_stack_size):
+			std::array<int, traversal_stack_size> nodes_to_visit;
+			int nodes_to_visit_count = 0;
+			int current_node_index = 0;
+
+			while (true)
+			{
+				visit_node(current_node_index);
+				const BVH_LinearNode& node = m_nodes[current_node_index];
+				float t_entry;
+				if (node.bounding_volume.intersects_with_ray(ray, ray.direction_reciprocal, ray_direction_is_negative, (float)bounded_ray.t_max, t_entry))
+				{
+					if (node.primitive_count > 0)	// case: we are at leaf node
+					{
+						intersect_leaf(node.first_primitive_index, node.primitive_count, bounded_ray);
+					}
+					else	// case: we are at interior node, visit the nearer child now and the farther child later
+					{
+						if (ray_direction_is_negative[node.split_axis])
+						{
+							nodes_to_visit[nodes_to_visit_count++] = current_node_index + 1;
+							current_node_index = node.second_child_index;
+						}
+						else
+						{
+							nodes_to_visit[nodes_to_visit_count++] = node.second_child_index;
+							current_node_index = current_node_index + 1;
+						}
+						continue;
+					}
+				}
+				if (nodes_to_visit_count == 0)
+				{
+					break;
+				}
+				current_node_index = nodes_to_visit[--nodes_to_visit_count];
+			}
+		}
+
+		template <typename IntersectLeaf, typename VisitNode>
+		void interleaved_closest_hits_visiting(Ray* rays, int ray_count, IntersectLeaf&& intersect_leaf, VisitNode&& visit_node) const
+		// see interleaved_closest_hits_with(), and closest_hit_visiting() for visit_node
+		{
+			if (m_wide_BVH_8)
+			{
+				return m_wide_BVH_8->interleaved_closest_hits_with(rays, ray_count, intersect_leaf, visit_node);
+			}
+			if (m_wide_BVH_4)
+			{
+				return m_wide_BVH_4->interleaved_closest_hits_with(rays, ray_count, intersect_leaf, visit_node);
+			}
+			if (m_compressed_BVH_8)
+			{
+				return m_compressed_BVH_8->interleaved_closest_hits_with(rays, ray_count, intersect_leaf, visit_node);
+			}
+			if (m_compressed_BVH_4)
+			{
+				return m_compressed_BVH_4->interleaved_closest_hits_with(rays, ray_count, intersect_leaf, visit_node);
+			}
+			if (m_nodes.empty())
+			{
+				return;
+			}
+			AccelerationStructure::interleaved_closest_hits_with(m_nodes.data(), rays, ray_count, intersect_leaf, visit_node);
+		}
+
+		template <typename IntersectLeaf, typename VisitNode>
+		bool any_hit_visiting(const Ray& ray, double maximum_t, IntersectLeaf&& intersects_leaf, VisitNode&& visit_node) const
+		// see any_hit_with(). Since we don't need the closest hit, we don't care about the order in which the children are visited.
+		{
+			if (m_wide_BVH_8)
+			{
+				return m_wide_BVH_8->any_hit_with(ray, maximum_t, intersects_leaf, visit_node);
+			}
+			if (m_wide_BVH_4)
+			{
+				return m_wide_BVH_4->any_hit_with(ray, maximum_t, intersects_leaf, visit_node);
+			}
+			if (m_compressed_BVH_8)
+			{
+				return m_compressed_BVH_8->any_hit_with(ray, maximum_t, intersects_leaf, visit_node);
+			}
+			if (m_compressed_BVH_4)
+			{
+				return m_compressed_BVH_4->any_hit_with(ray, maximum_t, intersects_leaf, visit_node);
+			}
+
+			if (m_nodes.empty())
+			{
+				return false;
+			}
+
+			std::array<int, 3> ray_direction_is_negative{ray.m_direction.x < 0.0f, ray.m_direction.y < 0.0f, ray.m_direction.z < 0.0f};
+
+			std::array<int, traversal_stack_size> nodes_to_visit;
+			int nodes_to_visit_count = 0;
+			int current_node_index = 0;
+
+			while (true)
+			{
+				visit_node(current_node_index);
+				const BVH_LinearNode& node = m_nodes[current_node_index];
+				float t_entry;
+				if (node.bounding_volume.intersects_with_ray(ray, ray.direction_reciprocal, ray_direction_is_negative, (float)maximum_t, t_entry))
+				{
+					if (node.primitive_count > 0)
+					{
+						if (intersects_leaf(node.first_primitive_index, node.primitive_count))
+						{
+							return true;
+						}
+					}
+					else
+					{
+						nodes_to_visit[nodes_to_visit_count++] = node.second_child_index;
+						current_node_index = current_node_index + 1;
+						continue;
+					}
+				}
+				if (nodes_to_visit_count == 0)
+				{
+					break;
+				}
+				current_node_index = nodes_to_visit[--nodes_to_visit_count];
+			}
+
+			return false;
+		}
+
+		void build_wide_BVH()
+		// The binary nodes are kept for sampling and refitting, the wide BVH (if any) takes over the ray queries.
+		{
+			m_wide_BVH_4.reset();
+			m_wide_BVH_8.reset();
+			m_compressed_BVH_4.reset();
+			m_compressed_BVH_8.reset();
+			if (m_nodes.empty())
+			{
+				return;
+			}
+			if (m_branching_factor == BranchingFactor::Four)
+			{
+				if (m_compress_nodes)
+				{
+					m_compressed_BVH_4 = std::make_unique<CompressedWideBVH<4>>(m_nodes);
+				}
+				else
+				{
+					m_wide_BVH_4 = std::make_unique<WideBVH<4>>(m_nodes);
+				}
+			}
+			else if (m_branching_factor == BranchingFactor::Eight)
+			{
+				if (m_compress_nodes)
+				{
+					m_compressed_BVH_8 = std::make_unique<CompressedWideBVH<8>>(m_nodes);
+				}
+				else
+				{
+					m_wide_BVH_8 = std::make_unique<WideBVH<8>>(m_nodes);
+				}
+			}
+			if (m_node_layout != NodeLayout::Depth_First)	// which collapsing gives us already
+			{
+				SetNodeLayout(m_node_layout, {}, [](int, int, Ray&) {});
+			}
+		}
+
+		template <typename F>
+		void for_each_wide_BVH(F&& f) const
+		// There is at most one.
+		{
+			if (m_wide_BVH_4)
+			{
+				f(*m_wide_BVH_4);
+			}
+			if (m_wide_BVH_8)
+			{
+				f(*m_wide_BVH_8);
+			}
+			if (m_compressed_BVH_4)
+			{
+				f(*m_compressed_BVH_4);
+			}
+			if (m_compressed_BVH_8)
+			{
+				f(*m_compressed_BVH_8);
+			}
+		}
+
+		template <typename WideBVHType, typename IntersectLeaf>
+		void lay_out_wide_BVH(WideBVHType& wide_BVH, const std::vector<Ray>& sample_rays, const IntersectLeaf& intersect_leaf) const
+		{
+			if (m_node_layout == NodeLayout::Depth_First)
+			{
+				wide_BVH.reorder_depth_first();
+			}
+			else if (m_node_layout == NodeLayout::Van_Emde_Boas)
+			{
+				wide_BVH.reorder_van_Emde_Boas();
+			}
+			else
+			{
+				using WideNode = typename std::decay_t<decltype(wide_BVH.GetNodes())>::value_type;
+				int nodes_per_treelet = std::max(1, treelet_size_in_bytes / (int)sizeof(WideNode));
+				std::vector<float> node_weights = sample_rays.empty() ? wide_BVH.get_surface_area_weights(m_nodes) : wide_BVH.get_visit_counts(sample_rays, intersect_leaf);
+				wide_BVH.reorder_treelets(node_weights, nodes_per_treelet);
+			}
+		}
+
+		int sample_reference(float probabilistic_area) const
+		// The index (into m_primitive_indices) of the primitive the probabilistic area in [0, total mesh area) falls on.
+		{
+			// walk down the tree, the first child is always the next node in the array:
+			int node_index = 0;
+			while (m_nodes[node_index].primitive_count == 0)
+			{
+				if (probabilistic_area < m_node_mesh_areas[node_index + 1])
+				{
+					node_index = node_index + 1;
+				}
+				else
+				{
+					probabilistic_area -= m_node_mesh_areas[node_index + 1];
+					node_index = m_nodes[node_index].second_child_index;
+				}
+			}
+
+			// pick the primitive in the leaf on which the probabilistic area falls:
+			const BVH_LinearNode& leaf = m_nodes[node_index];
+			int last = leaf.first_primitive_index + leaf.primitive_count - 1;
+			for (int i = leaf.first_primitive_index; i < last; i++)
+			{
+				float primitive_area = IsDuplicateReference(i) ? 0.0f : m_primitive_set->GetPrimitiveArea(m_primitive_indices[i]);
+				if (probabilistic_area < primitive_area)
+				{
+					return i;
+				}
+				probabilistic_area -= primitive_area;
+			}
+			return last;	// also catches the floating point error accumulated above
+		}
+
+		void group_leaf_entities_by_type()
+		// Sort the entities within every leaf by their type, so that a leaf is a few runs of same-type entities, and the queries
+		// dispatch once per run (Whitted::Entity::GetClosestHitInRange) instead of once per entity. Sampling and the node mesh areas
+		// don't depend on the order within a leaf.
+		{
+			m_same_type_run_lengths.assign(m_primitives.size(), 1);
+			std::vector<int> order;
+			std::vector<int> primitive_indices;
+			std::vector<Whitted::Entity*> primitives;
+			std::vector<char> is_duplicate_reference;
+			for (const BVH_LinearNode& node : m_nodes)
+			{
+				if (node.primitive_count < 2)
+				{
+					continue;
+				}
+				int first = node.first_primitive_index;
+				int count = node.primitive_count;
+				order.resize(count);
+				std::iota(order.begin(), order.end(), first);
+				std::stable_sort(order.begin(), order.end(),
+					[&](int a, int b)
+					{
+						return std::type_index(typeid(*m_primitives[a])) < std::type_index(typeid(*m_primitives[b]));
+					}
+				);
+
+				primitive_indices.resize(count);
+				primitives.resize(count);
+				is_duplicate_reference.resize(m_is_duplicate_reference.empty() ? 0 : count);
+				for (int i = 0; i < count; i++)
+				{
+					primitive_indices[i] = m_primitive_indices[order[i]];
+					primitives[i] = m_primitives[order[i]];
+					if (!m_is_duplicate_reference.empty())
+					{
+						is_duplicate_reference[i] = m_is_duplicate_reference[order[i]];
+					}
+				}
+				std::copy(primitive_indices.begin(), primitive_indices.end(), m_primitive_indices.begin() + first);
+				std::copy(primitives.begin(), primitives.end(), m_primitives.begin() + first);
+				std::copy(is_duplicate_reference.begin(), is_duplicate_reference.end(), m_is_duplicate_reference.begin() + first);
+
+				for (int i = first + count - 2; i >= first; i--)
+				{
+					if (typeid(*m_primitives[i]) == typeid(*m_primitives[i + 1]))
+					{
+						m_same_type_run_lengths[i] = m_same_type_run_lengths[i + 1] + 1;
+					}
+				}
+			}
+		}
+
+		void group_nodes_by_depth()
+		// For Refit(): m_refit_levels[d] lists the nodes at depth d. The parent always comes before its children in m_nodes.
+		{
+			std::vector<int> node_depths(m_nodes.size(), 0);
+			for (int i = 0; i < (int)m_nodes.size(); i++)
+			{
+				if ((int)m_refit_levels.size() <= node_depths[i])
+				{
+					m_refit_levels.resize(node_depths[i] + 1);
+				}
+				m_refit_levels[node_depths[i]].push_back(i);
+				if (m_nodes[i].primitive_count == 0)
+				{
+					node_depths[i + 1] = node_depths[i] + 1;
+					node_depths[m_nodes[i].second_child_index] = node_depths[i] + 1;
+				}
+			}
+		}
+
+		int flatten_BVH(BVH_Node* node, int& next_free_node)
+		// Lay out the subtree of node depth-first starting at m_nodes[next_free_node], and return the index of node.
+		{
+			int node_index = next_free_node++;
+			BVH_LinearNode& linear_node = m_nodes[node_index];
+			linear_node.bounding_volume = node->bounding_volume;
+			m_node_mesh_areas[node_index] = node->mesh_area;
+			if (node->is_leaf())
+			{
+				linear_node.first_primitive_index = node->first_primitive_index;
+				linear_node.primitive_count = (uint16_t)node->primitive_count;
+			}
+			else
+			{
+				linear_node.primitive_count = 0;
+				linear_node.split_axis = (uint8_t)node->split_axis;
+				flatten_BVH(node->left, next_free_node);	// lands at node_index + 1
+				m_nodes[node_index].second_child_index = flatten_BVH(node->right, next_free_node);
+			}
+			return node_index;
+		}
+
+		BVH_Node* build_leaf(const BVH_BuildPrimitives& build_primitives, const std::vector<int>& primitive_indices, int begin, int end, const AABB_3D& bounding_volume, std::atomic<int>& node_count)
+		{
+			node_count++;
+			BVH_Node* leaf = new BVH_Node();
+			leaf->bounding_volume = bounding_volume;
+			leaf->first_primitive_index = begin;
+			leaf->primitive_count = end - begin;
+			for (int i = begin; i < end; i++)
+			{
+				leaf->mesh_area += build_primitives.areas[primitive_indices[i]];
+			}
+			return leaf;
+		}
+
+		BVH_Node* build_BVH(const BVH_BuildPrimitives& build_primitives, std::vector<int>& primitive_indices, int begin, int end, int depth, std::atomic<int>& node_count)
+		// Build the subtree over primitive_indices[begin, end), re-ordering that range in place.
+		// Assume begin < end
+		{
+			AABB_3D bounding_volume;	// contains nothing at this point
+			AABB_3D AABB_of_all_centroids;
+			for (int i = begin; i < end; i++)
+			{
+				bounding_volume = bounding_volume.Union_with_3D_AABB(build_primitives.bounding_volumes[primitive_indices[i]]);
+				AABB_of_all_centroids = AABB_of_all_centroids.Union_with_point(build_primitives.centroids[primitive_indices[i]]);
+				// We use AABB of centroids instead of entities' own AABBs because we want partitions according to
+				// entities' number, and thus we don't care about the shape of each entity.
+			}
+
+			int primitive_count = end - begin;
+			if (primitive_count == 1)	// leaf node
+			{
+				return build_leaf(build_primitives, primitive_indices, begin, end, bounding_volume, node_count);
+			}
+
+			bool fits_in_leaf = (primitive_count <= m_maximum_primitives_in_leaf);
+			int dividing = end;		// end means "not divided yet"
+			int dividing_axis = AABB_of_all_centroids.longest_axis();
+
+			if ((m_dividing_method == DividingMethod::Surface_Area_Heuristic) && (depth < maximum_SAH_depth))
+			// Beyond maximum_SAH_depth we only do median splits, which halve the primitives,
+			// so that the tree can never be deeper than the traversal stack.
+			{
+				int best_axis = -1;
+				int best_bucket = -1;
+				float best_cost = std::numeric_limits<float>::max();
+				find_SAH_split(
+					primitive_count,
+					[&](int i) -> const AABB_3D& { return build_primitives.bounding_volumes[primitive_indices[begin + i]]; },
+					[&](int i) -> const glm::vec3& { return build_primitives.centroids[primitive_indices[begin + i]]; },
+					bounding_volume, AABB_of_all_centroids, best_axis, best_bucket, best_cost
+				);
+
+				float leaf_cost = SAH_intersection_cost * primitive_count;
+				if (fits_in_leaf && ((best_axis < 0) || (leaf_cost <= best_cost)))
+				{
+					return build_leaf(build_primitives, primitive_indices, begin, end, bounding_volume, node_count);
+				}
+				if (best_axis >= 0)
+				{
+					dividing_axis = best_axis;
+					dividing = (int)(std::partition(primitive_indices.begin() + begin, primitive_indices.begin() + end,
+						[&](int primitive_index)
+						{
+							return SAH_bucket_of(build_primitives.centroids[primitive_index], AABB_of_all_centroids, best_axis) <= best_bucket;
+						}
+					) - primitive_indices.begin());
+				}
+				// otherwise all the centroids coincide and we have too many primitives for one leaf: fall back to the median split
+			}
+			else if (fits_in_leaf)	// median split
+			{
+				return build_leaf(build_primitives, primitive_indices, begin, end, bounding_volume, node_count);
+			}
+
+			if (dividing == end)	// median split
+			{
+				// We only need the median in the middle, with the smaller ones before it and the larger ones after it,
+				// which std::nth_element gives us in linear time (see https://en.cppreference.com/w/cpp/algorithm/nth_element)
+				dividing = begin + primitive_count / 2;
+				std::nth_element(primitive_indices.begin() + begin, primitive_indices.begin() + dividing, primitive_indices.begin() + end,
+					[&](int a, int b)
+					{
+						return (build_primitives.centroids[a][dividing_axis] < build_primitives.centroids[b][dividing_axis]);
+					}
+				);
+			}
+
+			node_count++;
+			BVH_Node* local_root = new BVH_Node();
+			if (primitive_count >= parallel_build_threshold)
+			// Large enough to be worth a task: build the two halves in parallel (they touch disjoint ranges of primitive_indices).
+			{
+				std::array<int, 2> halves{ 0, 1 };
+				std::for_each(std::execution::par, halves.begin(), halves.end(),
+					[&](int half)
+					{
+						if (half == 0)
+						{
+							local_root->left = build_BVH(build_primitives, primitive_indices, begin, dividing, depth + 1, node_count);
+						}
+						else
+						{
+							local_root->right = build_BVH(build_primitives, primitive_indices, dividing, end, depth + 1, node_count);
+						}
+					}
+				);
+			}
+			else
+			{
+				local_root->left = build_BVH(build_primitives, primitive_indices, begin, dividing, depth + 1, node_count);
+				local_root->right = build_BVH(build_primitives, primitive_indices, dividing, end, depth + 1, node_count);
+			}
+			// local_root stays an interior node: primitive_count remains 0
+			local_root->split_axis = dividing_axis;
+
+			local_root->bounding_volume = bounding_volume;
+
+			local_root->mesh_area = local_root->left->mesh_area + local_root->right->mesh_area;
+
+			return local_root;
+		}
+
+		BVH_Node* build_LBVH(const BVH_BuildPrimitives& build_primitives, std::vector<int>& primitive_indices, std::atomic<int>& node_count)
+		// Linear BVH (see Lauterbach et al. 2009, "Fast BVH Construction on GPUs"):
+		// the cost is dominated by the sort, so this is the builder to use when the hierarchy has to be rebuilt every frame.
+		{
+			AABB_3D AABB_of_all_centroids;
+			for (const glm::vec3& centroid : build_primitives.centroids)
+			{
+				AABB_of_all_centroids = AABB_of_all_centroids.Union_with_point(centroid);
+			}
+
+			std::vector<MortonPrimitive> Morton_primitives(primitive_indices.size());
+			std::for_each(std::execution::par, primitive_indices.begin(), primitive_indices.end(),
+				[&](int primitive_index)
+				{
+					Morton_primitives[primitive_index] = MortonPrimitive{ Morton_code_of(AABB_of_all_centroids.scaled_by_the_box(build_primitives.centroids[primitive_index])), primitive_index };
+				}
+			);
+
+			radix_sort(Morton_primitives);
+
+			std::vector<uint32_t> Morton_codes(Morton_primitives.size());
+			for (int i = 0; i < (int)Morton_primitives.size(); i++)
+			{
+				primitive_indices[i] = Morton_primitives[i].primitive_index;
+				Morton_codes[i] = Morton_primitives[i].Morton_code;
+			}
+
+			return emit_LBVH(build_primitives, primitive_indices, Morton_codes, 0, (int)Morton_codes.size(), 29, node_count);
+		}
+
+		BVH_Node* emit_LBVH(
+			const BVH_BuildPrimitives& build_primitives,
+			const std::vector<int>& primitive_indices,
+			const std::vector<uint32_t>& Morton_codes,		// sorted, Morton_codes[i] belongs to primitive_indices[i]
+			int begin,
+			int end,
+			int bit,		// the highest Morton code bit that may still differ within [begin, end)
+			std::atomic<int>& node_count
+		)
+		// Every level splits the range where the current Morton code bit flips from 0 to 1.
+		// Each level consumes at least one bit, so the tree is at most 30 + log2(number of primitives) deep.
+		{
+			int primitive_count = end - begin;
+			if (primitive_count <= m_maximum_primitives_in_leaf)
+			{
+				AABB_3D bounding_volume;
+				for (int i = begin; i < end; i++)
+				{
+					bounding_volume = bounding_volume.Union_with_3D_AABB(build_primitives.bounding_volumes[primitive_indices[i]]);
+				}
+				return build_leaf(build_primitives, primitive_indices, begin, end, bounding_volume, node_count);
+			}
+
+			int dividing;
+			int dividing_axis;
+			if (bit < 0)	// case: all the Morton codes in the range are the same, but there are too many primitives for one leaf
+			{
+				dividing = begin + primitive_count / 2;
+				dividing_axis = X_axis;
+			}
+			else
+			{
+				uint32_t mask = 1u << bit;
+				if ((Morton_codes[begin] & mask) == (Morton_codes[end - 1] & mask))		// case: no split at this bit
+				{
+					return emit_LBVH(build_primitives, primitive_indices, Morton_codes, begin, end, bit - 1, node_count);
+				}
+				// the codes are sorted, and the higher bits are the same within the range, so the 0s come before the 1s:
+				dividing = (int)(std::partition_point(Morton_codes.begin() + begin, Morton_codes.begin() + end,
+					[mask](uint32_t Morton_code)
+					{
+						return (Morton_code & mask) == 0;
+					}
+				) - Morton_codes.begin());
+				dividing_axis = bit % 3;
+			}
+
+			node_count++;
+			BVH_Node* local_root = new BVH_Node();
+			if (primitive_count >= parallel_build_threshold)
+			{
+				std::array<int, 2> halves{ 0, 1 };
+				std::for_each(std::execution::par, halves.begin(), halves.end(),
+					[&](int half)
+					{
+						if (half == 0)
+						{
+							local_root->left = emit_LBVH(build_primitives, primitive_indices, Morton_codes, begin, dividing, bit - 1, node_count);
+						}
+						else
+						{
+							local_root->right = emit_LBVH(build_primitives, primitive_indices, Morton_codes, dividing, end, bit - 1, node_count);
+						}
+					}
+				);
+			}
+			else
+			{
+				local_root->left = emit_LBVH(build_primitives, primitive_indices, Morton_codes, begin, dividing, bit - 1, node_count);
+				local_root->right = emit_LBVH(build_primitives, primitive_indices, Morton_codes, dividing, end, bit - 1, node_count);
+			}
+			local_root->split_axis = dividing_axis;
+			local_root->bounding_volume = local_root->left->bounding_volume.Union_with_3D_AABB(local_root->right->bounding_volume);
+			local_root->mesh_area = local_root->left->mesh_area + local_root->right->mesh_area;
+
+			return local_root;
+		}
+
+		struct SBVH_Reference
+		// A primitive, or the part of it that is inside bounding_volume (after spatial splits).
+		{
+			AABB_3D bounding_volume;
+			int primitive_index;
+		};
+
+		BVH_Node* build_SBVH(const BVH_BuildPrimitives& build_primitives, std::vector<int>& primitive_indices, std::atomic<int>& node_count)
+		// Spatial split BVH (see Stich et al. 2009, "Spatial Splits in Bounding Volume Hierarchies"): besides partitioning the primitives
+		// (object split), a node may also cut space with a plane and put the primitives that straddle the plane into both children,
+		// each clipped to its own side. Then a large primitive (e.g. a wall of the Cornell box) no longer makes every node it spans overlap,
+		// at the cost of more than one reference to it. The number of extra references is capped by m_maximum_reference_duplication.
+		// primitive_indices is replaced by the references of the leaves, depth-first.
+		{
+			std::vector<SBVH_Reference> references(primitive_indices.size());
+			AABB_3D root_bounding_volume;
+			for (int i = 0; i < (int)references.size(); i++)
+			{
+				references[i] = SBVH_Reference{ build_primitives.bounding_volumes[i], i };
+				root_bounding_volume = root_bounding_volume.Union_with_3D_AABB(build_primitives.bounding_volumes[i]);
+			}
+			float root_area = (root_bounding_volume.total_area() > 0.0) ? ((float)root_bounding_volume.total_area()) : (1.0f);
+			std::atomic<int> duplication_budget = (int)(m_maximum_reference_duplication * references.size());
+
+			BVH_Node* root = split_SBVH(std::move(references), 0, root_area, duplication_budget, node_count);
+
+			// The subtrees were built independently (maybe in parallel), so only now do we know where the references of each leaf go:
+			primitive_indices.clear();
+			std::vector<char> is_referenced(build_primitives.areas.size(), 0);
+			lay_out_SBVH_leaves(root, build_primitives, primitive_indices, is_referenced);
+			return root;
+		}
+
+		void lay_out_SBVH_leaves(BVH_Node* node, const BVH_BuildPrimitives& build_primitives, std::vector<int>& primitive_indices, std::vector<char>& is_referenced)
+		// Depth-first, like flatten_BVH. The area of a primitive only counts in the first leaf that refers to it,
+		// so that sampling by area still picks every primitive with the right probability.
+		{
+			if (node->is_leaf())
+			{
+				node->first_primitive_index = (int)primitive_indices.size();
+				node->primitive_count = (int)node->SBVH_primitive_indices.size();
+				for (int primitive_index : node->SBVH_primitive_indices)
+				{
+					primitive_indices.push_back(primitive_index);
+					if (!is_referenced[primitive_index])
+					{
+						node->mesh_area += build_primitives.areas[primitive_index];
+						is_referenced[primitive_index] = 1;
+					}
+				}
+				std::vector<int>().swap(node->SBVH_primitive_indices);
+				return;
+			}
+			lay_out_SBVH_leaves(node->left, build_primitives, primitive_indices, is_referenced);
+			lay_out_SBVH_leaves(node->right, build_primitives, primitive_indices, is_referenced);
+			node->mesh_area = node->left->mesh_area + node->right->mesh_area;
+		}
+
+		BVH_Node* split_SBVH(std::vector<SBVH_Reference> references, int depth, float root_area, std::atomic<int>& duplication_budget, std::atomic<int>& node_count)
+		{
+			AABB_3D bounding_volume;
+			AABB_3D AABB_of_all_centroids;
+			for (const SBVH_Reference& reference : references)
+			{
+				bounding_volume = bounding_volume.Union_with_3D_AABB(reference.bounding_volume);
+				AABB_of_all_centroids = AABB_of_all_centroids.Union_with_point(reference.bounding_volume.center_vector());
+			}
+
+			int reference_count = (int)references.size();
+			bool fits_in_leaf = (reference_count <= m_maximum_primitives_in_leaf);
+			std::vector<SBVH_Reference> left_references;
+			std::vector<SBVH_Reference> right_references;
+			int dividing_axis = AABB_of_all_centroids.longest_axis();
+
+			if ((reference_count > 1) && (depth < maximum_SAH_depth))
+			{
+				int object_axis = -1;
+				int object_bucket = -1;
+				float object_cost = std::numeric_limits<float>::max();
+				find_SAH_split(
+					reference_count,
+					[&](int i) -> const AABB_3D& { return references[i].bounding_volume; },
+					[&](int i) { return references[i].bounding_volume.center_vector(); },
+					bounding_volume, AABB_of_all_centroids, object_axis, object_bucket, object_cost
+				);
+				auto is_left_of_object_split = [&](const SBVH_Reference& reference)
+				{
+					return SAH_bucket_of(reference.bounding_volume.center_vector(), AABB_of_all_centroids, object_axis) <= object_bucket;
+				};
+
+				// Spatial splits are only worth looking for when the children of the best object split overlap noticeably:
+				bool children_overlap = true;
+				if (object_axis >= 0)
+				{
+					AABB_3D left_box;
+					AABB_3D right_box;
+					for (const SBVH_Reference& reference : references)
+					{
+						AABB_3D& side_box = is_left_of_object_split(reference) ? left_box : right_box;
+						side_box = side_box.Union_with_3D_AABB(reference.bounding_volume);
+					}
+					children_overlap = left_box.intersects_with_3D_AABB(right_box) &&
+						(left_box.Intersection_with_3D_AABB(right_box).total_area() > spatial_split_overlap_threshold * root_area);
+				}
+				int spatial_axis = -1;
+				float spatial_plane = 0.0f;
+				float spatial_cost = std::numeric_limits<float>::max();
+				if (children_overlap && (duplication_budget > 0))
+				{
+					find_spatial_split(references, bounding_volume, spatial_axis, spatial_plane, spatial_cost);
+				}
+
+				float leaf_cost = SAH_intersection_cost * reference_count;
+				float best_cost = std::min(object_cost, spatial_cost);
+				if (fits_in_leaf && (leaf_cost <= best_cost))	// also the case if there is no split at all
+				{
+					return build_SBVH_leaf(references, bounding_volume, node_count);
+				}
+				if ((spatial_axis >= 0) && (spatial_cost < object_cost))
+				{
+					divide_by_spatial_split(references, spatial_axis, spatial_plane, duplication_budget, left_references, right_references);
+					dividing_axis = spatial_axis;
+				}
+				if ((left_references.empty() || right_references.empty()) && (object_axis >= 0))
+				{
+					left_references.clear();
+					right_references.clear();
+					for (const SBVH_Reference& reference : references)
+					{
+						(is_left_of_object_split(reference) ? left_references : right_references).push_back(reference);
+					}
+					dividing_axis = object_axis;
+				}
+			}
+			else if (fits_in_leaf)
+			{
+				return build_SBVH_leaf(references, bounding_volume, node_count);
+			}
+
+			if (left_references.empty() || right_references.empty())	// median split
+			{
+				left_references.clear();
+				right_references.clear();
+				int dividing = reference_count / 2;
+				std::nth_element(references.begin(), references.begin() + dividing, references.end(),
+					[dividing_axis](const SBVH_Reference& a, const SBVH_Reference& b)
+					{
+						return (a.bounding_volume.center_vector()[dividing_axis] < b.bounding_volume.center_vector()[dividing_axis]);
+					}
+				);
+				left_references.assign(references.begin(), references.begin() + dividing);
+				right_references.assign(references.begin() + dividing, references.end());
+			}
+			std::vector<SBVH_Reference>().swap(references);		// the children have their own copies
+
+			node_count++;
+			BVH_Node* local_root = new BVH_Node();
+			if (reference_count >= parallel_build_threshold)
+			{
+				std::array<int, 2> halves{ 0, 1 };
+				std::for_each(std::execution::par, halves.begin(), halves.end(),
+					[&](int half)
+					{
+						if (half == 0)
+						{
+							local_root->left = split_SBVH(std::move(left_references), depth + 1, root_area, duplication_budget, node_count);
+						}
+						else
+						{
+							local_root->right = split_SBVH(std::move(right_references), depth + 1, root_area, duplication_budget, node_count);
+						}
+					}
+				);
+			}
+			else
+			{
+				local_root->left = split_SBVH(std::move(left_references), depth + 1, root_area, duplication_budget, node_count);
+				local_root->right = split_SBVH(std::move(right_references), depth + 1, root_area, duplication_budget, node_count);
+			}
+			local_root->split_axis = dividing_axis;
+			local_root->bounding_volume = local_root->left->bounding_volume.Union_with_3D_AABB(local_root->right->bounding_volume);	// mesh_area is summed up by lay_out_SBVH_leaves
+
+			return local_root;
+		}
+
+		BVH_Node* build_SBVH_leaf(const std::vector<SBVH_Reference>& references, const AABB_3D& bounding_volume, std::atomic<int>& node_count)
+		{
+			node_count++;
+			BVH_Node* leaf = new BVH_Node();
+			leaf->bounding_volume = bounding_volume;
+			for (const SBVH_Reference& reference : references)
+			{
+				leaf->SBVH_primitive_indices.push_back(reference.primitive_index);
+			}
+			return leaf;
+		}
+
+		void find_spatial_split(const std::vector<SBVH_Reference>& references, const AABB_3D& bounding_volume, int& best_axis, float& best_plane, float& best_cost) const
+		// Binned spatial split: cut the node into spatial_bin_count equal-width slabs along each axis and clip every reference
+		// into the slabs it spans. A reference enters at its first slab and exits at its last one, so the split after slab i
+		// has (entries up to i) references on the left and (exits after i) on the right, the straddling ones counted on both sides.
+		{
+			struct Bin
+			{
+				AABB_3D bounding_volume;
+				int entries = 0;
+				int exits = 0;
+			};
+
+			float parent_area = (float)bounding_volume.total_area();
+			if (!(parent_area > 0.0f))
+			{
+				parent_area = 1.0f;
+			}
+
+			glm::vec3 extent = bounding_volume.diagonal_vector();
+			for (int axis = X_axis; axis <= Z_axis; axis++)
+			{
+				if (!(extent[axis] > 0.0f))
+				{
+					continue;
+				}
+				float origin = bounding_volume.min_slab_values[axis];
+				float bin_width = extent[axis] / spatial_bin_count;
+				auto bin_of = [&](float value)
+				{
+					return std::min(std::max((int)((value - origin) / bin_width), 0), spatial_bin_count - 1);
+				};
+
+				std::array<Bin, spatial_bin_count> bins;
+				for (const SBVH_Reference& reference : references)
+				{
+					int first_bin = bin_of(reference.bounding_volume.min_slab_values[axis]);
+					int last_bin = bin_of(reference.bounding_volume.max_slab_values[axis]);
+					bins[first_bin].entries++;
+					bins[last_bin].exits++;
+					if (first_bin == last_bin)
+					{
+						bins[first_bin].bounding_volume = bins[first_bin].bounding_volume.Union_with_3D_AABB(reference.bounding_volume);
+						continue;
+					}
+					for (int bin = first_bin; bin <= last_bin; bin++)
+					{
+						AABB_3D slab = reference.bounding_volume;
+						slab.min_slab_values[axis] = std::max(slab.min_slab_values[axis], origin + bin * bin_width);
+						slab.max_slab_values[axis] = std::min(slab.max_slab_values[axis], origin + (bin + 1) * bin_width);
+						bins[bin].bounding_volume = bins[bin].bounding_volume.Union_with_3D_AABB(m_primitive_set->GetClippedPrimitiveAABB(reference.primitive_index, slab));
+					}
+				}
+
+				// the same two sweeps as find_SAH_split:
+				std::array<float, spatial_bin_count - 1> right_weighted_area;
+				AABB_3D right_box;
+				int right_count = 0;
+				std::array<int, spatial_bin_count - 1> right_counts;
+				for (int i = spatial_bin_count - 1; i > 0; i--)
+				{
+					right_box = right_box.Union_with_3D_AABB(bins[i].bounding_volume);
+					right_count += bins[i].exits;
+					right_counts[i - 1] = right_count;
+					right_weighted_area[i - 1] = (right_count > 0) ? (right_count * (float)right_box.total_area()) : (0.0f);
+				}
+
+				AABB_3D left_box;
+				int left_count = 0;
+				for (int i = 0; i < spatial_bin_count - 1; i++)
+				{
+					left_box = left_box.Union_with_3D_AABB(bins[i].bounding_volume);
+					left_count += bins[i].entries;
+					if ((left_count == 0) || (right_counts[i] == 0))
+					{
+						continue;
+					}
+					float cost = SAH_traversal_cost + SAH_intersection_cost * (left_count * (float)left_box.total_area() + right_weighted_area[i]) / parent_area;
+					if (cost < best_cost)
+					{
+						best_cost = cost;
+						best_axis = axis;
+						best_plane = origin + (i + 1) * bin_width;
+					}
+				}
+			}
+		}
+
+		void divide_by_spatial_split(
+			const std::vector<SBVH_Reference>& references,
+			int axis,
+			float plane,
+			std::atomic<int>& duplication_budget,
+			std::vector<SBVH_Reference>& left_references,
+			std::vector<SBVH_Reference>& right_references
+		) const
+		// The references straddling the plane are clipped into both sides, as long as the duplication budget lasts.
+		// After that they go to the side of their centroid whole, which is still correct, just not as tight.
+		{
+			for (const SBVH_Reference& reference : references)
+			{
+				if (reference.bounding_volume.max_slab_values[axis] <= plane)
+				{
+					left_references.push_back(reference);
+					continue;
+				}
+				if (reference.bounding_volume.min_slab_values[axis] >= plane)
+				{
+					right_references.push_back(reference);
+					continue;
+				}
+				if (duplication_budget.fetch_sub(1) <= 0)	// case: out of budget
+				{
+					duplication_budget++;
+					(reference.bounding_volume.center_vector()[axis] < plane ? left_references : right_references).push_back(reference);
+					continue;
+				}
+
+				AABB_3D left_slab = reference.bounding_volume;
+				AABB_3D right_slab = reference.bounding_volume;
+				left_slab.max_slab_values[axis] = plane;
+				right_slab.min_slab_values[axis] = plane;
+				AABB_3D left_part = m_primitive_set->GetClippedPrimitiveAABB(reference.primitive_index, left_slab);
+				AABB_3D right_part = m_primitive_set->GetClippedPrimitiveAABB(reference.primitive_index, right_slab);
+				if (left_part.is_empty() || right_part.is_empty())	// case: the primitive itself doesn't cross the plane (only its box does)
+				{
+					duplication_budget++;
+					(left_part.is_empty() ? right_references : left_references).push_back(SBVH_Reference{ left_part.is_empty() ? right_part : left_part, reference.primitive_index });
+					continue;
+				}
+				left_references.push_back(SBVH_Reference{ left_part, reference.primitive_index });
+				right_references.push_back(SBVH_Reference{ right_part, reference.primitive_index });
+			}
+		}
+
+		int SAH_bucket_of(const glm::vec3& centroid, const AABB_3D& AABB_of_all_centroids, int axis) const
+		{
+			int bucket = (int)(SAH_bucket_count * AABB_of_all_centroids.scaled_by_the_box(centroid)[axis]);
+			return std::min(std::max(bucket, 0), SAH_bucket_count - 1);		// the centroid on the max slab would otherwise land in bucket SAH_bucket_count
+		}
+
+		template <typename BoundingVolumeOf, typename CentroidOf>
+		void find_SAH_split(
+			int primitive_count,
+			BoundingVolumeOf bounding_volume_of,	// int i -> the bounding volume of the i-th primitive (or reference) of the node
+			CentroidOf centroid_of,					// int i -> the centroid of the i-th primitive (or reference) of the node
+			const AABB_3D& bounding_volume,
+			const AABB_3D& AABB_of_all_centroids,
+			int& best_axis,
+			int& best_bucket,
+			float& best_cost
+		) const
+		// Binned SAH: drop the centroids into SAH_bucket_count equal-width buckets along each axis,
+		// then evaluate the SAH cost of splitting after each bucket, and keep the cheapest split over all three axes.
+		// best_axis stays -1 if the centroids coincide on every axis (i.e. no split is possible).
+		{
+			struct Bucket
+			{
+				int count = 0;
+				AABB_3D bounding_volume;
+			};
+
+			float parent_area = (float)bounding_volume.total_area();
+			if (!(parent_area > 0.0f))	// degenerate box (e.g. a single line): every split is equally good
+			{
+				parent_area = 1.0f;
+			}
+
+			glm::vec3 centroid_extent = AABB_of_all_centroids.diagonal_vector();
+			for (int axis = X_axis; axis <= Z_axis; axis++)
+			{
+				if (!(centroid_extent[axis] > 0.0f))
+				{
+					continue;
+				}
+
+				std::array<Bucket, SAH_bucket_count> buckets;
+				for (int i = 0; i < primitive_count; i++)
+				{
+					Bucket& bucket = buckets[SAH_bucket_of(centroid_of(i), AABB_of_all_centroids, axis)];
+					bucket.count++;
+					bucket.bounding_volume = bucket.bounding_volume.Union_with_3D_AABB(bounding_volume_of(i));
+				}
+
+				// sweep from the right to get the cost of everything after each candidate split:
+				std::array<float, SAH_bucket_count - 1> right_weighted_area;	// count * area of the right side for the split after bucket i
+				AABB_3D right_box;
+				int right_count = 0;
+				for (int i = SAH_bucket_count - 1; i > 0; i--)
+				{
+					right_box = right_box.Union_with_3D_AABB(buckets[i].bounding_volume);
+					right_count += buckets[i].count;
+					right_weighted_area[i - 1] = (right_count > 0) ? (right_count * (float)right_box.total_area()) : (0.0f);
+				}
+
+				// then sweep from the left and evaluate each split:
+				AABB_3D left_box;
+				int left_count = 0;
+				for (int i = 0; i < SAH_bucket_count - 1; i++)
+				{
+					left_box = left_box.Union_with_3D_AABB(buckets[i].bounding_volume);
+					left_count += buckets[i].count;
+					if ((left_count == 0) || (left_count == primitive_count))	// one side is empty, not a split at all
+					{
+						continue;
+					}
+					float cost = SAH_traversal_cost + SAH_intersection_cost * (left_count * (float)left_box.total_area() + right_weighted_area[i]) / parent_area;
+					if (cost < best_cost)
+					{
+						best_cost = cost;
+						best_axis = axis;
+						best_bucket = i;
+					}
+				}
+			}
+		}
+
+		// private data members:
+		std::unique_ptr<BVH_EntitySet> m_entity_set;	// null for a BVH over a BVH_PrimitiveSet someone else owns
+		const BVH_PrimitiveSet* m_primitive_set;		// m_entity_set.get() for a BVH over entities
+		std::vector<int> m_primitive_indices;			// ordered so that every leaf refers to a contiguous range
+		std::vector<Whitted::Entity*> m_primitives;		// the entities of m_primitive_indices (empty for a BVH over a BVH_PrimitiveSet), so that the queries don't go through the set
+		std::vector<int> m_same_type_run_lengths;		// per entity of m_primitives: how many entities from it on in its leaf have the same type
+		std::vector<BVH_LinearNode> m_nodes;			// depth-first, m_nodes[0] is the root
+		std::vector<float> m_node_mesh_areas;			// only needed for sampling, so kept out of the nodes
+		std::vector<char> m_is_duplicate_reference;		// empty unless spatial splits referred to a primitive more than once, see IsDuplicateReference()
+		std::vector<std::vector<int>> m_refit_levels;	// the node indices at each depth
+		float m_SAH_cost_at_rebuild = 0.0f;
+		std::unique_ptr<WideBVH<4>> m_wide_BVH_4;		// at most one of the four wide BVHs exists
+		std::unique_ptr<WideBVH<8>> m_wide_BVH_8;
+		std::unique_ptr<CompressedWideBVH<4>> m_compressed_BVH_4;
+		std::unique_ptr<CompressedWideBVH<8>> m_compressed_BVH_8;
+		bool m_compress_nodes = false;
+		NodeLayout m_node_layout = NodeLayout::Depth_First;
+		bool m_counting_traversals = false;
+		struct
+		{
+			std::atomic<uint64_t> query_count{ 0 };
+			std::atomic<uint64_t> nodes_visited{ 0 };
+			std::atomic<uint64_t> box_tests{ 0 };
+			std::atomic<uint64_t> primitive_tests{ 0 };
+		} mutable m_traversal_counters;		// see SetTraversalCounting()
+		DividingMethod m_dividing_method;
+		int m_maximum_primitives_in_leaf;
+		BranchingFactor m_branching_factor;
+		float m_maximum_reference_duplication;
+
+		static constexpr int SAH_bucket_count = 16;
+		static constexpr float SAH_traversal_cost = 0.125f;		// relative to the cost of one primitive intersection test
+		static constexpr float SAH_intersection_cost = 1.0f;
+		static constexpr int maximum_SAH_depth = 32;
+		static constexpr int traversal_stack_size = 64;		// >= maximum_SAH_depth + log2(number of primitives)
+		static constexpr int parallel_build_threshold = 4096;	// subtrees with fewer primitives are built on the calling thread
+		static constexpr int spatial_bin_count = 32;
+		static constexpr float spatial_split_overlap_threshold = 1e-5f;		// relative to the area of the root, see Stich et al. 2009
+		static constexpr int treelet_size_in_bytes = 4096;		// a page
 	};
 
 }
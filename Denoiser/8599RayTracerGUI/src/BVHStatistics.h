@@ -0,0 +1,91 @@
+/*****************************************************************//**
+ * \file   BVHStatistics.h
+ * \brief  Quality and traversal statistics of the bounding volume hierarchies
+ *
+ * \author Xiaoyang Liu
+ * \date   October 2026
+ *********************************************************************/
+
+#ifndef BVHSTATISTICS_H
+#define BVHSTATISTICS_H
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cstdint>
+
+namespace AccelerationStructure
+{
+	struct BVH_Statistics
+	// How good a built BVH is, see BVH::GetStatistics(). Compare these before and after changing the builder settings.
+	{
+		int primitive_count = 0;
+		int reference_count = 0;			// more than primitive_count when spatial splits refer to a primitive from several leaves
+		int node_count = 0;					// binary nodes
+		int leaf_count = 0;
+		int wide_node_count = 0;			// 0 without a wide BVH
+		int maximum_depth = 0;
+		std::vector<int> leaf_depth_histogram;	// leaf_depth_histogram[depth]: the number of leaves at that depth (the root is at depth 0)
+		float SAH_cost = 0.0f;
+		float average_leaf_size = 0.0f;		// references per leaf
+		float reference_duplication = 0.0f;	// extra references per primitive
+		size_t node_memory_in_bytes = 0;	// of the nodes the ray queries walk through
+
+		std::string ToJSON() const
+		{
+			std::ostringstream json;
+			json << "{\"primitive_count\": " << primitive_count
+				<< ", \"reference_count\": " << reference_count
+				<< ", \"node_count\": " << node_count
+				<< ", \"leaf_count\": " << leaf_count
+				<< ", \"wide_node_count\": " << wide_node_count
+				<< ", \"maximum_depth\": " << maximum_depth
+				<< ", \"leaf_depth_histogram\": [";
+			for (size_t depth = 0; depth < leaf_depth_histogram.size(); depth++)
+			{
+				json << ((depth > 0) ? ", " : "") << leaf_depth_histogram[depth];
+			}
+			json << "], \"SAH_cost\": " << SAH_cost
+				<< ", \"average_leaf_size\": " << average_leaf_size
+				<< ", \"reference_duplication\": " << reference_duplication
+				<< ", \"node_memory_in_bytes\": " << node_memory_in_bytes << "}";
+			return json.str();
+		}
+	};
+
+	struct BVH_TraversalStatistics
+	// What the ray queries on a BVH have cost since the counters were last reset, see BVH::SetTraversalCounting().
+	{
+		uint64_t query_count = 0;		// closest-hit and any-hit queries
+		uint64_t nodes_visited = 0;
+		uint64_t box_tests = 0;			// one per child of a visited wide node, one per visited binary node
+		uint64_t primitive_tests = 0;	// an entity with its own BVH (e.g. TriangleMesh) counts as one here, and counts its own tests in its BVH
+
+		BVH_TraversalStatistics& operator+=(const BVH_TraversalStatistics& other)
+		// to add up the statistics of the scene BVH and of the mesh BVHs
+		{
+			query_count += other.query_count;
+			nodes_visited += other.nodes_visited;
+			box_tests += other.box_tests;
+			primitive_tests += other.primitive_tests;
+			return *this;
+		}
+
+		std::string ToJSON(uint64_t ray_count) const
+		// ray_count: what to average over, e.g. the number of queries on the scene BVH
+		{
+			double per_ray = (ray_count > 0) ? (1.0 / ray_count) : (0.0);
+			std::ostringstream json;
+			json << "{\"query_count\": " << query_count
+				<< ", \"nodes_visited\": " << nodes_visited
+				<< ", \"box_tests\": " << box_tests
+				<< ", \"primitive_tests\": " << primitive_tests
+				<< ", \"nodes_visited_per_ray\": " << nodes_visited * per_ray
+				<< ", \"box_tests_per_ray\": " << box_tests * per_ray
+				<< ", \"primitive_tests_per_ray\": " << primitive_tests * per_ray << "}";
+			return json.str();
+		}
+	};
+}
+
+#endif // !BVHSTATISTICS_H
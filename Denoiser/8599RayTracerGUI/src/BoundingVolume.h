@@ -12,6 +12,14 @@
 #include <limits>
 #include <array>
 
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define BOUNDINGVOLUME_HAS_SSE
+#endif
+#if defined(__AVX__)
+#define BOUNDINGVOLUME_HAS_AVX
+#endif
+
 #include "Ray.h"
 
 namespace AccelerationStructure
@@ -65,7 +73,7 @@ namespace AccelerationStructure
 			// return true for inf large box versus a point that is infinitely far
 		}
 
-		bool intersects_with_3D_AABB(const AABB_3D& box)
+		bool intersects_with_3D_AABB(const AABB_3D& box) const
 		{
 			return (
 				(max_slab_values.x >= box.min_slab_values.x) && (min_slab_values.x <= box.max_slab_values.x)
@@ -78,7 +86,24 @@ namespace AccelerationStructure
 			// and return false when evaluating box of nothing versus anything except box of everything
 		}
 
-		AABB_3D Intersection_with_3D_AABB(const AABB_3D& box)
+		bool contains_3D_AABB(const AABB_3D& box) const
+		{
+			return (
+				(min_slab_values.x <= box.min_slab_values.x) && (box.max_slab_values.x <= max_slab_values.x)
+				&&
+				(min_slab_values.y <= box.min_slab_values.y) && (box.max_slab_values.y <= max_slab_values.y)
+				&&
+				(min_slab_values.z <= box.min_slab_values.z) && (box.max_slab_values.z <= max_slab_values.z)
+				);
+		}
+
+		bool is_empty() const
+		// true for the box of nothing (and for any box whose min slab is beyond its max slab)
+		{
+			return (min_slab_values.x > max_slab_values.x) || (min_slab_values.y > max_slab_values.y) || (min_slab_values.z > max_slab_values.z);
+		}
+
+		AABB_3D Intersection_with_3D_AABB(const AABB_3D& box) const
 		// This should be used logically AFTER bool intersects(const AABB_3D& box) returns true. Or the result may not be correct!
 		{
 			return AABB_3D
@@ -152,7 +177,7 @@ namespace AccelerationStructure
 			return (i == 0) ? (min_slab_values) : (max_slab_values);
 		}
 
-		AABB_3D Union_with_point(const glm::vec3& point)
+		AABB_3D Union_with_point(const glm::vec3& point) const
 		{
 			AABB_3D union_box;
 			union_box.min_slab_values = glm::min(min_slab_values, point);
@@ -161,7 +186,7 @@ namespace AccelerationStructure
 			// Note that such union will never result in a shrinked box
 		}
 
-		AABB_3D Union_with_3D_AABB(const AABB_3D& box)
+		AABB_3D Union_with_3D_AABB(const AABB_3D& box) const
 		{
 			AABB_3D union_box;
 			union_box.min_slab_values = glm::min(min_slab_values, box.min_slab_values);
@@ -174,7 +199,19 @@ namespace AccelerationStructure
 			const Ray& ray, 
 			const glm::vec3& ray_direction_reciprocal, // multiplication is (slightly) faster than division
 			const std::array<int,3>& ray_direction_is_negative
-		)
+		) const
+		{
+			float t_entry;
+			return intersects_with_ray(ray, ray_direction_reciprocal, ray_direction_is_negative, std::numeric_limits<float>::max(), t_entry);
+		}
+
+		bool intersects_with_ray(
+			const Ray& ray, 
+			const glm::vec3& ray_direction_reciprocal, // multiplication is (slightly) faster than division
+			const std::array<int,3>& ray_direction_is_negative,
+			float t_max,		// the box is missed if the ray only enters it beyond t_max (e.g. behind the closest hit found so far)
+			float& t_entry		// where the ray enters the box (negative if the ray origin is inside the box), only valid if returning true
+		) const
 		// We assume there is no perfectly axis-aligned ray, so that the intersection point for each slab exists and is unique.
 		{
 			float t_in_x = (min_slab_values.x - ray.m_origin.x) * ray_direction_reciprocal.x;
@@ -207,8 +244,9 @@ namespace AccelerationStructure
 			float t_in = std::max(t_in_x, std::max(t_in_y, t_in_z));
 			float t_out = std::min(t_out_x, std::min(t_out_y, t_out_z));
 
-			if (t_out >= 0 && t_in <= t_out)
+			if (t_out >= 0 && t_in <= t_out && t_in <= t_max)
 			{
+				t_entry = t_in;
 				return true;
 			}
 			return false;
@@ -223,6 +261,144 @@ namespace AccelerationStructure
 		glm::vec3 min_slab_values;
 		glm::vec3 max_slab_values;
 	};
+
+	template <int Width>
+	class AABB_3D_SoA
+	// Width boxes stored as structure-of-arrays (e.g. the children of a wide BVH node),
+	// so that one ray can be tested against all of them with one SIMD slab test.
+	{
+	public:
+		static_assert(Width == 4 || Width == 8, "a SIMD register holds 4 (SSE) or 8 (AVX) floats");
+
+		AABB_3D_SoA()	// Width boxes that contain nothing
+		{
+			for (int lane = 0; lane < Width; lane++)
+			{
+				set(lane, AABB_3D{});
+			}
+		}
+
+		enum Uninitialized { uninitialized };
+		explicit AABB_3D_SoA(Uninitialized)	// for boxes that are about to be overwritten anyway, e.g. decompressed ones
+		{
+		}
+
+		void set(int lane, const AABB_3D& box)
+		{
+			min_x[lane] = box.min_slab_values.x;
+			min_y[lane] = box.min_slab_values.y;
+			min_z[lane] = box.min_slab_values.z;
+			max_x[lane] = box.max_slab_values.x;
+			max_y[lane] = box.max_slab_values.y;
+			max_z[lane] = box.max_slab_values.z;
+		}
+
+		AABB_3D get(int lane) const
+		{
+			AABB_3D box;
+			box.min_slab_values = glm::vec3{ min_x[lane], min_y[lane], min_z[lane] };
+			box.max_slab_values = glm::vec3{ max_x[lane], max_y[lane], max_z[lane] };
+			return box;
+		}
+
+		int intersects_with_ray(
+			const Ray& ray,
+			const glm::vec3& ray_direction_reciprocal,
+			const std::array<int, 3>& ray_direction_is_negative,
+			float t_max,
+			std::array<float, Width>& t_entry
+		) const
+		// The same test as AABB_3D::intersects_with_ray, for all the Width boxes at once.
+		// Returns a bit mask with bit i set if box i is hit, and writes the entry distance of every box into t_entry.
+		{
+			// Instead of swapping t_in and t_out afterwards, we pick the near and far slabs up front according to the sign of the direction:
+			const float* near_x = ray_direction_is_negative[0] ? max_x.data() : min_x.data();
+			const float* near_y = ray_direction_is_negative[1] ? max_y.data() : min_y.data();
+			const float* near_z = ray_direction_is_negative[2] ? max_z.data() : min_z.data();
+			const float* far_x = ray_direction_is_negative[0] ? min_x.data() : max_x.data();
+			const float* far_y = ray_direction_is_negative[1] ? min_y.data() : max_y.data();
+			const float* far_z = ray_direction_is_negative[2] ? min_z.data() : max_z.data();
+
+#if defined(BOUNDINGVOLUME_HAS_AVX)
+			if constexpr (Width == 8)
+			{
+				__m256 origin_x = _mm256_set1_ps(ray.m_origin.x);
+				__m256 origin_y = _mm256_set1_ps(ray.m_origin.y);
+				__m256 origin_z = _mm256_set1_ps(ray.m_origin.z);
+				__m256 reciprocal_x = _mm256_set1_ps(ray_direction_reciprocal.x);
+				__m256 reciprocal_y = _mm256_set1_ps(ray_direction_reciprocal.y);
+				__m256 reciprocal_z = _mm256_set1_ps(ray_direction_reciprocal.z);
+
+				__m256 t_in = _mm256_max_ps(
+					_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_x), origin_x), reciprocal_x),
+					_mm256_max_ps(
+						_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_y), origin_y), reciprocal_y),
+						_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_z), origin_z), reciprocal_z)));
+				__m256 t_out = _mm256_min_ps(
+					_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_x), origin_x), reciprocal_x),
+					_mm256_min_ps(
+						_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_y), origin_y), reciprocal_y),
+						_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_z), origin_z), reciprocal_z)));
+
+				// t_out >= 0 && t_in <= t_out && t_in <= t_max:
+				__m256 hit = _mm256_and_ps(
+					_mm256_cmp_ps(t_out, _mm256_setzero_ps(), _CMP_GE_OQ),
+					_mm256_and_ps(_mm256_cmp_ps(t_in, t_out, _CMP_LE_OQ), _mm256_cmp_ps(t_in, _mm256_set1_ps(t_max), _CMP_LE_OQ)));
+				_mm256_storeu_ps(t_entry.data(), t_in);
+				return _mm256_movemask_ps(hit);
+			}
+#endif
+#if defined(BOUNDINGVOLUME_HAS_SSE)
+			if constexpr (Width == 4)
+			{
+				__m128 origin_x = _mm_set1_ps(ray.m_origin.x);
+				__m128 origin_y = _mm_set1_ps(ray.m_origin.y);
+				__m128 origin_z = _mm_set1_ps(ray.m_origin.z);
+				__m128 reciprocal_x = _mm_set1_ps(ray_direction_reciprocal.x);
+				__m128 reciprocal_y = _mm_set1_ps(ray_direction_reciprocal.y);
+				__m128 reciprocal_z = _mm_set1_ps(ray_direction_reciprocal.z);
+
+				__m128 t_in = _mm_max_ps(
+					_mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_x), origin_x), reciprocal_x),
+					_mm_max_ps(
+						_mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_y), origin_y), reciprocal_y),
+						_mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_z), origin_z), reciprocal_z)));
+				__m128 t_out = _mm_min_ps(
+					_mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_x), origin_x), reciprocal_x),
+					_mm_min_ps(
+						_mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_y), origin_y), reciprocal_y),
+						_mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_z), origin_z), reciprocal_z)));
+
+				__m128 hit = _mm_and_ps(
+					_mm_cmpge_ps(t_out, _mm_setzero_ps()),
+					_mm_and_ps(_mm_cmple_ps(t_in, t_out), _mm_cmple_ps(t_in, _mm_set1_ps(t_max))));
+				_mm_storeu_ps(t_entry.data(), t_in);
+				return _mm_movemask_ps(hit);
+			}
+#endif
+			// scalar fallback (e.g. 8 boxes without AVX):
+			int hit_mask = 0;
+			for (int lane = 0; lane < Width; lane++)
+			{
+				float t_in = std::max((near_x[lane] - ray.m_origin.x) * ray_direction_reciprocal.x, std::max((near_y[lane] - ray.m_origin.y) * ray_direction_reciprocal.y, (near_z[lane] - ray.m_origin.z) * ray_direction_reciprocal.z));
+				float t_out = std::min((far_x[lane] - ray.m_origin.x) * ray_direction_reciprocal.x, std::min((far_y[lane] - ray.m_origin.y) * ray_direction_reciprocal.y, (far_z[lane] - ray.m_origin.z) * ray_direction_reciprocal.z));
+				t_entry[lane] = t_in;
+				if (t_out >= 0 && t_in <= t_out && t_in <= t_max)
+				{
+					hit_mask |= (1 << lane);
+				}
+			}
+			return hit_mask;
+		}
+
+	public:		// Data members (aligned for the SIMD loads):
+		alignas(sizeof(float) * Width) std::array<float, Width> min_x;
+		alignas(sizeof(float) * Width) std::array<float, Width> min_y;
+		alignas(sizeof(float) * Width) std::array<float, Width> min_z;
+		alignas(sizeof(float) * Width) std::array<float, Width> max_x;
+		alignas(sizeof(float) * Width) std::array<float, Width> max_y;
+		alignas(sizeof(float) * Width) std::array<float, Width> max_z;
+	};
 }
 
 #endif // !BOUNDINGVOLUME_H
\ No newline at end of file
@@ -13,6 +13,7 @@
 #include "VectorFloat.h"
 #include "BoundingVolume.h"
 #include "IntersectionRecord.h"
+#include "RayPacket.h"
 
 namespace Whitted
 {
@@ -41,6 +42,93 @@ namespace Whitted
 
 		virtual IntersectionRecord GetIntersectionRecord(AccelerationStructure::Ray ray) = 0;
 
+		virtual bool GetClosestHit(const AccelerationStructure::Ray& ray, Hit& hit)
+		// Closest-hit query during a traversal: if the ray hits this entity at some t in [ray.t_min, ray.t_max),
+		// overwrite hit with the closest such hit and return true. Only GetSurfaceInteraction() needs to understand hit.primitive_index.
+		// Override this (and GetSurfaceInteraction) whenever a hit is cheaper to find than a full IntersectionRecord.
+		{
+			IntersectionRecord record = GetIntersectionRecord(ray);
+			if (record.has_intersection && (record.t >= ray.t_min) && (record.t < ray.t_max))
+			{
+				hit.t = (float)record.t;
+				hit.primitive_index = 0;
+				return true;
+			}
+			return false;
+		}
+
+		virtual IntersectionRecord GetSurfaceInteraction(const AccelerationStructure::Ray& ray, const Hit&)
+		// The full record of a hit found by GetClosestHit() with the same ray. By default, the entity is simply intersected again.
+		{
+			return GetIntersectionRecord(ray);
+		}
+
+		virtual bool IntersectsWithin(AccelerationStructure::Ray ray, double maximum_t)
+		// Any-hit query (e.g. for shadow rays): whether the ray hits this entity at some t in [ray.t_min, maximum_t).
+		// Override this whenever the answer is cheaper to get than a full IntersectionRecord.
+		{
+			IntersectionRecord record = GetIntersectionRecord(ray);
+			return record.has_intersection && (record.t >= ray.t_min) && (record.t < maximum_t);
+		}
+
+		virtual int GetClosestHitInRange(Entity* const* entities, int entity_count, AccelerationStructure::Ray& bounded_ray, Hit& hit)
+		// GetClosestHit() over entities[0, entity_count), which all have the same type as this entity (the BVH calls this on the first of them,
+		// so it dispatches once per run of same-type entities in a leaf). Shrinks bounded_ray.t_max to any closer hit, and returns the index
+		// of the entity hit closest (-1: none). Derive from TypedEntity to get this without a virtual call per entity.
+		{
+			int closest_entity_index = -1;
+			for (int i = 0; i < entity_count; i++)
+			{
+				if (entities[i]->GetClosestHit(bounded_ray, hit))
+				{
+					closest_entity_index = i;
+					bounded_ray.t_max = hit.t;
+				}
+			}
+			return closest_entity_index;
+		}
+
+		virtual bool IntersectsWithinRange(Entity* const* entities, int entity_count, const AccelerationStructure::Ray& ray, double maximum_t)
+		// IntersectsWithin() over entities[0, entity_count), see GetClosestHitInRange().
+		{
+			for (int i = 0; i < entity_count; i++)
+			{
+				if (entities[i]->IntersectsWithin(ray, maximum_t))
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		virtual uint64_t GetClosestHitsInPacket(AccelerationStructure::RayPacket& packet, int first_ray_index, int last_ray_index, Hit* hits)
+		// GetClosestHit() for each ray packet.rays[i] with i in [first_ray_index, last_ray_index), against hits[i]. Shrinks the t_max of the rays
+		// hit closer, and returns them as a bit mask (bit i for packet.rays[i]). Override this if the entity can trace the packet as a whole.
+		{
+			uint64_t hit_mask = 0;
+			for (int i = first_ray_index; i < last_ray_index; i++)
+			{
+				if (GetClosestHit(packet.rays[i], hits[i]))
+				{
+					packet.rays[i].t_max = hits[i].t;
+					hit_mask |= uint64_t{ 1 } << i;
+				}
+			}
+			return hit_mask;
+		}
+
+		virtual AccelerationStructure::AABB_3D GetClippedAABB(const AccelerationStructure::AABB_3D& box)
+		// The bounding volume of the part of this entity inside the box (contains nothing if there is no such part), used by spatial splits.
+		// By default this is just the overlap of the two boxes, which is conservative. Override this if the entity can be clipped more tightly.
+		{
+			AccelerationStructure::AABB_3D bounding_volume = Get3DAABB();
+			if (!bounding_volume.intersects_with_3D_AABB(box))
+			{
+				return AccelerationStructure::AABB_3D{};
+			}
+			return bounding_volume.Intersection_with_3D_AABB(box);
+		}
+
 		virtual void GetHitInfo(
 			const glm::vec3& intersection, 
 			const glm::vec3& light_direction, 
@@ -55,6 +143,40 @@ namespace Whitted
 		int id = -1;	// for temporal denoising
 
 	};
+
+	template <typename Derived>
+	class TypedEntity : public Entity
+	// Base of an entity type that the BVH leaves can test a whole run of at once: the loops below call Derived's
+	// GetClosestHit() and IntersectsWithin() directly, so they can be inlined. Derived should be final, otherwise
+	// a subclass of it would be tested as a Derived.
+	{
+	public:
+		virtual int GetClosestHitInRange(Entity* const* entities, int entity_count, AccelerationStructure::Ray& bounded_ray, Hit& hit) override
+		{
+			int closest_entity_index = -1;
+			for (int i = 0; i < entity_count; i++)
+			{
+				if (static_cast<Derived*>(entities[i])->Derived::GetClosestHit(bounded_ray, hit))
+				{
+					closest_entity_index = i;
+					bounded_ray.t_max = hit.t;
+				}
+			}
+			return closest_entity_index;
+		}
+
+		virtual bool IntersectsWithinRange(Entity* const* entities, int entity_count, const AccelerationStructure::Ray& ray, double maximum_t) override
+		{
+			for (int i = 0; i < entity_count; i++)
+			{
+				if (static_cast<Derived*>(entities[i])->Derived::IntersectsWithin(ray, maximum_t))
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+	};
 }
 
 #endif // !ENTITY_H
\ No newline at end of file
@@ -15,6 +15,15 @@ namespace Whitted
 {
 	class Entity;
 
+	struct Hit
+	// What a closest-hit query carries while it traverses the scene: where along the ray, and which primitive of the entity.
+	// The full IntersectionRecord is only filled in once, for the closest hit in the end (see Entity::GetSurfaceInteraction).
+	{
+		float t = std::numeric_limits<float>::max();
+		int primitive_index = -1;		// e.g. the triangle of a TriangleMesh, -1: no hit
+		glm::vec2 barycentric_coordinates{ 0.0f, 0.0f };	// of the hit on that triangle (of its second and third vertices), if any
+	};
+
 	class IntersectionRecord
 	{
 	public:
@@ -0,0 +1,249 @@
+/*****************************************************************//**
+ * \file   MeshInstance.h
+ * \brief  A placement of a shared triangle mesh in the scene (the bottom level of a two-level acceleration structure)
+ * 
+ * \author Xiaoyang Liu
+ * \date   October 2026
+ *********************************************************************/
+
+#ifndef MESHINSTANCE_H
+#define MESHINSTANCE_H
+
+#include <algorithm>
+#include <vector>
+
+#include "TriangleMesh.h"
+
+namespace Whitted
+{
+	class MeshInstance final : public TypedEntity<MeshInstance>
+	/*
+	The scene BVH (the top level) is built over entities, and a MeshInstance is an entity that places a TriangleMesh
+	(whose own BVH is the bottom level) with an affine transform. Many instances can share one mesh, so 1000 bunnies
+	cost one copy of the triangles and of their BVH.
+	Rays are transformed into the object space of the mesh instead of transforming the mesh into world space.
+	We deliberately don't normalize the transformed direction, so that t means the same thing in both spaces.
+	*/
+	{
+	public:
+		MeshInstance(int& id_count, TriangleMesh* mesh, const glm::mat4& object_to_world)
+			: m_mesh(mesh)
+		{
+			m_object_to_world = glm::mat4x3{ object_to_world };		// drop the (0,0,0,1) row
+			m_world_to_object = glm::mat4x3{ glm::inverse(object_to_world) };
+			m_normal_to_world = glm::transpose(glm::mat3{ m_world_to_object });
+
+			// every instance gets its own block of primitive ids, so that the temporal denoiser can tell the instances apart:
+			first_primitive_id = id_count;
+			id_count += mesh->GetTriangleCount();
+
+			if (is_similarity(glm::mat3{ m_object_to_world }))
+			{
+				transformed_area = mesh->GetTransformedArea(m_object_to_world);
+			}
+			else	// case: the triangles are stretched by different amounts, so they are sampled by their transformed areas
+			{
+				m_cumulative_triangle_areas.resize(mesh->GetTriangleCount());
+				float cumulative_area = 0.0f;
+				for (int triangle_index = 0; triangle_index < mesh->GetTriangleCount(); triangle_index++)
+				{
+					std::array<glm::vec3, 3> vertices = get_transformed_triangle_vertices(triangle_index);
+					cumulative_area += 0.5f * glm::length(glm::cross(vertices[1] - vertices[0], vertices[2] - vertices[0]));
+					m_cumulative_triangle_areas[triangle_index] = cumulative_area;
+				}
+				transformed_area = cumulative_area;
+			}
+
+			// the box of the transformed box of the mesh:
+			AccelerationStructure::AABB_3D object_AABB = mesh->Get3DAABB();
+			for (int corner = 0; corner < 8; corner++)
+			{
+				glm::vec3 object_corner{ object_AABB[corner & 1].x, object_AABB[(corner >> 1) & 1].y, object_AABB[(corner >> 2) & 1].z };
+				bounding_AABB = bounding_AABB.Union_with_point(m_object_to_world * glm::vec4{ object_corner, 1.0f });
+			}
+		}
+
+		MeshInstance(const MeshInstance& instance, TriangleMesh* mesh)
+		// The same placement of another mesh, e.g. of the copy of instance's mesh in a NUMA replica of the scene.
+			: MeshInstance(instance)
+		{
+			m_mesh = mesh;
+		}
+
+		TriangleMesh* GetMesh() const
+		{
+			return m_mesh;
+		}
+
+		AccelerationStructure::Ray ToObjectSpace(const AccelerationStructure::Ray& ray) const
+		// The ray as the mesh sees it, e.g. the camera rays that lay out the BVH of the mesh (see TriangleMesh::SetBVHNodeLayout()).
+		{
+			return to_object_space(ray);
+		}
+
+		virtual float GetArea() override
+		{
+			return transformed_area;
+		}
+
+		virtual void Sampling(IntersectionRecord& sample, float& PDF) override
+		// A uniform point on the transformed mesh. A similarity scales every triangle by the same factor, so a point sampled uniformly
+		// in object space is uniform in world space too. Any other transform (non-uniform scale, shear) does not, so the triangle is
+		// picked by its transformed area instead.
+		{
+			PDF = 1.0f / transformed_area;
+			if (m_cumulative_triangle_areas.empty())
+			{
+				float object_PDF;
+				m_mesh->Sampling(sample, object_PDF);
+				sample.location = m_object_to_world * glm::vec4{ sample.location, 1.0f };
+				sample.surface_normal = Whitted::normalize(m_normal_to_world * sample.surface_normal);
+				return;
+			}
+			float area_sample = get_random_float_0_1() * transformed_area;
+			int triangle_index = (int)(std::upper_bound(m_cumulative_triangle_areas.begin(), m_cumulative_triangle_areas.end(), area_sample) - m_cumulative_triangle_areas.begin());
+			triangle_index = std::min(triangle_index, (int)m_cumulative_triangle_areas.size() - 1);
+			std::array<glm::vec3, 3> vertices = get_transformed_triangle_vertices(triangle_index);
+			// a uniform point on the triangle, see TrianglePrimitive::Sampling():
+			float x = 1 - std::sqrt(get_random_float_0_1());
+			float y = get_random_float_0_1();
+			sample.location = (x)*vertices[0] + ((1.0f - x) * (y)) * vertices[1] + ((1.0f - x) * (1.0f - y)) * vertices[2];
+			sample.surface_normal = Whitted::normalize(m_normal_to_world * m_mesh->GetTriangleNormal(triangle_index));
+			sample.emission = m_mesh->GetMaterial()->GetEmission();
+		}
+
+		virtual bool IsEmissive() override
+		{
+			return m_mesh->IsEmissive();
+		}
+
+		virtual AccelerationStructure::AABB_3D Get3DAABB() override
+		{
+			return bounding_AABB;
+		}
+
+		virtual glm::vec3 GetDiffuseColor(const glm::vec2& texture_coordinates) const override
+		{
+			return m_mesh->GetDiffuseColor(texture_coordinates);
+		}
+
+		virtual IntersectionRecord GetIntersectionRecord(AccelerationStructure::Ray ray) override
+		{
+			Hit hit;
+			if (!GetClosestHit(ray, hit))
+			{
+				return IntersectionRecord{};
+			}
+			return GetSurfaceInteraction(ray, hit);
+		}
+
+		virtual bool GetClosestHit(const AccelerationStructure::Ray& ray, Hit& hit) override
+		// t is the same in object space (the direction is not renormalized), so the hit can be taken as is.
+		{
+			return m_mesh->GetClosestHit(to_object_space(ray), hit);
+		}
+
+		virtual uint64_t GetClosestHitsInPacket(AccelerationStructure::RayPacket& packet, int first_ray_index, int last_ray_index, Hit* hits) override
+		// The affine transform keeps a common origin common, and Add() checks again whether the directions still agree in sign.
+		{
+			AccelerationStructure::RayPacket object_packet;
+			for (int i = 0; i < packet.GetRayCount(); i++)
+			{
+				object_packet.Add(to_object_space(packet.rays[i]));
+			}
+			uint64_t hit_mask = m_mesh->GetClosestHitsInPacket(object_packet, first_ray_index, last_ray_index, hits);
+			for (int i = first_ray_index; i < last_ray_index; i++)
+			{
+				packet.rays[i].t_max = object_packet.rays[i].t_max;
+			}
+			return hit_mask;
+		}
+
+		virtual IntersectionRecord GetSurfaceInteraction(const AccelerationStructure::Ray& ray, const Hit& hit) override
+		{
+			IntersectionRecord record = m_mesh->GetSurfaceInteraction(to_object_space(ray), hit);
+			record.location = ray(record.t);
+			record.surface_normal = Whitted::normalize(m_normal_to_world * record.surface_normal);
+			record.hitted_entity = this;
+			record.primitive_id = record.primitive_id - m_mesh->GetFirstPrimitiveId() + first_primitive_id;
+			return record;
+		}
+
+		virtual bool IntersectsWithin(AccelerationStructure::Ray ray, double maximum_t) override
+		{
+			return m_mesh->IntersectsWithin(to_object_space(ray), maximum_t);
+		}
+
+		virtual void GetHitInfo(
+			const glm::vec3& intersection,
+			const glm::vec3& light_direction,
+			const uint32_t& triangle_index,
+			const glm::vec2& barycentric_coordinates,
+			glm::vec3& surface_normal,
+			glm::vec2& texture_coordinates
+		) const override
+		{
+			m_mesh->GetHitInfo(
+				m_world_to_object * glm::vec4{ intersection, 1.0f },
+				m_world_to_object * glm::vec4{ light_direction, 0.0f },
+				triangle_index,
+				barycentric_coordinates,
+				surface_normal,
+				texture_coordinates
+			);
+			surface_normal = Whitted::normalize(m_normal_to_world * surface_normal);
+		}
+
+	private:
+
+		static bool is_similarity(const glm::mat3& linear_part)
+		// Whether the columns are orthogonal and of the same length, i.e. a rotation (or reflection) with a uniform scale.
+		{
+			glm::mat3 gram = glm::transpose(linear_part) * linear_part;
+			float scale_squared = (gram[0][0] + gram[1][1] + gram[2][2]) / 3.0f;
+			constexpr float tolerance = 1e-4f;
+			for (int i = 0; i < 3; i++)
+			{
+				for (int j = 0; j < 3; j++)
+				{
+					float expected = (i == j) ? (scale_squared) : (0.0f);
+					if (std::abs(gram[i][j] - expected) > tolerance * scale_squared)
+					{
+						return false;
+					}
+				}
+			}
+			return true;
+		}
+
+		std::array<glm::vec3, 3> get_transformed_triangle_vertices(int triangle_index) const
+		{
+			std::array<glm::vec3, 3> vertices = m_mesh->GetTriangleVertices(triangle_index);
+			for (glm::vec3& vertex : vertices)
+			{
+				vertex = m_object_to_world * glm::vec4{ vertex, 1.0f };
+			}
+			return vertices;
+		}
+
+		AccelerationStructure::Ray to_object_space(const AccelerationStructure::Ray& ray) const
+		{
+			AccelerationStructure::Ray object_ray{ m_world_to_object * glm::vec4{ ray.m_origin, 1.0f }, m_world_to_object * glm::vec4{ ray.m_direction, 0.0f } };
+			object_ray.t_min = ray.t_min;
+			object_ray.t_max = ray.t_max;
+			return object_ray;
+		}
+
+		// Data members:
+		TriangleMesh* m_mesh;		// shared, not owned
+		glm::mat4x3 m_object_to_world;	// 3x4 affine transforms (glm matrices are column-major: 4 columns of 3 rows)
+		glm::mat4x3 m_world_to_object;
+		glm::mat3 m_normal_to_world;	// normals transform with the inverse transpose
+		float transformed_area;
+		std::vector<float> m_cumulative_triangle_areas;	// of the transformed triangles, empty if m_object_to_world is a similarity
+		int first_primitive_id;
+		AccelerationStructure::AABB_3D bounding_AABB;
+	};
+}
+
+#endif // !MESHINSTANCE_H
@@ -0,0 +1,175 @@
+/*****************************************************************//**
+ * \file   NUMATopology.cpp
+ * \brief  Detecting the NUMA nodes and pinning threads to them (Windows and Linux)
+ *
+ * \author Xiaoyang Liu
+ * \date   October 2026
+ *********************************************************************/
+
+#include "NUMATopology.h"
+
+#include <algorithm>
+#include <thread>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX	// otherwise windows.h defines min and max as macros
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace Scheduling
+{
+	namespace
+	{
+#if defined(__linux__)
+		std::vector<int> parse_processor_list(const std::string& processor_list)
+		// e.g. "0-3,8-11" as in /sys/devices/system/node/node0/cpulist
+		{
+			std::vector<int> processors;
+			std::stringstream ranges(processor_list);
+			std::string range;
+			while (std::getline(ranges, range, ','))
+			{
+				size_t dash = range.find('-');
+				try
+				{
+					int first = std::stoi(range.substr(0, dash));
+					int last = (dash == std::string::npos) ? (first) : (std::stoi(range.substr(dash + 1)));
+					for (int processor = first; processor <= last; processor++)
+					{
+						processors.push_back(processor);
+					}
+				}
+				catch (const std::exception&)	// e.g. the empty list of a node without processors
+				{
+				}
+			}
+			return processors;
+		}
+#endif
+	}
+
+	const NUMATopology& NUMATopology::Get()
+	{
+		static const NUMATopology topology;
+		return topology;
+	}
+
+	NUMATopology::NUMATopology()
+	{
+#if defined(_WIN32)
+		ULONG highest_node_number = 0;
+		if (GetNumaHighestNodeNumber(&highest_node_number))
+		{
+			for (USHORT node_number = 0; node_number <= highest_node_number; node_number++)
+			{
+				GROUP_AFFINITY affinity{};
+				if (!GetNumaNodeProcessorMaskEx(node_number, &affinity))
+				{
+					continue;
+				}
+				Node node;
+				node.processor_group = affinity.Group;
+				for (int processor = 0; processor < (int)(8 * sizeof(KAFFINITY)); processor++)
+				{
+					if (affinity.Mask & ((KAFFINITY)1 << processor))
+					{
+						node.processors.push_back(processor);
+					}
+				}
+				if (!node.processors.empty())
+				{
+					m_nodes.push_back(node);
+				}
+			}
+		}
+#elif defined(__linux__)
+		std::vector<std::pair<int, Node>> numbered_nodes;
+		std::error_code error;
+		for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator("/sys/devices/system/node", error))
+		{
+			std::string name = entry.path().filename().string();
+			if ((name.rfind("node", 0) != 0) || (name.size() == 4) || (!std::all_of(name.begin() + 4, name.end(), ::isdigit)))
+			{
+				continue;
+			}
+			std::ifstream processor_list_file(entry.path() / "cpulist");
+			std::string processor_list;
+			std::getline(processor_list_file, processor_list);
+			Node node;
+			node.processors = parse_processor_list(processor_list);
+			if (!node.processors.empty())
+			{
+				numbered_nodes.emplace_back(std::stoi(name.substr(4)), node);
+			}
+		}
+		std::sort(numbered_nodes.begin(), numbered_nodes.end(),
+			[](const std::pair<int, Node>& a, const std::pair<int, Node>& b)
+			{
+				return a.first < b.first;
+			}
+		);
+		for (const auto& [node_number, node] : numbered_nodes)
+		{
+			m_nodes.push_back(node);
+		}
+#endif
+		if (m_nodes.empty())	// case: not reported, one node with every processor
+		{
+			Node node;
+			for (int processor = 0; processor < std::max(1, (int)std::thread::hardware_concurrency()); processor++)
+			{
+				node.processors.push_back(processor);
+			}
+			m_nodes.push_back(node);
+		}
+	}
+
+	bool NUMATopology::PinThisThreadToNode(int node_index) const
+	{
+		const Node& node = m_nodes[node_index];
+#if defined(_WIN32)
+		GROUP_AFFINITY affinity{};
+		affinity.Group = node.processor_group;
+		for (int processor : node.processors)
+		{
+			affinity.Mask |= (KAFFINITY)1 << processor;
+		}
+		return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#elif defined(__linux__)
+		cpu_set_t processor_set;
+		CPU_ZERO(&processor_set);
+		for (int processor : node.processors)
+		{
+			CPU_SET(processor, &processor_set);
+		}
+		return pthread_setaffinity_np(pthread_self(), sizeof(processor_set), &processor_set) == 0;
+#else
+		return false;
+#endif
+	}
+
+	void NUMATopology::RunOnNode(int node_index, const std::function<void()>& f) const
+	{
+		std::thread thread(
+			[this, node_index, &f]()
+			{
+				PinThisThreadToNode(node_index);
+				f();
+			}
+		);
+		thread.join();
+	}
+}
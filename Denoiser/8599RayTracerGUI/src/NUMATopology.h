@@ -0,0 +1,60 @@
+/*****************************************************************//**
+ * \file   NUMATopology.h
+ * \brief  The NUMA nodes of the machine, pinning threads to them, and running work on them (for node-local memory)
+ *
+ * \author Xiaoyang Liu
+ * \date   October 2026
+ *********************************************************************/
+
+#ifndef NUMATOPOLOGY_H
+#define NUMATOPOLOGY_H
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace Scheduling
+{
+	class NUMATopology
+	/*
+	On a machine with several sockets, each socket (NUMA node) has its own memory, and reading the memory of another socket is slower
+	and shares the link between them. The operating systems put a page in the memory of the node whose thread touches it first, so
+	data a thread pinned to a node allocates and fills stays local to that node: no libnuma needed.
+
+	Machines (or operating systems) that do not report their nodes show up as one node with all the processors.
+	*/
+	{
+	public:
+		static const NUMATopology& Get();
+		// Detected once, on first use.
+
+		int GetNodeCount() const
+		{
+			return (int)m_nodes.size();
+		}
+
+		int GetProcessorCount(int node_index) const
+		{
+			return (int)m_nodes[node_index].processors.size();
+		}
+
+		bool PinThisThreadToNode(int node_index) const;
+		// Restricts the calling thread to the processors of the node. Returns false if the operating system refused (or cannot pin).
+
+		void RunOnNode(int node_index, const std::function<void()>& f) const;
+		// Calls f on a new thread pinned to the node and waits for it, so that the memory f allocates and fills lands on the node.
+
+	private:
+		NUMATopology();
+
+		struct Node
+		{
+			uint16_t processor_group = 0;		// Windows only: processors are numbered within groups of up to 64
+			std::vector<int> processors;
+		};
+
+		std::vector<Node> m_nodes;	// never empty
+	};
+}
+
+#endif // !NUMATOPOLOGY_H
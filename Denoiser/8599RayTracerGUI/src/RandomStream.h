@@ -0,0 +1,81 @@
+/*****************************************************************//**
+ * \file   RandomStream.h
+ * \brief  Counter-based random numbers keyed by pixel, sample, bounce and dimension
+ *
+ * \author Xiaoyang Liu
+ * \date   October 2026
+ *********************************************************************/
+
+#ifndef RANDOMSTREAM_H
+#define RANDOMSTREAM_H
+
+#include <cstdint>
+
+namespace Whitted
+{
+	class RandomStream
+	/*
+	The random numbers of one sample of one pixel. There is no generator state to carry along: the d-th number drawn at bounce b of
+	sample s of pixel p is a hash of (p, s, b, d), so it does not depend on which thread shades the pixel, or in which order the
+	pixels (or the stages of a wavefront) are processed, and the image is the same whatever the thread count or the scheduler.
+	Every bounce starts over from dimension 0, so a bounce can be resumed from (p, s, b) alone.
+
+	The hash is pcg4d from Jarzynski and Olano, "Hash Functions for GPU Rendering" (JCGT 2020): a few multiplies and one xorshift,
+	mixing all four inputs into each output.
+	*/
+	{
+	public:
+		RandomStream(uint32_t pixel_index = 0, uint32_t sample_index = 0, uint32_t bounce = 0)
+			: m_pixel_index(pixel_index), m_sample_index(sample_index), m_bounce(bounce)
+		{
+		}
+
+		float Float()
+		// In [0, 1), with the 24 bits a float can hold.
+		{
+			return (float)(hash(m_pixel_index, m_sample_index, m_bounce, m_dimension++) >> 8) * (1.0f / 16777216.0f);
+		}
+
+		void NextBounce()
+		{
+			m_bounce++;
+			m_dimension = 0;
+		}
+
+		uint32_t GetBounce() const
+		{
+			return m_bounce;
+		}
+
+		static uint32_t hash(uint32_t x, uint32_t y, uint32_t z, uint32_t w)
+		{
+			x = x * 1664525u + 1013904223u;
+			y = y * 1664525u + 1013904223u;
+			z = z * 1664525u + 1013904223u;
+			w = w * 1664525u + 1013904223u;
+			x += y * w;
+			y += z * x;
+			z += x * y;
+			w += y * z;
+			x ^= x >> 16;
+			y ^= y >> 16;
+			z ^= z >> 16;
+			w ^= w >> 16;
+			x += y * w;
+			y += z * x;
+			z += x * y;
+			w += y * z;
+			return x ^ z;
+		}
+
+	private:
+		uint32_t m_pixel_index;
+		uint32_t m_sample_index;
+		uint32_t m_bounce;
+		uint32_t m_dimension = 0;
+	};
+
+	inline thread_local RandomStream this_thread_random_stream;		// what get_random_float_0_1() draws from, set by the renderer for every sample it shades
+}
+
+#endif // !RANDOMSTREAM_H
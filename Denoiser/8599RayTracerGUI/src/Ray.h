@@ -22,6 +22,11 @@ namespace AccelerationStructure
 {
 	struct Ray
 	{
+		Ray()
+			: Ray(glm::vec3{ 0.0f, 0.0f, 0.0f }, glm::vec3{ 0.0f, 0.0f, 1.0f })	// a placeholder, e.g. for the unused rays of a RayPacket
+		{
+		}
+
 		Ray(const glm::vec3& origin, const glm::vec3& direction)
 			: m_origin(origin), m_direction(direction)
 		{
@@ -0,0 +1,102 @@
+/*****************************************************************//**
+ * \file   RayPacket.h
+ * \brief  Rays traced through the BVHs together, e.g. the primary rays of a tile of pixels
+ *
+ * \author Xiaoyang Liu
+ * \date   October 2026
+ *********************************************************************/
+
+#ifndef RAYPACKET_H
+#define RAYPACKET_H
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include "BoundingVolume.h"
+
+namespace AccelerationStructure
+{
+	constexpr int ray_packet_size = 64;		// the primary rays of 8x8 pixels
+	static_assert(ray_packet_size <= 64, "the entities report the rays of a packet they hit as the bits of a uint64_t");
+
+	class RayPacket
+	/*
+	A packet walks a BVH front-to-back as a whole (see AccelerationStructure::packet_closest_hits_with()), keeping track of the range of
+	its rays that still hit the current node. This only works if the rays agree on which child of a node is the nearer one, so the
+	packet has to be coherent: one common origin, and the same sign for each component of the directions. Then a subtree can also be
+	rejected for all the rays at once, with interval arithmetic over the directions. Incoherent packets are traced one ray at a time.
+	*/
+	{
+	public:
+		void Add(const Ray& ray)
+		{
+			std::array<int, 3> direction_is_negative{ ray.m_direction.x < 0.0f, ray.m_direction.y < 0.0f, ray.m_direction.z < 0.0f };
+			bool has_finite_reciprocal = std::isfinite(ray.direction_reciprocal.x) && std::isfinite(ray.direction_reciprocal.y) && std::isfinite(ray.direction_reciprocal.z);
+			if (m_ray_count == 0)
+			{
+				m_origin = ray.m_origin;
+				m_direction_is_negative = direction_is_negative;
+				m_direction_reciprocal_min = ray.direction_reciprocal;
+				m_direction_reciprocal_max = ray.direction_reciprocal;
+				m_is_coherent = has_finite_reciprocal;
+			}
+			else
+			{
+				m_is_coherent = m_is_coherent && has_finite_reciprocal && (ray.m_origin == m_origin) && (direction_is_negative == m_direction_is_negative);
+				m_direction_reciprocal_min = glm::min(m_direction_reciprocal_min, ray.direction_reciprocal);
+				m_direction_reciprocal_max = glm::max(m_direction_reciprocal_max, ray.direction_reciprocal);
+			}
+			rays[m_ray_count++] = ray;
+		}
+
+		int GetRayCount() const
+		{
+			return m_ray_count;
+		}
+
+		bool IsCoherent() const
+		{
+			return m_is_coherent;
+		}
+
+		const std::array<int, 3>& GetDirectionIsNegative() const
+		// Coherent packets only: shared by all the rays.
+		{
+			return m_direction_is_negative;
+		}
+
+		bool misses_bounding_volume(const AABB_3D& box) const
+		// Coherent packets only: true if no ray of the packet can hit the box (false does not mean that any does).
+		{
+			/*
+			Along an axis, a ray enters the slab of the box at t = (near - origin) * direction_reciprocal, and leaves it at (far - origin) * direction_reciprocal.
+			With a common origin, these are linear in direction_reciprocal, so over the interval [min, max] of direction_reciprocal in the packet
+			they take their extremes at its ends. A ray enters the box at the largest of its entry t over the three axes, which is at least the largest
+			of the lower bounds t_in below, and leaves it at the smallest exit t, at most t_out below. So t_in > t_out means every ray misses the box.
+			*/
+			float t_in = -std::numeric_limits<float>::max();
+			float t_out = std::numeric_limits<float>::max();
+			for (int axis = X_axis; axis <= Z_axis; axis++)
+			{
+				float near_distance = (m_direction_is_negative[axis] ? box.max_slab_values[axis] : box.min_slab_values[axis]) - m_origin[axis];
+				float far_distance = (m_direction_is_negative[axis] ? box.min_slab_values[axis] : box.max_slab_values[axis]) - m_origin[axis];
+				t_in = std::max(t_in, std::min(near_distance * m_direction_reciprocal_min[axis], near_distance * m_direction_reciprocal_max[axis]));
+				t_out = std::min(t_out, std::max(far_distance * m_direction_reciprocal_min[axis], far_distance * m_direction_reciprocal_max[axis]));
+			}
+			return (t_out < 0.0f) || (t_in > t_out);
+		}
+
+		// Data members:
+		std::array<Ray, ray_packet_size> rays;	// rays[0, GetRayCount()), the queries shrink their t_max to the closest hits
+
+	private:
+		int m_ray_count = 0;
+		bool m_is_coherent = false;
+		glm::vec3 m_origin{ 0.0f };
+		std::array<int, 3> m_direction_is_negative{ 0, 0, 0 };
+		glm::vec3 m_direction_reciprocal_min{ 0.0f };
+		glm::vec3 m_direction_reciprocal_max{ 0.0f };
+	};
+}
+
+#endif // !RAYPACKET_H
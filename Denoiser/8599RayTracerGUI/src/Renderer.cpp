@@ -8,7 +8,15 @@
 
 #include "Renderer.h"
 
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "Walnut/Timer.h"
 #include "TriangleMesh.h"
+#include "MeshInstance.h"
 
 namespace RTUtility
 {
@@ -34,30 +42,90 @@ Renderer::Renderer()
 	Whitted::WhittedMaterial* light_material = new Whitted::WhittedMaterial(Whitted::MaterialNature::Diffuse, glm::vec3(47.8f, 38.6f, 31.1f));
 	light_material->diffuse_coefficient = glm::vec3{ 0.7f, 0.7f, 0.7f };
 
+	// Switch this to DividingMethod::Median to compare against the median-split BVHs:
+	constexpr AccelerationStructure::BVH::DividingMethod dividing_method = AccelerationStructure::BVH::DividingMethod::Surface_Area_Heuristic;
+	constexpr float mesh_scale = 1.0f;		// the meshes keep the coordinates of their OBJ files, and the MeshInstances place them
+
 	int id_count = 1;	// primitive's id starting from 1
 	// TODO: use a more robust type other than int to avoid overflow when the scene contains many primitives.
 
-	Whitted::TriangleMesh* floor = new Whitted::TriangleMesh(id_count, "src/cornellbox/floor.obj", white);
-	Whitted::TriangleMesh* shortbox = new Whitted::TriangleMesh(id_count, "src/cornellbox/shortbox.obj", white);
-	Whitted::TriangleMesh* tallbox = new Whitted::TriangleMesh(id_count, "src/cornellbox/tallbox.obj", white);
-	Whitted::TriangleMesh* left = new Whitted::TriangleMesh(id_count, "src/cornellbox/left.obj", red);
-	Whitted::TriangleMesh* right = new Whitted::TriangleMesh(id_count, "src/cornellbox/right.obj", green);
-	Whitted::TriangleMesh* light = new Whitted::TriangleMesh(id_count, "src/cornellbox/light.obj", light_material);
+	// The Cornell box is modelled in units of 0.01 of the scene, and the bunny stands on both boxes and on the floor:
+	const glm::mat4 cornell_box_to_world = glm::scale(glm::mat4{ 1.0f }, glm::vec3{ 0.01f });
+	const glm::vec3 bunny_feet{ -0.0168f, 0.0333f, -0.0015f };		// the middle of the bottom of its box in the OBJ file
+	auto place_bunny = [&bunny_feet](const glm::vec3& location, float turn_in_degrees)
+	{
+		glm::mat4 bunny_to_world = glm::translate(glm::mat4{ 1.0f }, location);
+		bunny_to_world = glm::rotate(bunny_to_world, glm::radians(turn_in_degrees), glm::vec3{ 0.0f, 1.0f, 0.0f });
+		bunny_to_world = glm::scale(bunny_to_world, glm::vec3{ 8.0f });
+		return glm::translate(bunny_to_world, -bunny_feet);
+	};
 
 	// The mesh file of the Stanford bunny is downloaded from https://graphics.stanford.edu/~mdfisher/Data/Meshes/bunny.obj
 	// The mesh file of the Utah teapot is downloaded from https://graphics.stanford.edu/courses/cs148-10-summer/as3/code/as3/teapot.obj
 	// The data for the mesh of the Cornell box is obtained from http://www.graphics.cornell.edu/online/box/data.html
+	struct MeshFile
+	{
+		std::string path;
+		Whitted::WhittedMaterial* material;
+		std::vector<glm::mat4> object_to_world;		// a MeshInstance each, all sharing the one TriangleMesh of the file
+	};
+	const std::vector<MeshFile> mesh_files{
+		{ "src/cornellbox/floor.obj", white, { cornell_box_to_world } },
+		{ "src/cornellbox/shortbox.obj", white, { cornell_box_to_world } },
+		{ "src/cornellbox/tallbox.obj", white, { cornell_box_to_world } },
+		{ "src/cornellbox/left.obj", red, { cornell_box_to_world } },
+		{ "src/cornellbox/right.obj", green, { cornell_box_to_world } },
+		{ "src/cornellbox/light.obj", light_material, { cornell_box_to_world } },
+		{ "src/stanford_bunny.obj", white, { place_bunny({ 1.86f, 1.65f, 1.69f }, 20.0f), place_bunny({ 3.68f, 3.30f, 3.51f }, -35.0f), place_bunny({ 4.10f, 0.0f, 1.30f }, 160.0f) } }
+	};
 
-	Add(floor);
-	Add(shortbox);
-	Add(tallbox);
-	Add(left);
-	Add(right);
-	Add(light);
+	// Parsing the OBJ files and building the mesh BVHs is most of the startup time, so after the first run
+	// we read back a binary snapshot of the finished meshes instead (delete the snapshot to force a reload).
+	const std::string scene_snapshot_path = "scene.snapshot";
+	const Whitted::SnapshotBuildParameters snapshot_build_parameters{ (uint32_t)dividing_method, mesh_scale };
+	bool snapshot_is_up_to_date = std::filesystem::exists(scene_snapshot_path);
+	for (const MeshFile& mesh_file : mesh_files)
+	{
+		snapshot_is_up_to_date = snapshot_is_up_to_date && (std::filesystem::last_write_time(mesh_file.path) <= std::filesystem::last_write_time(scene_snapshot_path));
+	}
+	if (snapshot_is_up_to_date)
+	{
+		scene_snapshot = std::make_unique<Whitted::SceneSnapshot>(scene_snapshot_path, snapshot_build_parameters);
+		if (!scene_snapshot->IsValid() || (scene_snapshot->GetMeshes().size() != mesh_files.size()))		// e.g. written by an older version, with another dividing_method or of other files
+		{
+			scene_snapshot.reset();
+		}
+	}
+
+	std::vector<Whitted::TriangleMesh*> meshes;		// in the order of mesh_files
+	if (scene_snapshot)
+	{
+		meshes = scene_snapshot->GetMeshes();
+		for (Whitted::TriangleMesh* mesh : meshes)
+		{
+			id_count = std::max(id_count, mesh->GetFirstPrimitiveId() + mesh->GetTriangleCount());	// as if the meshes had been parsed
+		}
+	}
+	else
+	{
+		for (const MeshFile& mesh_file : mesh_files)
+		{
+			meshes.push_back(new Whitted::TriangleMesh(id_count, mesh_file.path, mesh_file.material, dividing_method, mesh_scale));
+		}
+		Whitted::SceneSnapshot::Write(scene_snapshot_path, meshes, snapshot_build_parameters);		// if this fails we just parse the files again next time
+	}
+	for (size_t mesh_index = 0; mesh_index < meshes.size(); mesh_index++)
+	{
+		for (const glm::mat4& object_to_world : mesh_files[mesh_index].object_to_world)
+		{
+			Add(new Whitted::MeshInstance(id_count, meshes[mesh_index], object_to_world));
+		}
+	}
 
 	// TODO: the current internal logic will result in memory leak of the mesh
 	
-	GenerateBVH();	// we should only generate BVH **once** here
+	// The walls and the floor span the whole scene, so the scene BVH uses spatial splits to keep them from overlapping every node:
+	GenerateBVH(AccelerationStructure::BVH::DividingMethod::Spatial_Split_SAH);	// we should only generate BVH **once** here
 }
 
 void Renderer::ResizeViewport(uint32_t width, uint32_t height)
@@ -86,16 +154,7 @@ void Renderer::ResizeViewport(uint32_t width, uint32_t height)
 	//temporal_accumulation_frame_data = new glm::vec4[width * height];
 	//frame_accumulating = 1;
 
-	rows.resize(height);
-	for (uint32_t i = 0; i < height; i++)
-	{
-		rows[i] = i;
-	}
-	columns.resize(width);
-	for (uint32_t i = 0; i < width; i++)
-	{
-		columns[i] = i;
-	}
+	tile_scheduler.Resize(width, height);
 }
 
 void Renderer::Render(const Camera& camera)
@@ -235,35 +294,65 @@ void Renderer::Render(const Camera& camera)
 		}
 	}
 
-	std::for_each(std::execution::par, rows.begin(), rows.end(),
-		[this](uint32_t y)
-		{
-			std::for_each(std::execution::par, columns.begin(), columns.end(),
-			[this, y](uint32_t x)
-				{
-					RayGen_Shader(x, y);
-				}
-			);
-		}
-	);
+	if (settings.rebuild_BVH_every_frame)
+	{
+		RebuildBVH();
+	}
+	else if (settings.refit_BVH_every_frame)
+	{
+		RefitBVH();
+	}
+
+	// a scheduler tile is a whole number of packet tiles, so that the packet tiles stay on the 8x8 grid:
+	uint32_t packet_tiles_per_tile = std::max(1u, (settings.render_tile_size + packet_tile_size - 1) / packet_tile_size);
+	tile_scheduler.Configure(settings.render_thread_count, packet_tiles_per_tile * packet_tile_size, settings.NUMA_scene_replicas);
+	update_scene_replicas();
+	frame_index++;
+
+	if (!settings.adaptive_sampling)
+	{
+		pixel_estimates.clear();
+	}
+
+	if (settings.adaptive_sampling)
+	{
+		adaptive_sampling();
+	}
+	else if (settings.wavefront_path_tracing)
+	{
+		wavefront_path_tracing();
+	}
+	else if (settings.trace_primary_ray_packets)
+	{
+		for_each_packet_tile(
+			[this](uint32_t tile_x, uint32_t tile_y)
+			{
+				RayGen_Shader_Packet(tile_x, tile_y);
+			}
+		);
+	}
+	else
+	{
+		tile_scheduler.ForEachPixel(
+			[this](uint32_t x, uint32_t y)
+			{
+				RayGen_Shader(x, y);
+			}
+		);
+	}
 	
-	denoiser.JointBilateralFiltering(g_buffer, spatial_filtered_frame_buffer, settings.immediate_clamping);
+	denoiser.JointBilateralFiltering(tile_scheduler, g_buffer, spatial_filtered_frame_buffer, settings.immediate_clamping);
 	// save the current frame transformation for the next frame:
 	g_buffer.projection_matrix = active_camera->ProjectionMatrix();
 	g_buffer.view_matrix = active_camera->ViewMatrix();
-	denoiser.TemporalFiltering(g_buffer, temporal_filtered_frame_buffer);
+	denoiser.TemporalFiltering(tile_scheduler, g_buffer, temporal_filtered_frame_buffer);
 	
-	std::for_each(std::execution::par, rows.begin(), rows.end(),
-		[this](uint32_t y)
+	tile_scheduler.ForEachPixel(
+		[this](uint32_t x, uint32_t y)
 		{
-			std::for_each(std::execution::par, columns.begin(), columns.end(),
-			[this, y](uint32_t x)
-				{
-					glm::vec4 final_color_RGBA{temporal_filtered_frame_buffer(x, y), 1.0f};
-					final_color_RGBA = glm::clamp(final_color_RGBA, glm::vec4(0.0f), glm::vec4(1.0f));	// glm::clamp(value, min, max)
-					frame_data[(y * frame_image_final->GetWidth()) + x] = RTUtility::vecRGBA_to_0xABGR(final_color_RGBA);
-				}
-			);
+			glm::vec4 final_color_RGBA{temporal_filtered_frame_buffer(x, y), 1.0f};
+			final_color_RGBA = glm::clamp(final_color_RGBA, glm::vec4(0.0f), glm::vec4(1.0f));	// glm::clamp(value, min, max)
+			frame_data[(y * frame_image_final->GetWidth()) + x] = RTUtility::vecRGBA_to_0xABGR(final_color_RGBA);
 		}
 	);
 
@@ -272,22 +361,358 @@ void Renderer::Render(const Camera& camera)
 }
 
 void Renderer::RayGen_Shader(uint32_t x, uint32_t y)
+{
+	AccelerationStructure::Ray ray = primary_ray(x, y);
+	primary_ray_shader(x, y, ray, ray_BVH_intersection_record(ray));
+}
+
+void Renderer::for_each_packet_tile(const std::function<void(uint32_t tile_x, uint32_t tile_y)>& trace_packet_tile)
+// The packet tiles of one scheduler tile go to the same thread, one after another.
+{
+	tile_scheduler.ForEachTile(
+		[&trace_packet_tile](const Scheduling::Tile& tile)
+		{
+			for (uint32_t tile_y = tile.y; tile_y < tile.y + tile.height; tile_y += packet_tile_size)
+			{
+				for (uint32_t tile_x = tile.x; tile_x < tile.x + tile.width; tile_x += packet_tile_size)
+				{
+					trace_packet_tile(tile_x, tile_y);
+				}
+			}
+		}
+	);
+}
+
+void Renderer::update_scene_replicas()
+/*
+Each NUMA node gets its own copy of what the ray queries read: the triangle meshes with their BVHs, and a scene BVH over them. A copy
+is made on a thread pinned to its node, so its pages are first touched there and stay in the memory of that node. The scheduler threads
+of a node then read only their own copy (see scene_BVH()), instead of all the sockets reading one copy over the link between them.
+The meshes are copied from the shared ones, whether those were parsed or loaded from the scene snapshot, once each however many
+MeshInstances place them, and apply_BVH_settings_to() gives the copies the settings of the shared scene. The MeshInstances are copied
+to place the copies of their meshes. The other entities and the materials are small, and are shared.
+*/
+{
+	int replica_count = settings.NUMA_scene_replicas ? tile_scheduler.GetNodeCount() : 0;
+	if ((int)scene_replicas.size() == replica_count)
+	{
+		return;
+	}
+	scene_replicas.clear();
+	scene_replicas.resize(replica_count);
+	std::vector<Whitted::TriangleMesh*> shared_meshes = get_triangle_meshes(entities);
+	for (int node_index = 0; node_index < replica_count; node_index++)
+	{
+		Scheduling::NUMATopology::Get().RunOnNode(node_index,
+			[&]()
+			{
+				SceneReplica& replica = scene_replicas[node_index];
+				std::vector<Whitted::TriangleMesh*> replica_meshes;
+				for (Whitted::TriangleMesh* mesh : shared_meshes)
+				{
+					replica.copies.push_back(std::make_unique<Whitted::TriangleMesh>(*mesh));
+					replica_meshes.push_back(static_cast<Whitted::TriangleMesh*>(replica.copies.back().get()));
+				}
+				auto get_replica_mesh = [&](const Whitted::Entity* shared_mesh)
+				{
+					auto mesh = std::find(shared_meshes.begin(), shared_meshes.end(), shared_mesh);
+					return (mesh != shared_meshes.end()) ? (replica_meshes[mesh - shared_meshes.begin()]) : (nullptr);
+				};
+				for (Whitted::Entity* entity : entities)
+				{
+					if (Whitted::MeshInstance* instance = dynamic_cast<Whitted::MeshInstance*>(entity))
+					{
+						replica.copies.push_back(std::make_unique<Whitted::MeshInstance>(*instance, get_replica_mesh(instance->GetMesh())));
+						replica.entities.push_back(replica.copies.back().get());
+					}
+					else
+					{
+						Whitted::TriangleMesh* replica_mesh = get_replica_mesh(entity);
+						replica.entities.push_back((replica_mesh) ? (replica_mesh) : (entity));
+					}
+				}
+				replica.bvh = std::make_unique<AccelerationStructure::BVH>(replica.entities, bvh->GetDividingMethod());
+				apply_BVH_settings_to(replica.entities, *replica.bvh);
+			}
+		);
+	}
+}
+
+void Renderer::apply_BVH_settings()
+// The replicas are changed on a thread of their node, so that what the settings rebuild is allocated there too.
+{
+	apply_BVH_settings_to(entities, *bvh);
+	for (int node_index = 0; node_index < (int)scene_replicas.size(); node_index++)
+	{
+		Scheduling::NUMATopology::Get().RunOnNode(node_index,
+			[&]()
+			{
+				apply_BVH_settings_to(scene_replicas[node_index].entities, *scene_replicas[node_index].bvh);
+			}
+		);
+	}
+}
+
+void Renderer::apply_BVH_settings_to(const std::vector<Whitted::Entity*>& scene, AccelerationStructure::BVH& scene_BVH)
+// Every setting is applied over again, changed or not, so that the shared scene and a replica end up alike however they got there
+// (a replica made later gets them all at once). That restarts the traversal counters too.
+// A mesh is laid out for the camera rays as every entity that places it sees them, in the space of its vertices.
+{
+	for (Whitted::TriangleMesh* mesh : get_triangle_meshes(scene))
+	{
+		std::vector<AccelerationStructure::Ray> mesh_sample_rays;
+		for (Whitted::Entity* entity : scene)
+		{
+			if (entity == mesh)
+			{
+				mesh_sample_rays.insert(mesh_sample_rays.end(), BVH_settings.layout_sample_rays.begin(), BVH_settings.layout_sample_rays.end());
+			}
+			else if (Whitted::MeshInstance* instance = dynamic_cast<Whitted::MeshInstance*>(entity); instance && (instance->GetMesh() == mesh))
+			{
+				for (const AccelerationStructure::Ray& ray : BVH_settings.layout_sample_rays)
+				{
+					mesh_sample_rays.push_back(instance->ToObjectSpace(ray));
+				}
+			}
+		}
+		mesh->SetBVHCompression(BVH_settings.compress_nodes, BVH_settings.quantize_vertices);
+		mesh->SetBVHNodeLayout(BVH_settings.node_layout, mesh_sample_rays);
+		mesh->GetBVH().SetTraversalCounting(BVH_settings.count_traversals);
+		mesh->GetBVH().ResetTraversalStatistics();
+	}
+	scene_BVH.SetNodeCompression(BVH_settings.compress_nodes);
+	scene_BVH.Rebuild();		// quantizing the vertices may have nudged the boxes of the meshes (and the scene BVH has only a few entities)
+	scene_BVH.SetNodeLayout(BVH_settings.node_layout, BVH_settings.layout_sample_rays);
+	scene_BVH.SetTraversalCounting(BVH_settings.count_traversals);
+	scene_BVH.ResetTraversalStatistics();
+}
+
+std::vector<Whitted::TriangleMesh*> Renderer::get_triangle_meshes(const std::vector<Whitted::Entity*>& scene)
+// The meshes in the scene and those the MeshInstances place, once each however many instances share them.
+{
+	std::vector<Whitted::TriangleMesh*> meshes;
+	for (Whitted::Entity* entity : scene)
+	{
+		Whitted::TriangleMesh* mesh = dynamic_cast<Whitted::TriangleMesh*>(entity);
+		if (Whitted::MeshInstance* instance = dynamic_cast<Whitted::MeshInstance*>(entity))
+		{
+			mesh = instance->GetMesh();
+		}
+		if (mesh && (std::find(meshes.begin(), meshes.end(), mesh) == meshes.end()))
+		{
+			meshes.push_back(mesh);
+		}
+	}
+	return meshes;
+}
+
+void Renderer::RayGen_Shader_Packet(uint32_t tile_x, uint32_t tile_y)
+// Neighbouring primary rays mostly walk the same nodes, so the packet reads each node once for all of them (see AccelerationStructure::RayPacket).
+{
+	uint32_t tile_width = std::min(packet_tile_size, frame_image_final->GetWidth() - tile_x);
+	uint32_t tile_height = std::min(packet_tile_size, frame_image_final->GetHeight() - tile_y);
+	AccelerationStructure::RayPacket packet;
+	for (uint32_t y = tile_y; y < tile_y + tile_height; y++)
+	{
+		for (uint32_t x = tile_x; x < tile_x + tile_width; x++)
+		{
+			packet.Add(primary_ray(x, y));
+		}
+	}
+
+	std::array<Whitted::IntersectionRecord, AccelerationStructure::ray_packet_size> records;
+	scene_BVH().traverse_packet_from_root(packet, records);
+
+	for (uint32_t y = tile_y; y < tile_y + tile_height; y++)
+	{
+		for (uint32_t x = tile_x; x < tile_x + tile_width; x++)
+		{
+			primary_ray_shader(x, y, primary_ray(x, y), records[(y - tile_y) * tile_width + (x - tile_x)]);		// the packet has shrunk the t_max of its rays
+		}
+	}
+}
+
+void Renderer::primary_ray_shader(uint32_t x, uint32_t y, const AccelerationStructure::Ray& ray, const Whitted::IntersectionRecord& record)
+{
+	Whitted::this_thread_random_stream = Whitted::RandomStream{ y * frame_image_final->GetWidth() + x, frame_index };
+	write_pixel_color(x, y, cast_path(ray, record, g_buffer, x, y));
+}
+
+void Renderer::write_pixel_color(uint32_t x, uint32_t y, const glm::vec3& unfiltered_color_RGB)
 {
 	if (!(settings.immediate_clamping))
 	{
-		g_buffer.pixel_color(x, y) = cast_path(AccelerationStructure::Ray{active_camera->Position(), Whitted::normalize(active_camera->RayDirections()[y * frame_image_final->GetWidth() + x])}, g_buffer, x, y);
+		g_buffer.pixel_color(x, y) = unfiltered_color_RGB;
 		return;
 	}
 	// We can rather choose to do clamping before spatial denoising (to reduce "fireflies"), but wouldn't it violate conservation of energy?
-	glm::vec3 unfiltered_color_RGB = cast_path(AccelerationStructure::Ray{active_camera->Position(), Whitted::normalize(active_camera->RayDirections()[y * frame_image_final->GetWidth() + x])}, g_buffer, x, y);
 	glm::vec3 clamped_unfiltered_color_RGB = glm::clamp(unfiltered_color_RGB, glm::vec3(0.0f), glm::vec3(1.0f));
 	g_buffer.pixel_color(x, y) = clamped_unfiltered_color_RGB;
 }
 
-glm::vec3 Renderer::cast_path(const AccelerationStructure::Ray& ray, Denoising::G_Buffer& g_buffer, const int& column, const int& row) const
+AccelerationStructure::Ray Renderer::primary_ray(uint32_t x, uint32_t y) const
+{
+	return AccelerationStructure::Ray{active_camera->Position(), Whitted::normalize(active_camera->RayDirections()[y * frame_image_final->GetWidth() + x])};
+}
+
+std::vector<AccelerationStructure::Ray> Renderer::GetPrimaryRays(const Camera& camera, int pixel_stride) const
+{
+	std::vector<AccelerationStructure::Ray> primary_rays;
+	if ((!frame_image_final) || (camera.RayDirections().size() != (size_t)frame_image_final->GetWidth() * frame_image_final->GetHeight()))
+	{
+		return primary_rays;	// the camera and the viewport have not been sized yet
+	}
+	for (uint32_t y = 0; y < frame_image_final->GetHeight(); y += pixel_stride)
+	{
+		for (uint32_t x = 0; x < frame_image_final->GetWidth(); x += pixel_stride)
+		{
+			primary_rays.emplace_back(camera.Position(), Whitted::normalize(camera.RayDirections()[y * frame_image_final->GetWidth() + x]));
+		}
+	}
+	return primary_rays;
+}
+
+std::array<float, 3> Renderer::BenchmarkBVHNodeLayouts(const Camera& camera)
+// For each BVH node layout (in the order of AccelerationStructure::BVH::NodeLayout), the milliseconds it takes to find the closest hits
+// of all the primary rays of the camera (the best of a few runs). Leaves the BVHs in the fastest layout.
+{
+	constexpr int run_count = 5;
+	std::vector<AccelerationStructure::Ray> primary_rays = GetPrimaryRays(camera, 1);
+	std::array<AccelerationStructure::BVH::NodeLayout, 3> node_layouts{
+		AccelerationStructure::BVH::NodeLayout::Depth_First,
+		AccelerationStructure::BVH::NodeLayout::Van_Emde_Boas,
+		AccelerationStructure::BVH::NodeLayout::Treelets
+	};
+	std::array<float, 3> durations;
+	for (int i = 0; i < (int)node_layouts.size(); i++)
+	{
+		SetBVHNodeLayout(node_layouts[i], camera);
+		durations[i] = std::numeric_limits<float>::max();
+		for (int run = 0; run < run_count; run++)
+		{
+			Walnut::Timer timer;
+			std::for_each(std::execution::par, primary_rays.begin(), primary_rays.end(),
+				[this](const AccelerationStructure::Ray& ray)
+				{
+					ray_BVH_intersection_record(ray);
+				}
+			);
+			durations[i] = std::min(durations[i], timer.ElapsedMillis());
+		}
+	}
+	SetBVHNodeLayout(node_layouts[std::min_element(durations.begin(), durations.end()) - durations.begin()], camera);
+	return durations;
+}
+
+std::array<float, 2> Renderer::BenchmarkIntegrators(const Camera& camera)
+// The milliseconds it takes to render a frame (the best of a few runs) with the recursive shading() and with the wavefront integrator.
+// Leaves settings.wavefront_path_tracing as it was.
+{
+	constexpr int run_count = 5;
+	bool wavefront_path_tracing = settings.wavefront_path_tracing;
+	std::array<float, 2> durations;
+	for (int i = 0; i < (int)durations.size(); i++)
+	{
+		settings.wavefront_path_tracing = (i == 1);
+		durations[i] = std::numeric_limits<float>::max();
+		for (int run = 0; run < run_count; run++)
+		{
+			Walnut::Timer timer;
+			Render(camera);
+			durations[i] = std::min(durations[i], timer.ElapsedMillis());
+		}
+	}
+	settings.wavefront_path_tracing = wavefront_path_tracing;
+	return durations;
+}
+
+std::array<float, 2> Renderer::BenchmarkSceneReplicas(const Camera& camera)
+// The milliseconds it takes to render a frame (the best of a few runs) with one shared scene, and with the render threads pinned to
+// the NUMA nodes and a copy of the scene per node. Leaves settings.NUMA_scene_replicas as it was.
+{
+	constexpr int run_count = 5;
+	bool NUMA_scene_replicas = settings.NUMA_scene_replicas;
+	std::array<float, 2> durations;
+	for (int i = 0; i < (int)durations.size(); i++)
+	{
+		settings.NUMA_scene_replicas = (i == 1);
+		Render(camera);		// not timed: restarts the threads and makes (or drops) the replicas
+		durations[i] = std::numeric_limits<float>::max();
+		for (int run = 0; run < run_count; run++)
+		{
+			Walnut::Timer timer;
+			Render(camera);
+			durations[i] = std::min(durations[i], timer.ElapsedMillis());
+		}
+	}
+	settings.NUMA_scene_replicas = NUMA_scene_replicas;
+	return durations;
+}
+
+std::array<float, 2> Renderer::BenchmarkRayBatches(const Camera& camera)
+// The milliseconds it takes to find the closest hits of all the primary rays of the camera (the best of a few runs),
+// one ray at a time and in batches (see ray_BVH_intersection_records()).
+{
+	constexpr int run_count = 5;
+	static constexpr int batch_size = 256;
+	const std::vector<AccelerationStructure::Ray> primary_rays = GetPrimaryRays(camera, 1);
+	std::vector<int> batches((primary_rays.size() + batch_size - 1) / batch_size);
+	std::iota(batches.begin(), batches.end(), 0);
+	std::array<float, 2> durations{ std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+	for (int run = 0; run < run_count; run++)
+	{
+		Walnut::Timer timer;
+		std::for_each(std::execution::par, primary_rays.begin(), primary_rays.end(),
+			[this](const AccelerationStructure::Ray& ray)
+			{
+				ray_BVH_intersection_record(ray);
+			}
+		);
+		durations[0] = std::min(durations[0], timer.ElapsedMillis());
+
+		std::vector<AccelerationStructure::Ray> rays = primary_rays;	// the batches shrink the t_max of the rays
+		timer.Reset();
+		std::for_each(std::execution::par, batches.begin(), batches.end(),
+			[this, &rays](int batch)
+			{
+				int first_ray_index = batch * batch_size;
+				std::array<Whitted::IntersectionRecord, batch_size> records;
+				ray_BVH_intersection_records(rays.data() + first_ray_index, std::min(batch_size, (int)rays.size() - first_ray_index), records.data());
+			}
+		);
+		durations[1] = std::min(durations[1], timer.ElapsedMillis());
+	}
+	return durations;
+}
+
+bool Renderer::WriteBVHStatistics(const std::string& file_path) const
+// As JSON, e.g. to diff against the statistics written before changing the BVH builder settings.
+{
+	std::ofstream file(file_path, std::ios::trunc);
+	file << "{\n\t\"BVHs\": {";
+	std::vector<std::pair<std::string, AccelerationStructure::BVH_Statistics>> statistics = GetBVHStatistics();
+	for (size_t i = 0; i < statistics.size(); i++)
+	{
+		file << ((i > 0) ? "," : "") << "\n\t\t\"" << statistics[i].first << "\": " << statistics[i].second.ToJSON();
+	}
+	file << "\n\t},\n\t\"traversal\": " << GetBVHTraversalStatistics().ToJSON(GetSceneBVHQueryCount()) << "\n}\n";
+	return (bool)file;
+}
+
+glm::vec3 Renderer::cast_path(const AccelerationStructure::Ray& ray, const Whitted::IntersectionRecord& record, Denoising::G_Buffer& g_buffer, const int& column, const int& row) const
 // We don't really need to record bounce depth as long as we are usign Russian Roulette.
 {
-	Whitted::IntersectionRecord record = ray_BVH_intersection_record(ray);
+	write_primary_hit(ray, record, g_buffer, column, row);
+	if (record.has_intersection)
+	{
+		return shading(record, -(ray.m_direction));
+		// Note that here we negate the direction because we want all the vectors to be outwards with respect to the shading point
+	}
+	return night_sky_color;
+}
+
+void Renderer::write_primary_hit(const AccelerationStructure::Ray& ray, const Whitted::IntersectionRecord& record, Denoising::G_Buffer& g_buffer, const int& column, const int& row) const
+{
 	if (record.has_intersection)
 	{
 		g_buffer.primitive_id(column, row) = record.primitive_id;
@@ -299,15 +724,11 @@ glm::vec3 Renderer::cast_path(const AccelerationStructure::Ray& ray, Denoising::
 			shading_point_normal = -(record.surface_normal);
 		}
 		g_buffer.pixel_world_surface_normal(column, row) = glm::normalize(shading_point_normal);
-
-		return shading(record, -(ray.m_direction));
-		// Note that here we negate the direction because we want all the vectors to be outwards with respect to the shading point
+		return;
 	}
 
 	g_buffer.primitive_id(column, row) = -1;
 	g_buffer.contributor(column, row) = 0;	// we don't bother providing any further information for denoiser
-
-	return glm::vec3{12 / 255.0f, 20 / 255.0f, 69 / 255.0f};		// returns the color of night sky 12, 20, 69
 }
 
 glm::vec3 Renderer::shading(const Whitted::IntersectionRecord& record, const glm::vec3& W_out) const
@@ -335,6 +756,35 @@ glm::vec3 Renderer::shading(const Whitted::IntersectionRecord& record, const glm
 
 	// Direct Illumination:
 	glm::vec3 radiance_direct = glm::vec3{ 0.0f,0.0f,0.0f };
+	LightSample light_sample = sample_direct_illumination(record, W_out, shading_point, shading_point_normal);
+	if (!ray_BVH_is_occluded(light_sample.shadow_ray, light_sample.distance))
+	{
+		radiance_direct = light_sample.radiance;
+	}
+
+	// Indirect Illumination:
+	glm::vec3 radiance_indirect = glm::vec3{ 0.0f,0.0f,0.0f };
+	glm::vec3 W_in;
+	glm::vec3 weight;
+	if (sample_indirect_direction(record, W_out, shading_point_normal, W_in, weight))
+		// shot a ray from the shading point
+	{
+		Whitted::IntersectionRecord deeper_ray_record = ray_BVH_intersection_record(AccelerationStructure::Ray{shading_point, W_in});
+		if (deeper_ray_record.has_intersection && (!(deeper_ray_record.hitted_entity_material->IsEmitting())))
+			/*
+			If the ray for indirect illumination does not hit any object, then we assume no light from the skybox.
+			If it hits the arealight, then our function returns 0 so that it is mathematically correct to do the linear sum of radiance_direct and radiance_indirect.
+			*/
+		{
+			Whitted::this_thread_random_stream.NextBounce();
+			radiance_indirect = shading(deeper_ray_record, -W_in) * weight;
+		}
+	}
+	return radiance_direct + radiance_indirect;
+}
+
+Renderer::LightSample Renderer::sample_direct_illumination(const Whitted::IntersectionRecord& record, const glm::vec3& W_out, const glm::vec3& shading_point, const glm::vec3& shading_point_normal) const
+{
 	Whitted::IntersectionRecord arealight_sample;
 	float arealight_sample_PDF;
 	SamplingAreaLight(arealight_sample, arealight_sample_PDF);
@@ -346,35 +796,357 @@ glm::vec3 Renderer::shading(const Whitted::IntersectionRecord& record, const glm
 	{
 		arealight_sample_normal = -(arealight_sample.surface_normal);
 	}
-	Whitted::IntersectionRecord potential_occlusion = ray_BVH_intersection_record(AccelerationStructure::Ray{shading_point, W_in_light_source});
-	if (glm::length(shading_point_to_sample) < potential_occlusion.t + 0.01f)	// add 0.01 for intersection correction (in case the potential occluding object is the arealight itself)
-		// not occluded
-	{
+	return LightSample{
+		AccelerationStructure::Ray{shading_point, W_in_light_source},
+		glm::length(shading_point_to_sample) - 0.01f,	// subtract 0.01 for intersection correction (in case the potential occluding object is the arealight itself)
 		// compute 1 spp MCPT over the surface of the effective arealight:
-		radiance_direct = arealight_sample.emission * record.hitted_entity_material->BRDF(W_out, W_in_light_source, shading_point_normal) * glm::dot(W_in_light_source, shading_point_normal) * glm::dot(-W_in_light_source, arealight_sample_normal) / (glm::dot(shading_point_to_sample, shading_point_to_sample)) / (arealight_sample_PDF);
+		arealight_sample.emission * record.hitted_entity_material->BRDF(W_out, W_in_light_source, shading_point_normal) * glm::dot(W_in_light_source, shading_point_normal) * glm::dot(-W_in_light_source, arealight_sample_normal) / (glm::dot(shading_point_to_sample, shading_point_to_sample)) / (arealight_sample_PDF)
+	};
+}
+
+bool Renderer::sample_indirect_direction(const Whitted::IntersectionRecord& record, const glm::vec3& W_out, const glm::vec3& shading_point_normal, glm::vec3& W_in, glm::vec3& weight) const
+// weight: what the radiance arriving from W_in is multiplied with
+{
+	if (Whitted::get_random_float_0_1() >= RR_survival_probability)
+	{
+		return false;
 	}
+	W_in = glm::normalize(record.hitted_entity_material->Sampling(W_out, shading_point_normal));
+	float PDF = record.hitted_entity_material->PDF_at_the_sample(W_out, W_in, shading_point_normal);
+	// TODO: check PDF != 0
+	weight = record.hitted_entity_material->BRDF(W_out, W_in, shading_point_normal) * glm::dot(W_in, shading_point_normal) / PDF / RR_survival_probability;
+	return true;
+}
 
-	// Indirect Illumination:
-	glm::vec3 radiance_indirect = glm::vec3{ 0.0f,0.0f,0.0f };
-	if (Whitted::get_random_float_0_1() < RR_survival_probability)
-		// shot a ray from the shading point
+void Renderer::wavefront_path_tracing()
+/*
+The same estimate as RayGen_Shader and shading(), but rather than following one path to its end at a time, every stage runs for the paths
+of all the pixels before the next one starts:
+	1. the primary rays (as packets, if settings.trace_primary_ray_packets),
+	2. shading, with the paths grouped by material: each path takes a light sample and (unless Russian Roulette ends it) an indirect direction,
+	3. the shadow rays of all the light samples, as one batch,
+	4. the extension rays, sorted by direction octant and origin (so that neighbouring rays in the batch walk similar BVH nodes), as one batch,
+and 2-4 repeat until all the paths have ended. shading() adds radiance_indirect * weight to radiance_direct at every bounce,
+so a path accumulates the direct illumination of each bounce weighted by the product of the weights before it (its throughput).
+*/
+{
+	uint32_t width = frame_image_final->GetWidth();
+	uint32_t height = frame_image_final->GetHeight();
+	wavefront_paths.resize((size_t)width * height);
+	wavefront_active_paths.resize(wavefront_paths.size());
+	wavefront_shadow_rays.resize(wavefront_paths.size());
+	wavefront_extension_rays.resize(wavefront_paths.size());
+
+	// 1. primary rays:
+	if (settings.trace_primary_ray_packets)
+	{
+		for_each_packet_tile(
+			[this](uint32_t tile_x, uint32_t tile_y)
+			{
+				uint32_t tile_width = std::min(packet_tile_size, frame_image_final->GetWidth() - tile_x);
+				uint32_t tile_height = std::min(packet_tile_size, frame_image_final->GetHeight() - tile_y);
+				AccelerationStructure::RayPacket packet;
+				for (uint32_t y = tile_y; y < tile_y + tile_height; y++)
+				{
+					for (uint32_t x = tile_x; x < tile_x + tile_width; x++)
+					{
+						packet.Add(primary_ray(x, y));
+					}
+				}
+				std::array<Whitted::IntersectionRecord, AccelerationStructure::ray_packet_size> records;
+				scene_BVH().traverse_packet_from_root(packet, records);
+				for (uint32_t y = tile_y; y < tile_y + tile_height; y++)
+				{
+					for (uint32_t x = tile_x; x < tile_x + tile_width; x++)
+					{
+						start_wavefront_path(x, y, primary_ray(x, y), records[(y - tile_y) * tile_width + (x - tile_x)]);
+					}
+				}
+			}
+		);
+	}
+	else
+	{
+		tile_scheduler.ForEachPixel(
+			[this](uint32_t x, uint32_t y)
+			{
+				AccelerationStructure::Ray ray = primary_ray(x, y);
+				start_wavefront_path(x, y, ray, ray_BVH_intersection_record(ray));
+			}
+		);
+	}
+	std::iota(wavefront_active_paths.begin(), wavefront_active_paths.end(), 0);
+	wavefront_active_paths.erase(
+		std::remove_if(std::execution::par, wavefront_active_paths.begin(), wavefront_active_paths.end(),
+			[this](uint32_t path_index)
+			{
+				const Whitted::IntersectionRecord& record = wavefront_paths[path_index].record;
+				return (!record.has_intersection) || record.hitted_entity_material->IsEmitting();	// shading() returns right away for these
+			}
+		),
+		wavefront_active_paths.end()
+	);
+
+	AccelerationStructure::AABB_3D scene_bounding_volume = bvh->GetNodes().empty() ? AccelerationStructure::AABB_3D{} : bvh->GetNodes()[0].bounding_volume;
+	while (!wavefront_active_paths.empty())
+	{
+		size_t active_path_count = wavefront_active_paths.size();
+
+		// 2. shading, grouped by material:
+		group_wavefront_paths_by_material();
+		std::for_each(std::execution::par, wavefront_active_paths.begin(), wavefront_active_paths.end(),
+			[this](const uint32_t& path_index)
+			{
+				size_t i = &path_index - wavefront_active_paths.data();
+				shade_wavefront_path(path_index, wavefront_shadow_rays[i], wavefront_extension_rays[i]);
+			}
+		);
+
+		// 3. shadow rays (every path has at most one, so the paths can be updated in parallel):
+		std::for_each(std::execution::par, wavefront_shadow_rays.begin(), wavefront_shadow_rays.begin() + active_path_count,
+			[this](const WavefrontShadowRay& shadow_ray)
+			{
+				if (shadow_ray.is_active && (!ray_BVH_is_occluded(shadow_ray.light_sample.shadow_ray, shadow_ray.light_sample.distance)))
+				{
+					wavefront_paths[shadow_ray.path_index].radiance += shadow_ray.light_sample.radiance;
+				}
+			}
+		);
+
+		// 4. extension rays, sorted (a radix sort: a comparison sort every bounce costs about as much as the tracing in small scenes):
+		wavefront_extension_ray_order.clear();
+		for (uint32_t i = 0; i < active_path_count; i++)
+		{
+			if (wavefront_extension_rays[i].is_active)
+			{
+				wavefront_extension_ray_order.push_back(AccelerationStructure::BVH::MortonPrimitive{ 0, (int)i });
+			}
+		}
+		std::for_each(std::execution::par, wavefront_extension_ray_order.begin(), wavefront_extension_ray_order.end(),
+			[this, &scene_bounding_volume](AccelerationStructure::BVH::MortonPrimitive& entry)
+			{
+				entry.Morton_code = ray_sort_key(wavefront_extension_rays[entry.primitive_index].ray, scene_bounding_volume);
+			}
+		);
+		AccelerationStructure::BVH::radix_sort(wavefront_extension_ray_order);
+		std::for_each(std::execution::par, wavefront_extension_ray_order.begin(), wavefront_extension_ray_order.end(),
+			[this](const AccelerationStructure::BVH::MortonPrimitive& entry)
+			{
+				WavefrontExtensionRay& extension_ray = wavefront_extension_rays[entry.primitive_index];
+				Whitted::IntersectionRecord record = ray_BVH_intersection_record(extension_ray.ray);
+				extension_ray.is_active = record.has_intersection && (!(record.hitted_entity_material->IsEmitting()));	// see shading()
+				if (extension_ray.is_active)
+				{
+					WavefrontPath& path = wavefront_paths[extension_ray.path_index];
+					path.record = record;
+					path.W_out = -(extension_ray.ray.m_direction);
+					path.throughput = extension_ray.throughput;
+					path.bounce++;
+				}
+			}
+		);
+		wavefront_active_paths.clear();
+		for (const AccelerationStructure::BVH::MortonPrimitive& entry : wavefront_extension_ray_order)
+		{
+			if (wavefront_extension_rays[entry.primitive_index].is_active)
+			{
+				wavefront_active_paths.push_back(wavefront_extension_rays[entry.primitive_index].path_index);
+			}
+		}
+	}
+
+	tile_scheduler.ForEachPixel(
+		[this](uint32_t x, uint32_t y)
+		{
+			write_pixel_color(x, y, wavefront_paths[(size_t)y * frame_image_final->GetWidth() + x].radiance);
+		}
+	);
+}
+
+void Renderer::adaptive_sampling()
+/*
+While the camera stands still, each frame adds samples to a running estimate of every pixel (PixelEstimate) instead of replacing it,
+and spends its paths where the estimates are still noisy. The relative error e of a pixel after n samples falls with 1 / sqrt(n),
+so it takes about n * (e / threshold)^2 samples in all to get below the threshold, and the pixel asks for the rest of those (see
+adaptive_sample_demand()). The paths of the frame (settings.adaptive_samples_per_pixel per pixel) are shared out in proportion to
+what the pixels ask for, rounded at random so that the shares add up to the budget on average. So a converged wall costs nothing,
+and its paths go to the shadow edges instead. Until a pixel has adaptive_minimum_sample_count samples it takes one per frame, to have
+a variance to go by.
+The camera rays do not jitter, so the primary ray of a pixel is traced once per frame, and only the shading is repeated.
+*/
+{
+	uint32_t width = frame_image_final->GetWidth();
+	size_t pixel_count = (size_t)width * frame_image_final->GetHeight();
+	if ((pixel_estimates.size() != pixel_count) || (active_camera->ViewMatrix() != adaptive_view_matrix) || (active_camera->ProjectionMatrix() != adaptive_projection_matrix))
 	{
-		glm::vec3 W_in = glm::normalize(record.hitted_entity_material->Sampling(W_out, shading_point_normal));
-		float PDF = record.hitted_entity_material->PDF_at_the_sample(W_out, W_in, shading_point_normal);
-		// TODO: check PDF != 0
-		//if (PDF > 0.0f)
-		{
-			Whitted::IntersectionRecord deeper_ray_record = ray_BVH_intersection_record(AccelerationStructure::Ray{shading_point, W_in});
-			if (deeper_ray_record.has_intersection && (!(deeper_ray_record.hitted_entity_material->IsEmitting())))
-				/*
-				If the ray for indirect illumination does not hit any object, then we assume no light from the skybox.
-				If it hits the arealight, then our function returns 0 so that it is mathematically correct to do the linear sum of radiance_direct and radiance_indirect.
-				*/
+		pixel_estimates.assign(pixel_count, PixelEstimate{});
+		adaptive_view_matrix = active_camera->ViewMatrix();
+		adaptive_projection_matrix = active_camera->ProjectionMatrix();
+		adaptive_sampling_statistics = AdaptiveSamplingStatistics{};
+	}
+
+	size_t starting_pixel_count = std::count_if(std::execution::par, pixel_estimates.begin(), pixel_estimates.end(),
+		[](const PixelEstimate& estimate)
+		{
+			return estimate.sample_count < adaptive_minimum_sample_count;
+		}
+	);
+	double total_demand = std::transform_reduce(std::execution::par, pixel_estimates.begin(), pixel_estimates.end(), 0.0, std::plus<double>(),
+		[this](const PixelEstimate& estimate)
+		{
+			return (double)adaptive_sample_demand(estimate);
+		}
+	);
+	size_t converged_pixel_count = std::count_if(std::execution::par, pixel_estimates.begin(), pixel_estimates.end(),
+		[this](const PixelEstimate& estimate)
+		{
+			return (estimate.sample_count >= adaptive_minimum_sample_count) && (adaptive_sample_demand(estimate) == 0.0f);
+		}
+	);
+	double budget = std::max(0.0, (double)settings.adaptive_samples_per_pixel * pixel_count - (double)starting_pixel_count);
+	float share = (total_demand > budget) ? ((float)(budget / total_demand)) : (1.0f);
+
+	std::atomic<uint64_t> path_count{ 0 };
+	tile_scheduler.ForEachTile(
+		[&](const Scheduling::Tile& tile)
+		{
+			uint64_t tile_path_count = 0;
+			for (uint32_t y = tile.y; y < tile.y + tile.height; y++)
 			{
-				radiance_indirect = shading(deeper_ray_record, -W_in) * record.hitted_entity_material->BRDF(W_out, W_in, shading_point_normal) * glm::dot(W_in, shading_point_normal) / PDF / RR_survival_probability;
+				for (uint32_t x = tile.x; x < tile.x + tile.width; x++)
+				{
+					PixelEstimate& estimate = pixel_estimates[(size_t)y * width + x];
+					uint32_t pixel_index = y * width + x;
+					float rounding = Whitted::RandomStream{ pixel_index, adaptive_sampling_statistics.frame_count, adaptive_rounding_bounce }.Float();
+					uint32_t sample_count = (estimate.sample_count < adaptive_minimum_sample_count) ? (1) : ((uint32_t)(adaptive_sample_demand(estimate) * share + rounding));
+					if (sample_count > 0)
+					{
+						AccelerationStructure::Ray ray = primary_ray(x, y);
+						Whitted::IntersectionRecord record = ray_BVH_intersection_record(ray);
+						write_primary_hit(ray, record, g_buffer, x, y);
+						for (uint32_t i = 0; i < sample_count; i++)
+						{
+							Whitted::this_thread_random_stream = Whitted::RandomStream{ pixel_index, estimate.sample_count };	// the samples of a pixel are numbered from its first one
+							estimate.Add(record.has_intersection ? shading(record, -(ray.m_direction)) : night_sky_color);
+						}
+						tile_path_count += sample_count;
+					}
+					write_pixel_color(x, y, estimate.mean);		// every frame, since the denoiser overwrites the colors of the G-buffer
+				}
 			}
+			path_count.fetch_add(tile_path_count, std::memory_order_relaxed);
+		}
+	);
+
+	adaptive_sampling_statistics.path_count += path_count;
+	adaptive_sampling_statistics.paths_per_pixel = (float)adaptive_sampling_statistics.path_count / (float)pixel_count;
+	adaptive_sampling_statistics.frame_count++;
+	adaptive_sampling_statistics.converged_pixel_fraction = (float)converged_pixel_count / (float)pixel_count;
+}
+
+float Renderer::adaptive_sample_demand(const PixelEstimate& estimate) const
+{
+	if (estimate.sample_count < adaptive_minimum_sample_count)
+	{
+		return 0.0f;	// case: still taking its first samples, one per frame
+	}
+	float error_ratio = estimate.GetRelativeError() / settings.adaptive_relative_error;
+	if (error_ratio <= 1.0f)
+	{
+		return 0.0f;
+	}
+	return std::min(estimate.sample_count * (error_ratio * error_ratio - 1.0f), adaptive_maximum_samples_per_frame);
+}
+
+void Renderer::group_wavefront_paths_by_material()
+// A stable counting sort of wavefront_active_paths: a scene has a handful of materials, so a linear search finds the group of a path.
+{
+	std::vector<const Whitted::WhittedMaterial*> materials;
+	std::vector<size_t> group_offsets;
+	auto group_of = [this, &materials](uint32_t path_index)
+	{
+		return (size_t)(std::find(materials.begin(), materials.end(), wavefront_paths[path_index].record.hitted_entity_material) - materials.begin());
+	};
+	for (uint32_t path_index : wavefront_active_paths)
+	{
+		size_t group = group_of(path_index);
+		if (group == materials.size())
+		{
+			materials.push_back(wavefront_paths[path_index].record.hitted_entity_material);
+			group_offsets.push_back(0);
 		}
+		group_offsets[group]++;
+	}
+	size_t running_offset = 0;
+	for (size_t& group_offset : group_offsets)
+	{
+		size_t count = group_offset;
+		group_offset = running_offset;
+		running_offset += count;
+	}
 
+	wavefront_grouped_paths.resize(wavefront_active_paths.size());
+	for (uint32_t path_index : wavefront_active_paths)
+	{
+		wavefront_grouped_paths[group_offsets[group_of(path_index)]++] = path_index;
 	}
-	return radiance_direct + radiance_indirect;
+	wavefront_active_paths.swap(wavefront_grouped_paths);
+}
+
+void Renderer::start_wavefront_path(uint32_t x, uint32_t y, const AccelerationStructure::Ray& ray, const Whitted::IntersectionRecord& record)
+{
+	write_primary_hit(ray, record, g_buffer, x, y);
+	WavefrontPath& path = wavefront_paths[(size_t)y * frame_image_final->GetWidth() + x];
+	path.record = record;
+	path.W_out = -(ray.m_direction);
+	path.throughput = glm::vec3{ 1.0f, 1.0f, 1.0f };
+	path.bounce = 0;
+	if (!record.has_intersection)
+	{
+		path.radiance = night_sky_color;
+	}
+	else if (record.hitted_entity_material->IsEmitting())	// see shading()
+	{
+		path.radiance = record.hitted_entity_material->GetEmission();
+	}
+	else
+	{
+		path.radiance = glm::vec3{ 0.0f, 0.0f, 0.0f };
+	}
+}
+
+void Renderer::shade_wavefront_path(uint32_t path_index, WavefrontShadowRay& shadow_ray, WavefrontExtensionRay& extension_ray) const
+// shading() up to where it traces rays, which are handed to the next stages instead
+{
+	const WavefrontPath& path = wavefront_paths[path_index];
+	glm::vec3 shading_point_normal = path.record.surface_normal;
+	if (glm::dot(path.record.surface_normal, path.W_out) < 0.0f)
+	{
+		shading_point_normal = -(path.record.surface_normal);
+	}
+	glm::vec3 shading_point = path.record.location + shading_point_normal * INTERSECTION_CORRECTION;
+	Whitted::this_thread_random_stream = Whitted::RandomStream{ path_index, frame_index, path.bounce };		// a path is one per pixel, in the same order
+
+	shadow_ray.light_sample = sample_direct_illumination(path.record, path.W_out, shading_point, shading_point_normal);
+	shadow_ray.light_sample.radiance *= path.throughput;
+	shadow_ray.path_index = path_index;
+	shadow_ray.is_active = true;
+
+	glm::vec3 W_in;
+	glm::vec3 weight;
+	extension_ray.is_active = sample_indirect_direction(path.record, path.W_out, shading_point_normal, W_in, weight);
+	if (extension_ray.is_active)
+	{
+		extension_ray.ray = AccelerationStructure::Ray{shading_point, W_in};
+		extension_ray.throughput = path.throughput * weight;
+		extension_ray.path_index = path_index;
+	}
+}
+
+uint32_t Renderer::ray_sort_key(const AccelerationStructure::Ray& ray, const AccelerationStructure::AABB_3D& scene_bounding_volume) const
+// The octant goes first because rays of different octants visit the children of the nodes in different orders.
+// The origin keeps the 9 highest bits per axis of its Morton code.
+{
+	uint32_t octant = (uint32_t)(ray.m_direction.x < 0.0f) | ((uint32_t)(ray.m_direction.y < 0.0f) << 1) | ((uint32_t)(ray.m_direction.z < 0.0f) << 2);
+	return (octant << 27) | (AccelerationStructure::BVH::Morton_code_of(scene_bounding_volume.scaled_by_the_box(ray.m_origin)) >> 3);
 }
\ No newline at end of file
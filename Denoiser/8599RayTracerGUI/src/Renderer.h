@@ -18,7 +18,9 @@
 #include "Camera.h"
 #include "Ray.h"
 #include "BVH.h"
+#include "SceneSnapshot.h"
 #include "Denoiser.h"
+#include "TileScheduler.h"
 
 // Average index of refractions:
 #define eta_Vacuum 1.0
@@ -56,6 +58,20 @@ public:		// structs
 		bool using_temporal_current_frame_weighting_5 = false;
 		bool using_temporal_current_frame_weighting_20 = false;
 		bool using_temporal_current_frame_weighting_50 = false;
+
+		bool rebuild_BVH_every_frame = false;	// for scenes whose entities move between frames
+		bool refit_BVH_every_frame = false;		// cheaper than rebuilding when the entities only move a little, see RefitBVH()
+
+		bool trace_primary_ray_packets = true;	// trace the camera rays of each 8x8 tile of pixels as one packet, see RayGen_Shader_Packet()
+		bool wavefront_path_tracing = false;	// trace the paths of all the pixels bounce by bounce rather than one by one, see wavefront_path_tracing()
+
+		int render_thread_count = 0;		// 0: one thread per hardware thread
+		uint32_t render_tile_size = 32;		// in pixels, rounded up to a whole number of packet tiles
+		bool NUMA_scene_replicas = false;	// pin the render threads to the NUMA nodes, and give each node a copy of the scene, see update_scene_replicas()
+
+		bool adaptive_sampling = false;		// while the camera stands still, keep refining the pixels that are still noisy, see adaptive_sampling()
+		float adaptive_relative_error = 0.05f;		// a pixel has converged once the standard error of its mean luminance is below this fraction of it
+		float adaptive_samples_per_pixel = 1.0f;	// the paths of a frame, on average over the pixels
 	};
 
 public:		// methods
@@ -84,6 +100,21 @@ public:		// methods
 	void Reaccumulate()
 	{
 		//frame_accumulating = 1;
+		pixel_estimates.clear();	// adaptive_sampling() starts over
+	}
+
+	struct AdaptiveSamplingStatistics
+	// Since adaptive_sampling() last started over.
+	{
+		uint64_t path_count = 0;
+		float paths_per_pixel = 0.0f;
+		uint32_t frame_count = 0;
+		float converged_pixel_fraction = 0.0f;
+	};
+
+	const AdaptiveSamplingStatistics& GetAdaptiveSamplingStatistics() const
+	{
+		return adaptive_sampling_statistics;
 	}
 
 	Settings& GetSettings()
@@ -102,14 +133,146 @@ public:		// methods
 		entities.push_back(entity_pointer);
 	}
 
-	void GenerateBVH()
+	void GenerateBVH(AccelerationStructure::BVH::DividingMethod dividing_method = AccelerationStructure::BVH::DividingMethod::Surface_Area_Heuristic)
+	{
+		bvh = new AccelerationStructure::BVH{ entities, dividing_method };	// put into constructor? NO, since we may add entities before rendering but after initializing the World
+	}
+
+	void RebuildBVH()
+	// Rebuild the scene BVH over the same entities, e.g. after some of them have moved.
+	{
+		for_each_scene_BVH(
+			[](AccelerationStructure::BVH& scene_BVH)
+			{
+				scene_BVH.Rebuild();
+			}
+		);
+	}
+
+	void RefitBVH()
+	// Refit the scene BVH to the current boxes of the entities, and rebuild it instead once refitting has doubled its SAH cost.
+	{
+		for_each_scene_BVH(
+			[](AccelerationStructure::BVH& scene_BVH)
+			{
+				scene_BVH.Refit();
+				if (scene_BVH.GetSAHCost() > 2.0f * scene_BVH.GetSAHCostAtRebuild())
+				{
+					scene_BVH.Rebuild();
+				}
+			}
+		);
+	}
+
+	void SetBVHCompression(bool compress_nodes, bool quantize_vertices)
+	// Compress (or decompress) the scene BVH and the BVHs of the triangle meshes, see TriangleMesh::SetBVHCompression().
+	{
+		BVH_settings.compress_nodes = compress_nodes;
+		BVH_settings.quantize_vertices = quantize_vertices;
+		apply_BVH_settings();
+	}
+
+	void SetBVHNodeLayout(AccelerationStructure::BVH::NodeLayout node_layout, const Camera& camera)
+	// Reorder the nodes of the scene BVH and of the mesh BVHs in memory, see AccelerationStructure::BVH::SetNodeLayout().
+	// The treelets are packed around the nodes the primary rays of the camera visit most (sampled every few pixels).
+	{
+		BVH_settings.node_layout = node_layout;
+		BVH_settings.layout_sample_rays.clear();
+		if (node_layout == AccelerationStructure::BVH::NodeLayout::Treelets)
+		{
+			BVH_settings.layout_sample_rays = GetPrimaryRays(camera, layout_sampling_pixel_stride);
+		}
+		apply_BVH_settings();
+	}
+
+	std::array<float, 3> BenchmarkBVHNodeLayouts(const Camera& camera);
+	std::array<float, 2> BenchmarkIntegrators(const Camera& camera);
+	std::array<float, 2> BenchmarkRayBatches(const Camera& camera);
+	std::array<float, 2> BenchmarkSceneReplicas(const Camera& camera);
+
+	int GetSceneReplicaCount() const
+	{
+		return (int)scene_replicas.size();
+	}
+
+	std::vector<std::pair<std::string, AccelerationStructure::BVH_Statistics>> GetBVHStatistics() const
+	// Of the scene BVH ("scene") and of the BVHs of the triangle meshes ("mesh 0", "mesh 1", ...), parsed or loaded from the snapshot.
+	// A mesh is listed once however many MeshInstances share it, and the scene replicas hold copies of the same BVHs, so they are not
+	// listed again either.
+	{
+		std::vector<std::pair<std::string, AccelerationStructure::BVH_Statistics>> statistics{ { "scene", bvh->GetStatistics() } };
+		for (const Whitted::TriangleMesh* mesh : get_triangle_meshes(entities))
+		{
+			statistics.emplace_back("mesh " + std::to_string(statistics.size() - 1), mesh->GetBVH().GetStatistics());
+		}
+		return statistics;
+	}
+
+	void SetBVHTraversalCounting(bool count_traversals)
+	// Count what the ray queries cost in the scene BVH and in the mesh BVHs, from now on (the counters restart from 0, as they
+	// do whenever the BVH settings change, so that the statistics describe one set of settings).
+	{
+		BVH_settings.count_traversals = count_traversals;
+		apply_BVH_settings();
+	}
+
+	AccelerationStructure::BVH_TraversalStatistics GetBVHTraversalStatistics() const
+	// Summed over the scene BVH and the mesh BVHs. Every ray the renderer traces is one query on the scene BVH, so average over
+	// GetSceneBVHQueryCount() to get the cost per ray. The scene replicas (and their meshes) count their queries too.
+	{
+		AccelerationStructure::BVH_TraversalStatistics statistics = bvh->GetTraversalStatistics();
+		for (const SceneReplica& replica : scene_replicas)
+		{
+			statistics += replica.bvh->GetTraversalStatistics();
+		}
+		for_each_triangle_mesh(
+			[&statistics](const Whitted::TriangleMesh& mesh)
+			{
+				statistics += mesh.GetBVH().GetTraversalStatistics();
+			}
+		);
+		return statistics;
+	}
+
+	uint64_t GetSceneBVHQueryCount() const
 	{
-		bvh = new AccelerationStructure::BVH{ entities };	// put into constructor? NO, since we may add entities before rendering but after initializing the World
+		uint64_t query_count = bvh->GetTraversalStatistics().query_count;
+		for (const SceneReplica& replica : scene_replicas)
+		{
+			query_count += replica.bvh->GetTraversalStatistics().query_count;
+		}
+		return query_count;
+	}
+
+	bool WriteBVHStatistics(const std::string& file_path) const;
+
+	size_t GetBVHMemoryInBytes() const
+	// What the ray queries walk through: the nodes of the scene BVH, and the nodes and vertices of the triangle meshes (of one copy of the scene).
+	{
+		size_t memory_in_bytes = bvh->GetNodeMemoryInBytes();
+		for (const Whitted::TriangleMesh* mesh : get_triangle_meshes(entities))
+		{
+			memory_in_bytes += mesh->GetTraversalMemoryInBytes();
+		}
+		return memory_in_bytes;
 	}
 
 	Whitted::IntersectionRecord ray_BVH_intersection_record(const AccelerationStructure::Ray& ray) const
 	{
-		return bvh->traverse_BVH_from_root(ray);
+		return scene_BVH().traverse_BVH_from_root(ray);
+	}
+
+	void ray_BVH_intersection_records(AccelerationStructure::Ray* rays, int ray_count, Whitted::IntersectionRecord* records) const
+	// ray_BVH_intersection_record() for a batch of rays (records[i] for rays[i]), with the traversals of the rays interleaved
+	// so that the BVH nodes are fetched in the background (see AccelerationStructure::interleave_traversals()). The t_max of the rays shrinks to their hits.
+	{
+		scene_BVH().traverse_rays_from_root(rays, ray_count, records);
+	}
+
+	bool ray_BVH_is_occluded(const AccelerationStructure::Ray& ray, const float& distance) const
+	// Shadow ray query: whether anything blocks the ray before it travels the given distance (the ray direction must be normalized).
+	{
+		return scene_BVH().is_occluded_from_root(ray, distance);
 	}
 
 	glm::vec3 mirror_reflection_direction(const glm::vec3& incident_ray_direction, const glm::vec3& surface_normal) const
@@ -188,13 +351,14 @@ public:		// methods
 		Currently the code below is designed to render Cornell Box only.
 		Hence, we assume that there is only one (area)light source.
 		*/
-		for (uint32_t n = 0; n < entities.size(); n++)
+		const std::vector<Whitted::Entity*>& node_entities = scene_entities();	// the ones in the memory of the NUMA node of this thread
+		for (uint32_t n = 0; n < node_entities.size(); n++)
 		{
-			if (entities[n]->IsEmissive())
+			if (node_entities[n]->IsEmissive())
 			{
 				// We have found the only light source
 				// For Cornell Box, this should be a triangle mesh representing a rectangle which consists of 2 triangles
-				entities[n]->Sampling(sample, PDF);
+				node_entities[n]->Sampling(sample, PDF);
 
 				break;
 			}
@@ -203,14 +367,167 @@ public:		// methods
 
 private:	// methods
 
-	glm::vec3 cast_path(const AccelerationStructure::Ray& ray, Denoising::G_Buffer& g_buffer, const int& column, const int& row) const;
+	glm::vec3 cast_path(const AccelerationStructure::Ray& ray, const Whitted::IntersectionRecord& record, Denoising::G_Buffer& g_buffer, const int& column, const int& row) const;	// record: of the ray
+	void write_primary_hit(const AccelerationStructure::Ray& ray, const Whitted::IntersectionRecord& record, Denoising::G_Buffer& g_buffer, const int& column, const int& row) const;	// into the G-buffer
 	glm::vec3 shading(const Whitted::IntersectionRecord& record, const glm::vec3& W_out) const;
+
+	// The two samples shading() takes at a shading point, shared with the wavefront integrator so that both compute the same estimate:
+	struct LightSample
+	{
+		AccelerationStructure::Ray shadow_ray;
+		float distance;			// to the sample on the area light (minus the intersection correction)
+		glm::vec3 radiance;		// the direct illumination, if the shadow ray is not occluded
+	};
+	LightSample sample_direct_illumination(const Whitted::IntersectionRecord& record, const glm::vec3& W_out, const glm::vec3& shading_point, const glm::vec3& shading_point_normal) const;
+	bool sample_indirect_direction(const Whitted::IntersectionRecord& record, const glm::vec3& W_out, const glm::vec3& shading_point_normal, glm::vec3& W_in, glm::vec3& weight) const;	// false if Russian Roulette ends the path
+
+	// The wavefront integrator:
+	struct WavefrontPath
+	// What a path carries from one stage to the next.
+	{
+		Whitted::IntersectionRecord record;		// of the current bounce
+		glm::vec3 W_out;
+		glm::vec3 throughput;	// the factor the radiance leaving the current bounce towards W_out contributes to the pixel with
+		glm::vec3 radiance;		// gathered so far
+		uint32_t bounce;		// of the current bounce, which resumes the random stream of the path
+	};
+	struct WavefrontShadowRay
+	{
+		LightSample light_sample;	// radiance already weighted by the throughput of the path
+		uint32_t path_index;
+		bool is_active;
+	};
+	struct WavefrontExtensionRay
+	{
+		AccelerationStructure::Ray ray;
+		glm::vec3 throughput;		// of the path, if the ray hits a surface
+		uint32_t path_index;
+		bool is_active;
+	};
+	void wavefront_path_tracing();
+
+	// The adaptive sampler:
+	struct PixelEstimate
+	// The running mean of the samples of a pixel, with the variance of their luminance (Welford's online algorithm).
+	{
+		glm::vec3 mean{ 0.0f };
+		float luminance_mean = 0.0f;
+		float luminance_M2 = 0.0f;		// the sum of the squared deviations from luminance_mean
+		uint32_t sample_count = 0;
+
+		void Add(const glm::vec3& sample)
+		{
+			sample_count++;
+			mean += (sample - mean) / (float)sample_count;
+			float luminance = glm::dot(sample, glm::vec3{ 0.2126f, 0.7152f, 0.0722f });	// Rec. 709
+			float deviation = luminance - luminance_mean;
+			luminance_mean += deviation / (float)sample_count;
+			luminance_M2 += deviation * (luminance - luminance_mean);
+		}
+
+		float GetRelativeError() const
+		// The standard error of the mean luminance over the mean luminance, which is floored so that black pixels can converge too.
+		{
+			if (sample_count < 2)
+			{
+				return std::numeric_limits<float>::max();
+			}
+			float standard_error = std::sqrt(luminance_M2 / (float)(sample_count - 1) / (float)sample_count);
+			return standard_error / std::max(luminance_mean, 0.01f);
+		}
+	};
+	void adaptive_sampling();
+	float adaptive_sample_demand(const PixelEstimate& estimate) const;	// the samples the pixel still asks for, 0 once converged
+
+	void start_wavefront_path(uint32_t x, uint32_t y, const AccelerationStructure::Ray& ray, const Whitted::IntersectionRecord& record);
+	void group_wavefront_paths_by_material();
+	void shade_wavefront_path(uint32_t path_index, WavefrontShadowRay& shadow_ray, WavefrontExtensionRay& extension_ray) const;
+	uint32_t ray_sort_key(const AccelerationStructure::Ray& ray, const AccelerationStructure::AABB_3D& scene_bounding_volume) const;	// 30 bits: the direction octant, then the Morton code of the origin
+	void write_pixel_color(uint32_t x, uint32_t y, const glm::vec3& unfiltered_color_RGB);
 	void RayGen_Shader(uint32_t x, uint32_t y);	// mimic one of the vulkan shaders which is called to cast ray(s) for every pixel
+	void RayGen_Shader_Packet(uint32_t tile_x, uint32_t tile_y);	// RayGen_Shader for a tile of pixels, with the primary rays traced as one packet
+	void for_each_packet_tile(const std::function<void(uint32_t tile_x, uint32_t tile_y)>& trace_packet_tile);	// the top left pixels of the packet tiles, a scheduler tile at a time
+
+	// One copy of the scene per NUMA node of tile_scheduler:
+	struct SceneReplica
+	{
+		std::vector<std::unique_ptr<Whitted::Entity>> copies;	// of the triangle meshes and the MeshInstances of the shared scene, in the memory of the node
+		std::vector<Whitted::Entity*> entities;		// entities, with the copies in place of the meshes and the instances
+		std::unique_ptr<AccelerationStructure::BVH> bvh;
+	};
+	void update_scene_replicas();
+
+	// What the SetBVH* setters choose, for the shared scene and the replicas alike:
+	struct BVHSettings
+	{
+		bool compress_nodes = false;
+		bool quantize_vertices = false;
+		AccelerationStructure::BVH::NodeLayout node_layout = AccelerationStructure::BVH::NodeLayout::Depth_First;
+		std::vector<AccelerationStructure::Ray> layout_sample_rays;		// of the camera of the last SetBVHNodeLayout(), kept for the replicas made later
+		bool count_traversals = false;
+	};
+	void apply_BVH_settings();		// to the shared scene and to every replica
+	void apply_BVH_settings_to(const std::vector<Whitted::Entity*>& scene, AccelerationStructure::BVH& scene_BVH);	// to one of them
+	static std::vector<Whitted::TriangleMesh*> get_triangle_meshes(const std::vector<Whitted::Entity*>& scene);
+
+	const AccelerationStructure::BVH& scene_BVH() const
+	// The scene BVH the ray queries of this thread walk: the one of its NUMA node if there are replicas.
+	{
+		int node_index = Scheduling::TileScheduler::GetNodeIndexOfThisThread();
+		return (node_index < (int)scene_replicas.size()) ? (*scene_replicas[node_index].bvh) : (*bvh);
+	}
+
+	const std::vector<Whitted::Entity*>& scene_entities() const
+	{
+		int node_index = Scheduling::TileScheduler::GetNodeIndexOfThisThread();
+		return (node_index < (int)scene_replicas.size()) ? (scene_replicas[node_index].entities) : (entities);
+	}
+
+	template <typename F>
+	void for_each_triangle_mesh(F&& f) const
+	// The triangle meshes of the shared scene and those of the replicas.
+	{
+		for (Whitted::TriangleMesh* mesh : get_triangle_meshes(entities))
+		{
+			f(*mesh);
+		}
+		for (const SceneReplica& replica : scene_replicas)
+		{
+			for (Whitted::TriangleMesh* mesh : get_triangle_meshes(replica.entities))
+			{
+				f(*mesh);
+			}
+		}
+	}
+
+	template <typename F>
+	void for_each_scene_BVH(F&& f)
+	// The shared scene BVH and those of the replicas, which have to stay alike.
+	{
+		f(*bvh);
+		for (SceneReplica& replica : scene_replicas)
+		{
+			f(*replica.bvh);
+		}
+	}
+	void primary_ray_shader(uint32_t x, uint32_t y, const AccelerationStructure::Ray& ray, const Whitted::IntersectionRecord& record);	// what RayGen_Shader does once the primary ray is traced
+	AccelerationStructure::Ray primary_ray(uint32_t x, uint32_t y) const;
+	std::vector<AccelerationStructure::Ray> GetPrimaryRays(const Camera& camera, int pixel_stride) const;	// of every pixel_stride-th pixel in both directions
 
 private:	// members
 	Settings settings;
-	std::vector<uint32_t> rows;
-	std::vector<uint32_t> columns;
+	Scheduling::TileScheduler tile_scheduler;	// runs the per-pixel passes of the renderer and the denoiser
+	std::vector<WavefrontPath> wavefront_paths;		// one per pixel, and the queues below refer to them by index
+	std::vector<uint32_t> wavefront_active_paths;
+	std::vector<uint32_t> wavefront_grouped_paths;		// scratch space of group_wavefront_paths_by_material()
+	std::vector<WavefrontShadowRay> wavefront_shadow_rays;
+	std::vector<WavefrontExtensionRay> wavefront_extension_rays;
+	std::vector<AccelerationStructure::BVH::MortonPrimitive> wavefront_extension_ray_order;	// ray_sort_key() and the index of every active extension ray, sorted
+	uint32_t frame_index = 0;		// the sample index of the random streams of the pixels, so that each frame draws new numbers
+	std::vector<PixelEstimate> pixel_estimates;		// one per pixel, empty while adaptive_sampling() is off
+	glm::mat4 adaptive_view_matrix{ 1.0f };			// of the camera the estimates were taken with
+	glm::mat4 adaptive_projection_matrix{ 1.0f };
+	AdaptiveSamplingStatistics adaptive_sampling_statistics;
 	std::shared_ptr<Walnut::Image> frame_image_final;
 	uint32_t* frame_data = nullptr;
 	
@@ -224,8 +541,18 @@ private:	// members
 	const Camera* active_camera = nullptr;
 
 	const float RR_survival_probability = 0.8;	// RR for "Russian Roulette"
+	const glm::vec3 night_sky_color = glm::vec3{12 / 255.0f, 20 / 255.0f, 69 / 255.0f};	// 12, 20, 69, for the primary rays that hit nothing
+	static constexpr uint32_t packet_tile_size = 8;
+	static_assert(packet_tile_size * packet_tile_size <= AccelerationStructure::ray_packet_size, "a tile has to fit in one packet");
+	static constexpr int layout_sampling_pixel_stride = 4;	// the treelet layout samples the primary ray of one pixel in every 4x4 block
+	static constexpr uint32_t adaptive_minimum_sample_count = 16;	// of a pixel, before its variance is trusted
+	static constexpr float adaptive_maximum_samples_per_frame = 16.0f;	// of a pixel
+	static constexpr uint32_t adaptive_rounding_bounce = std::numeric_limits<uint32_t>::max();	// the random stream of the share of a pixel, which no path reaches
 	AccelerationStructure::BVH* bvh = nullptr;
 	std::vector<Whitted::Entity*> entities;
+	std::unique_ptr<Whitted::SceneSnapshot> scene_snapshot;	// owns the meshes (and materials) when the scene is loaded from a snapshot
+	std::vector<SceneReplica> scene_replicas;	// one per node of tile_scheduler with settings.NUMA_scene_replicas, none otherwise
+	BVHSettings BVH_settings;
 };
 
 #endif // !RENDERER_H
\ No newline at end of file
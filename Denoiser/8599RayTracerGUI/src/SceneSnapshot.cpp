@@ -0,0 +1,290 @@
+/*****************************************************************//**
+ * \file   SceneSnapshot.cpp
+ * \brief  Writing and reading the binary scene snapshots
+ *
+ * \author Xiaoyang Liu
+ * \date   October 2026
+ *********************************************************************/
+
+#include "SceneSnapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <unordered_map>
+
+namespace Whitted
+{
+	namespace
+	{
+		uint64_t align_up(uint64_t offset)
+		{
+			return (offset + snapshot_alignment - 1) / snapshot_alignment * snapshot_alignment;
+		}
+
+		bool section_is_inside(uint64_t offset, uint64_t size, uint64_t file_size)
+		{
+			return (offset % snapshot_alignment == 0) && (offset <= file_size) && (size <= file_size - offset);
+		}
+
+		struct alignas(snapshot_alignment) SnapshotBlock
+		// The unit the file is read into, so that the sections of the buffer are aligned like those of the file.
+		{
+			char bytes[snapshot_alignment];
+		};
+	}
+
+	bool SceneSnapshot::Write(const std::string& file_path, const std::vector<TriangleMesh*>& meshes, const SnapshotBuildParameters& build_parameters)
+	{
+		// the material table:
+		std::vector<WhittedMaterial*> materials;
+		std::unordered_map<WhittedMaterial*, uint32_t> material_indices;
+		for (TriangleMesh* mesh : meshes)
+		{
+			if (material_indices.find(mesh->GetMaterial()) == material_indices.end())
+			{
+				material_indices[mesh->GetMaterial()] = (uint32_t)materials.size();
+				materials.push_back(mesh->GetMaterial());
+			}
+		}
+
+		// lay out the file:
+		SnapshotHeader header{};
+		std::memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+		header.version = snapshot_version;
+		header.byte_order_mark = snapshot_byte_order_mark;
+		header.node_size = sizeof(AccelerationStructure::BVH_LinearNode);
+		header.mesh_record_size = sizeof(SnapshotMeshRecord);
+		header.build_parameters = build_parameters;
+		header.material_count = (uint32_t)materials.size();
+		header.mesh_count = (uint32_t)meshes.size();
+		header.materials_offset = align_up(sizeof(SnapshotHeader));
+		header.meshes_offset = align_up(header.materials_offset + materials.size() * sizeof(SnapshotMaterial));
+
+		std::vector<SnapshotMeshRecord> mesh_records(meshes.size());
+		uint64_t file_size = align_up(header.meshes_offset + meshes.size() * sizeof(SnapshotMeshRecord));
+		for (size_t m = 0; m < meshes.size(); m++)
+		{
+			const AccelerationStructure::BVH& bvh = meshes[m]->GetBVH();
+			SnapshotMeshRecord& record = mesh_records[m];
+			record.material_index = material_indices[meshes[m]->GetMaterial()];
+			record.first_primitive_id = meshes[m]->GetFirstPrimitiveId();
+			record.vertex_count = (uint32_t)meshes[m]->GetVertexCount();
+			record.triangle_count = (uint32_t)meshes[m]->GetTriangleCount();
+			record.reference_count = (uint32_t)bvh.GetPrimitiveIndices().size();
+			record.node_count = (uint32_t)bvh.GetNodes().size();
+			record.vertices_offset = file_size;
+			record.texture_coordinates_offset = align_up(record.vertices_offset + record.vertex_count * sizeof(glm::vec3));
+			record.vertices_indices_offset = align_up(record.texture_coordinates_offset + record.vertex_count * sizeof(glm::vec2));
+			record.primitive_indices_offset = align_up(record.vertices_indices_offset + record.triangle_count * 3 * sizeof(uint32_t));
+			record.duplicate_references_offset = align_up(record.primitive_indices_offset + record.reference_count * sizeof(int));
+			record.nodes_offset = align_up(record.duplicate_references_offset + record.reference_count * sizeof(char));
+			record.node_mesh_areas_offset = align_up(record.nodes_offset + record.node_count * sizeof(AccelerationStructure::BVH_LinearNode));
+			file_size = align_up(record.node_mesh_areas_offset + record.node_count * sizeof(float));
+		}
+		header.file_size = file_size;
+
+		// fill it in:
+		std::vector<char> buffer(file_size, 0);
+		std::memcpy(buffer.data(), &header, sizeof(header));
+		for (size_t i = 0; i < materials.size(); i++)
+		{
+			SnapshotMaterial material{};
+			material.emission = materials[i]->GetEmission();
+			material.diffuse_coefficient = materials[i]->diffuse_coefficient;
+			material.diffuse_color = materials[i]->GetDiffuseColor();
+			material.refractive_index = materials[i]->refractive_index;
+			material.material_nature = (uint32_t)materials[i]->GetMaterialNature();
+			std::memcpy(buffer.data() + header.materials_offset + i * sizeof(SnapshotMaterial), &material, sizeof(material));
+		}
+		for (size_t m = 0; m < meshes.size(); m++)
+		{
+			const TriangleMesh& mesh = *meshes[m];
+			const AccelerationStructure::BVH& bvh = mesh.GetBVH();
+			const SnapshotMeshRecord& record = mesh_records[m];
+			std::memcpy(buffer.data() + header.meshes_offset + m * sizeof(SnapshotMeshRecord), &record, sizeof(record));
+			for (uint32_t i = 0; i < record.vertex_count; i++)
+			{
+				std::memcpy(buffer.data() + record.vertices_offset + i * sizeof(glm::vec3), &mesh.GetVertex(i), sizeof(glm::vec3));
+				std::memcpy(buffer.data() + record.texture_coordinates_offset + i * sizeof(glm::vec2), &mesh.GetTextureCoordinates(i), sizeof(glm::vec2));
+			}
+			for (uint32_t i = 0; i < record.triangle_count; i++)
+			{
+				std::array<uint32_t, 3> vertices_indices = mesh.GetTriangleVertexIndices(i);
+				std::memcpy(buffer.data() + record.vertices_indices_offset + i * 3 * sizeof(uint32_t), vertices_indices.data(), 3 * sizeof(uint32_t));
+			}
+			std::memcpy(buffer.data() + record.primitive_indices_offset, bvh.GetPrimitiveIndices().data(), record.reference_count * sizeof(int));
+			for (uint32_t i = 0; i < record.reference_count; i++)
+			{
+				buffer[record.duplicate_references_offset + i] = bvh.IsDuplicateReference(i) ? 1 : 0;
+			}
+			std::memcpy(buffer.data() + record.nodes_offset, bvh.GetNodes().data(), record.node_count * sizeof(AccelerationStructure::BVH_LinearNode));
+			std::memcpy(buffer.data() + record.node_mesh_areas_offset, bvh.GetNodeMeshAreas().data(), record.node_count * sizeof(float));
+		}
+
+		std::ofstream file(file_path, std::ios::binary | std::ios::trunc);
+		file.write(buffer.data(), (std::streamsize)buffer.size());
+		return (bool)file;
+	}
+
+	SceneSnapshot::SceneSnapshot(const std::string& file_path, const SnapshotBuildParameters& build_parameters)
+	// The meshes copy what they need out of the buffer, so it only lives as long as the loading.
+	{
+		std::ifstream file(file_path, std::ios::binary | std::ios::ate);
+		if (!file)
+		{
+			return;
+		}
+		std::streamoff size = file.tellg();
+		if (size <= 0)
+		{
+			return;
+		}
+		std::vector<SnapshotBlock> buffer(((size_t)size + snapshot_alignment - 1) / snapshot_alignment);
+		file.seekg(0);
+		if (!file.read(buffer.front().bytes, size))
+		{
+			return;
+		}
+		load(buffer.front().bytes, (size_t)size, build_parameters);
+	}
+
+	void SceneSnapshot::load(const char* data, size_t size, const SnapshotBuildParameters& build_parameters)
+	{
+		if ((data == nullptr) || (size < sizeof(SnapshotHeader)))
+		{
+			return;
+		}
+
+		SnapshotHeader header;
+		std::memcpy(&header, data, sizeof(header));
+		if ((std::memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic)) != 0) ||
+			(header.version != snapshot_version) ||
+			(header.byte_order_mark != snapshot_byte_order_mark) ||
+			(header.node_size != sizeof(AccelerationStructure::BVH_LinearNode)) ||
+			(header.mesh_record_size != sizeof(SnapshotMeshRecord)) ||
+			(header.build_parameters.dividing_method != build_parameters.dividing_method) ||
+			(header.build_parameters.mesh_scale != build_parameters.mesh_scale) ||
+			(header.build_parameters.BVH_builder_version != build_parameters.BVH_builder_version) ||
+			(header.file_size != size) ||
+			(!section_is_inside(header.materials_offset, (uint64_t)header.material_count * sizeof(SnapshotMaterial), header.file_size)) ||
+			(!section_is_inside(header.meshes_offset, (uint64_t)header.mesh_count * sizeof(SnapshotMeshRecord), header.file_size)))
+		{
+			return;
+		}
+
+		// Everything the meshes index with is checked before any of it is used:
+		const SnapshotMeshRecord* mesh_records = reinterpret_cast<const SnapshotMeshRecord*>(data + header.meshes_offset);
+		for (uint32_t m = 0; m < header.mesh_count; m++)
+		{
+			const SnapshotMeshRecord& record = mesh_records[m];
+			if ((record.material_index >= header.material_count) ||
+				(record.vertex_count == 0) || (record.triangle_count == 0) || (record.node_count == 0) ||		// sampling reads the mesh area of the root
+				(record.vertex_count > (uint32_t)std::numeric_limits<int>::max()) ||
+				(record.triangle_count > (uint32_t)std::numeric_limits<int>::max() / 3) ||
+				(record.reference_count > (uint32_t)std::numeric_limits<int>::max()) ||
+				(record.node_count > (uint32_t)std::numeric_limits<int>::max()) ||
+				(!section_is_inside(record.vertices_offset, (uint64_t)record.vertex_count * sizeof(glm::vec3), header.file_size)) ||
+				(!section_is_inside(record.texture_coordinates_offset, (uint64_t)record.vertex_count * sizeof(glm::vec2), header.file_size)) ||
+				(!section_is_inside(record.vertices_indices_offset, (uint64_t)record.triangle_count * 3 * sizeof(uint32_t), header.file_size)) ||
+				(!section_is_inside(record.primitive_indices_offset, (uint64_t)record.reference_count * sizeof(int), header.file_size)) ||
+				(!section_is_inside(record.duplicate_references_offset, (uint64_t)record.reference_count * sizeof(char), header.file_size)) ||
+				(!section_is_inside(record.nodes_offset, (uint64_t)record.node_count * sizeof(AccelerationStructure::BVH_LinearNode), header.file_size)) ||
+				(!section_is_inside(record.node_mesh_areas_offset, (uint64_t)record.node_count * sizeof(float), header.file_size)))
+			{
+				return;
+			}
+
+			const uint32_t* vertices_indices = reinterpret_cast<const uint32_t*>(data + record.vertices_indices_offset);
+			for (uint32_t i = 0; i < record.triangle_count * 3; i++)
+			{
+				if (vertices_indices[i] >= record.vertex_count)
+				{
+					return;
+				}
+			}
+			const int* primitive_indices = reinterpret_cast<const int*>(data + record.primitive_indices_offset);
+			for (uint32_t i = 0; i < record.reference_count; i++)
+			{
+				if ((primitive_indices[i] < 0) || ((uint32_t)primitive_indices[i] >= record.triangle_count))
+				{
+					return;
+				}
+			}
+			// The nodes have to form a depth-first tree (the second child of a node comes after the subtree of its first child, which
+			// makes every walk down the tree terminate), no deeper than the traversal stacks, with leaves inside the references:
+			constexpr int maximum_node_depth = 64;	// the same bound as BVH::traversal_stack_size
+			const AccelerationStructure::BVH_LinearNode* nodes = reinterpret_cast<const AccelerationStructure::BVH_LinearNode*>(data + record.nodes_offset);
+			std::vector<int> node_depths(record.node_count, 0);
+			for (uint32_t i = 0; i < record.node_count; i++)
+			{
+				const AccelerationStructure::BVH_LinearNode& node = nodes[i];
+				if (node.primitive_count > 0)
+				{
+					if ((node.first_primitive_index < 0) || ((uint64_t)node.first_primitive_index + node.primitive_count > record.reference_count))
+					{
+						return;
+					}
+					continue;
+				}
+				if ((node.split_axis > 2) ||
+					(node.second_child_index <= (int64_t)i + 1) || ((uint32_t)node.second_child_index >= record.node_count) ||
+					(node_depths[i] + 1 >= maximum_node_depth))
+				{
+					return;
+				}
+				node_depths[i + 1] = node_depths[i] + 1;
+				node_depths[node.second_child_index] = node_depths[i] + 1;
+			}
+		}
+
+		const SnapshotMaterial* snapshot_materials = reinterpret_cast<const SnapshotMaterial*>(data + header.materials_offset);
+		for (uint32_t i = 0; i < header.material_count; i++)
+		{
+			const SnapshotMaterial& material = snapshot_materials[i];
+			m_materials.push_back(std::make_unique<WhittedMaterial>((MaterialNature)material.material_nature, material.emission, material.diffuse_color));
+			m_materials.back()->diffuse_coefficient = material.diffuse_coefficient;
+			m_materials.back()->refractive_index = material.refractive_index;
+		}
+		for (uint32_t m = 0; m < header.mesh_count; m++)
+		{
+			const SnapshotMeshRecord& record = mesh_records[m];
+			AccelerationStructure::BVH_Hierarchy hierarchy;
+			const int* primitive_indices = reinterpret_cast<const int*>(data + record.primitive_indices_offset);
+			hierarchy.primitive_indices.assign(primitive_indices, primitive_indices + record.reference_count);
+			const AccelerationStructure::BVH_LinearNode* nodes = reinterpret_cast<const AccelerationStructure::BVH_LinearNode*>(data + record.nodes_offset);
+			hierarchy.nodes.assign(nodes, nodes + record.node_count);
+			const float* node_mesh_areas = reinterpret_cast<const float*>(data + record.node_mesh_areas_offset);
+			hierarchy.node_mesh_areas.assign(node_mesh_areas, node_mesh_areas + record.node_count);
+			const char* duplicate_references = data + record.duplicate_references_offset;
+			if (std::any_of(duplicate_references, duplicate_references + record.reference_count, [](char is_duplicate) { return is_duplicate != 0; }))
+			{
+				hierarchy.is_duplicate_reference.assign(duplicate_references, duplicate_references + record.reference_count);
+			}
+
+			m_meshes.push_back(std::make_unique<TriangleMesh>(
+				record.first_primitive_id,
+				m_materials[record.material_index].get(),
+				reinterpret_cast<const glm::vec3*>(data + record.vertices_offset),
+				reinterpret_cast<const glm::vec2*>(data + record.texture_coordinates_offset),
+				(int)record.vertex_count,
+				reinterpret_cast<const uint32_t*>(data + record.vertices_indices_offset),
+				(int)record.triangle_count,
+				std::move(hierarchy),
+				(AccelerationStructure::BVH::DividingMethod)build_parameters.dividing_method
+			));
+		}
+		m_valid = true;
+	}
+
+	std::vector<TriangleMesh*> SceneSnapshot::GetMeshes() const
+	{
+		std::vector<TriangleMesh*> meshes;
+		for (const std::unique_ptr<TriangleMesh>& mesh : m_meshes)
+		{
+			meshes.push_back(mesh.get());
+		}
+		return meshes;
+	}
+}
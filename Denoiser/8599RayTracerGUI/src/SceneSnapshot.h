@@ -0,0 +1,123 @@
+/*****************************************************************//**
+ * \file   SceneSnapshot.h
+ * \brief  A binary snapshot of the triangle meshes of a scene (vertex buffers + BVH nodes + materials) that is read back in one piece instead of parsed
+ *
+ * \author Xiaoyang Liu
+ * \date   October 2026
+ *********************************************************************/
+
+#ifndef SCENESNAPSHOT_H
+#define SCENESNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "TriangleMesh.h"
+
+namespace Whitted
+{
+	/*
+	File layout (every section starts at a multiple of snapshot_alignment bytes from the start of the file):
+
+		SnapshotHeader
+		SnapshotMaterial[material_count]			at materials_offset
+		SnapshotMeshRecord[mesh_count]				at meshes_offset
+		and for each mesh:
+			glm::vec3[vertex_count]								at vertices_offset
+			glm::vec2[vertex_count]								at texture_coordinates_offset
+			uint32_t[3 * triangle_count]						at vertices_indices_offset
+			int[reference_count]								at primitive_indices_offset
+			char[reference_count]								at duplicate_references_offset
+			AccelerationStructure::BVH_LinearNode[node_count]	at nodes_offset
+			float[node_count]									at node_mesh_areas_offset
+
+	That is a TriangleMesh and the hierarchy of its BVH (see AccelerationStructure::BVH_Hierarchy), stored exactly the way they are
+	laid out in memory. It is a binary cache: the file is read with one stream read and loading a mesh copies its arrays out of that
+	buffer, with no parsing and no BVH build; the buffer is freed once the meshes are made. What is derived from them (the wide BVH, the SIMD
+	triangle blocks) is rebuilt on load, so the loaded meshes are TriangleMeshes like any other. That also means a snapshot is only
+	valid for the same build (same struct layouts and byte order), which the header checks, and for the same build parameters.
+	*/
+
+	constexpr char snapshot_magic[8] = { 'R', 'T', 'S', 'N', 'A', 'P', 'S', 'H' };
+	constexpr uint32_t snapshot_version = 2;	// bump this whenever the layout of anything in the file changes
+	constexpr uint32_t snapshot_byte_order_mark = 0x01020304;
+	constexpr uint64_t snapshot_alignment = 64;
+
+	struct SnapshotBuildParameters
+	// What the meshes were loaded and their BVHs built with. A snapshot written with other parameters is not used.
+	{
+		uint32_t dividing_method;	// AccelerationStructure::BVH::DividingMethod
+		float mesh_scale;			// see TriangleMesh::TriangleMesh()
+		uint32_t BVH_builder_version = AccelerationStructure::BVH::builder_version;
+	};
+
+	struct SnapshotHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t byte_order_mark;
+		uint32_t node_size;			// sizeof(AccelerationStructure::BVH_LinearNode) of the build that wrote the file
+		uint32_t mesh_record_size;	// sizeof(SnapshotMeshRecord) of the build that wrote the file
+		SnapshotBuildParameters build_parameters;
+		uint32_t material_count;
+		uint32_t mesh_count;
+		uint32_t padding;
+		uint64_t materials_offset;
+		uint64_t meshes_offset;
+		uint64_t file_size;
+	};
+
+	struct SnapshotMaterial
+	{
+		glm::vec3 emission;
+		glm::vec3 diffuse_coefficient;
+		glm::vec3 diffuse_color;
+		float refractive_index;
+		uint32_t material_nature;
+	};
+
+	struct SnapshotMeshRecord
+	{
+		uint32_t material_index;
+		int first_primitive_id;
+		uint32_t vertex_count;
+		uint32_t triangle_count;
+		uint32_t reference_count;	// of the BVH leaves to the triangles, more than triangle_count if spatial splits referred to a triangle more than once
+		uint32_t node_count;
+		uint64_t vertices_offset;
+		uint64_t texture_coordinates_offset;
+		uint64_t vertices_indices_offset;
+		uint64_t primitive_indices_offset;
+		uint64_t duplicate_references_offset;
+		uint64_t nodes_offset;
+		uint64_t node_mesh_areas_offset;
+	};
+
+	class SceneSnapshot
+	{
+	public:
+		static bool Write(const std::string& file_path, const std::vector<TriangleMesh*>& meshes, const SnapshotBuildParameters& build_parameters);
+		// Writes the meshes, their BVHs and the table of the materials they use. Returns false if the file could not be written.
+
+		SceneSnapshot(const std::string& file_path, const SnapshotBuildParameters& build_parameters);
+		// Reads the file and loads the meshes, IsValid() tells whether it is a sound snapshot written by this build with these build parameters.
+
+		bool IsValid() const
+		{
+			return m_valid;
+		}
+
+		std::vector<TriangleMesh*> GetMeshes() const;
+		// Owned by this SceneSnapshot, as are their materials.
+
+	private:
+		void load(const char* data, size_t size, const SnapshotBuildParameters& build_parameters);	// checks the snapshot at data and creates the meshes and materials
+
+		bool m_valid = false;
+		std::vector<std::unique_ptr<WhittedMaterial>> m_materials;
+		std::vector<std::unique_ptr<TriangleMesh>> m_meshes;
+	};
+}
+
+#endif // !SCENESNAPSHOT_H
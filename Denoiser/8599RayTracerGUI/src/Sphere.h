@@ -13,7 +13,7 @@
 
 namespace Whitted
 {
-	class Sphere : public Entity
+	class Sphere final : public TypedEntity<Sphere>
 	{
 	public:
 		Sphere(const glm::vec3& center, const float& radius, WhittedMaterial* _material = new WhittedMaterial{})
@@ -61,7 +61,46 @@ namespace Whitted
 
 		virtual IntersectionRecord GetIntersectionRecord(AccelerationStructure::Ray ray) override
 		{
-			IntersectionRecord record;		// default-initialized to "has_intersection = false"
+			Hit hit;
+			if (!get_nearest_root(ray, ray.t_max, hit.t))
+			{
+				return IntersectionRecord{};		// default-initialized to "has_intersection = false"
+			}
+			return GetSurfaceInteraction(ray, hit);
+		}
+
+		virtual bool GetClosestHit(const AccelerationStructure::Ray& ray, Hit& hit) override
+		{
+			if (!get_nearest_root(ray, ray.t_max, hit.t))
+			{
+				return false;
+			}
+			hit.primitive_index = 0;
+			return true;
+		}
+
+		virtual IntersectionRecord GetSurfaceInteraction(const AccelerationStructure::Ray& ray, const Hit& hit) override
+		{
+			IntersectionRecord record;
+			record.has_intersection = true;
+			record.t = hit.t;
+			record.hitted_entity = this;
+			record.location = ray(hit.t);
+			record.hitted_entity_material = material;
+			record.surface_normal = Whitted::normalize(record.location - m_center);
+			return record;
+		}
+
+		virtual bool IntersectsWithin(AccelerationStructure::Ray ray, double maximum_t) override
+		{
+			float t;
+			return get_nearest_root(ray, maximum_t, t);
+		}
+
+	private:
+		bool get_nearest_root(const AccelerationStructure::Ray& ray, double t_max, float& t) const
+		// The nearest t in [ray.t_min, t_max) at which the ray crosses the sphere, if any.
+		{
 			float t_small;
 			float t_large;
 			glm::vec3 center_to_light_origin = ray.m_origin - m_center;
@@ -74,29 +113,21 @@ namespace Whitted
 				t_large)
 				)
 			{
-				return record;
+				return false;
 			}
 
-			if (t_small < 0.0f)
+			if (t_small < ray.t_min)
 			{
 				t_small = t_large;
 			}
-			if (t_small < 0.0f)
+			if ((t_small < ray.t_min) || (t_small >= t_max))
 			{
-				return record;
+				return false;
 			}
-
-			record.has_intersection = true;
-			record.t = t_small;
-			record.hitted_entity = this;
-			record.location = ray(t_small);
-			record.hitted_entity_material = material;
-			record.surface_normal = Whitted::normalize(record.location - m_center);
-
-			return record;
+			t = t_small;
+			return true;
 		}
 
-	private:
 		float surface_area;
 		WhittedMaterial* material;
 		glm::vec3 m_center;
@@ -0,0 +1,388 @@
+/*****************************************************************//**
+ * \file   TileScheduler.h
+ * \brief  A persistent pool of threads that works through a frame tile by tile, with work stealing
+ *
+ * \author Xiaoyang Liu
+ * \date   October 2026
+ *********************************************************************/
+
+#ifndef TILESCHEDULER_H
+#define TILESCHEDULER_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "NUMATopology.h"
+
+namespace Scheduling
+{
+	struct Tile
+	{
+		uint32_t x;		// the top left pixel
+		uint32_t y;
+		uint32_t width;		// smaller than the tile size at the right and bottom edges of the frame
+		uint32_t height;
+	};
+
+	class TileScheduler
+	/*
+	The threads are started once and wait between the passes, so a frame costs no thread creation, and a pass costs one wake-up per thread
+	rather than one scheduling decision per pixel. The calling thread works through its share of the tiles as well.
+
+	The tiles of a frame are ordered along a Hilbert curve, and each thread gets a contiguous run of them, so the pixels one thread shades
+	(and the scene data their rays touch) stay close together. Each run is a deque: its thread takes tiles from the front, and a thread
+	that has run out steals the back half of the run of another thread, which is again a compact region of the frame.
+
+	NUMA-aware, the threads are split into one group per NUMA node (see NUMATopology) and pinned to its processors, and the calling thread
+	only waits, since it may run anywhere. The threads of a node have consecutive indices, so the node gets one contiguous stretch of the
+	curve, and its threads steal from each other before they steal from another node. GetNodeIndexOfThisThread() tells the work on a
+	thread which node it runs on, e.g. to read the copy of the scene in the memory of that node.
+	*/
+	{
+	public:
+
+		TileScheduler(int thread_count = 0, uint32_t tile_size = 32, bool NUMA_aware = false)	// thread_count 0: one thread per hardware thread
+		{
+			Configure(thread_count, tile_size, NUMA_aware);
+		}
+
+		~TileScheduler()
+		{
+			stop_threads();
+		}
+
+		TileScheduler(const TileScheduler&) = delete;
+		TileScheduler& operator=(const TileScheduler&) = delete;
+
+		void Configure(int thread_count, uint32_t tile_size, bool NUMA_aware = false)
+		// Cheap if nothing changes, so it can be called every frame.
+		{
+			if (thread_count <= 0)
+			{
+				thread_count = std::max(1, (int)std::thread::hardware_concurrency());
+			}
+			tile_size = std::max(tile_size, 1u);
+			if ((thread_count != m_thread_count) || (NUMA_aware != m_NUMA_aware))
+			{
+				stop_threads();
+				m_thread_count = thread_count;
+				m_NUMA_aware = NUMA_aware;
+				m_tile_runs = std::make_unique<TileRun[]>(m_thread_count);
+				assign_threads_to_nodes();
+				start_threads();
+			}
+			if (tile_size != m_tile_size)
+			{
+				m_tile_size = tile_size;
+				order_tiles();
+			}
+		}
+
+		void Resize(uint32_t width, uint32_t height)
+		{
+			if ((width != m_width) || (height != m_height))
+			{
+				m_width = width;
+				m_height = height;
+				order_tiles();
+			}
+		}
+
+		int GetThreadCount() const
+		{
+			return m_thread_count;
+		}
+
+		uint32_t GetTileSize() const
+		{
+			return m_tile_size;
+		}
+
+		bool IsNUMAAware() const
+		{
+			return m_NUMA_aware;
+		}
+
+		int GetNodeCount() const
+		// The nodes the threads are spread over (1 unless NUMA-aware).
+		{
+			return m_node_count;
+		}
+
+		static int GetNodeIndexOfThisThread()
+		// 0 on any thread but the ones of a NUMA-aware scheduler.
+		{
+			return s_node_index_of_this_thread;
+		}
+
+		void ForEachTile(const std::function<void(const Tile&)>& shade_tile)
+		// Calls shade_tile once for every tile of the frame, on any of the threads, and returns once all the tiles are done.
+		{
+			if (m_tiles.empty())
+			{
+				return;
+			}
+			int tile_count = (int)m_tiles.size();
+			for (int thread_index = 0; thread_index < m_thread_count; thread_index++)
+			{
+				m_tile_runs[thread_index].first_tile_index = (int)((int64_t)tile_count * thread_index / m_thread_count);
+				m_tile_runs[thread_index].last_tile_index = (int)((int64_t)tile_count * (thread_index + 1) / m_thread_count);
+			}
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_shade_tile = &shade_tile;
+				m_pass_index++;
+				m_busy_thread_count = m_thread_count - caller_thread_count();
+			}
+			m_pass_started.notify_all();
+
+			if (caller_thread_count() == 1)
+			{
+				work_through_tiles(0, shade_tile);
+			}
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_pass_finished.wait(lock, [this] { return m_busy_thread_count == 0; });
+			m_shade_tile = nullptr;
+		}
+
+		template <typename ShadePixel>
+		void ForEachPixel(ShadePixel&& shade_pixel)
+		// shade_pixel(x, y) for every pixel of the frame, a tile at a time.
+		{
+			ForEachTile(
+				[&shade_pixel](const Tile& tile)
+				{
+					for (uint32_t y = tile.y; y < tile.y + tile.height; y++)
+					{
+						for (uint32_t x = tile.x; x < tile.x + tile.width; x++)
+						{
+							shade_pixel(x, y);
+						}
+					}
+				}
+			);
+		}
+
+	private:
+
+		struct alignas(64) TileRun		// one per thread, on its own cache line
+		// The tiles m_tiles[first_tile_index, last_tile_index) still to be taken.
+		{
+			std::mutex mutex;
+			int first_tile_index = 0;
+			int last_tile_index = 0;
+		};
+
+		bool take_tile(int thread_index, int& tile_index)
+		{
+			TileRun& own_run = m_tile_runs[thread_index];
+			{
+				std::lock_guard<std::mutex> lock(own_run.mutex);
+				if (own_run.first_tile_index < own_run.last_tile_index)
+				{
+					tile_index = own_run.first_tile_index++;
+					return true;
+				}
+			}
+			for (int victim_index : m_steal_orders[thread_index])		// case: steal
+			{
+				TileRun& victim_run = m_tile_runs[victim_index];
+				std::scoped_lock lock(own_run.mutex, victim_run.mutex);		// locks both without deadlocking against a thread stealing the other way
+				int remaining_tile_count = victim_run.last_tile_index - victim_run.first_tile_index;
+				if (remaining_tile_count > 0)
+				{
+					int stolen_tile_count = (remaining_tile_count + 1) / 2;
+					own_run.first_tile_index = victim_run.last_tile_index - stolen_tile_count;
+					own_run.last_tile_index = victim_run.last_tile_index;
+					victim_run.last_tile_index = own_run.first_tile_index;
+					tile_index = own_run.first_tile_index++;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void work_through_tiles(int thread_index, const std::function<void(const Tile&)>& shade_tile)
+		{
+			int tile_index;
+			while (take_tile(thread_index, tile_index))
+			{
+				shade_tile(m_tiles[tile_index]);
+			}
+		}
+
+		int caller_thread_count() const
+		{
+			return m_NUMA_aware ? 0 : 1;
+		}
+
+		void assign_threads_to_nodes()
+		// Consecutive threads share a node. Each thread steals from the threads of its own node first, the nearest ones first.
+		{
+			m_node_count = m_NUMA_aware ? std::min(NUMATopology::Get().GetNodeCount(), m_thread_count) : 1;
+			m_thread_node_indices.resize(m_thread_count);
+			for (int thread_index = 0; thread_index < m_thread_count; thread_index++)
+			{
+				m_thread_node_indices[thread_index] = (int)((int64_t)thread_index * m_node_count / m_thread_count);
+			}
+			m_steal_orders.assign(m_thread_count, {});
+			for (int thread_index = 0; thread_index < m_thread_count; thread_index++)
+			{
+				for (bool same_node : { true, false })
+				{
+					for (int offset = 1; offset < m_thread_count; offset++)
+					{
+						int victim_index = (thread_index + offset) % m_thread_count;
+						if ((m_thread_node_indices[victim_index] == m_thread_node_indices[thread_index]) == same_node)
+						{
+							m_steal_orders[thread_index].push_back(victim_index);
+						}
+					}
+				}
+			}
+		}
+
+		void start_threads()
+		// Unless NUMA-aware, the calling thread is thread 0 and the pool has the other m_thread_count - 1.
+		{
+			m_stopping = false;
+			for (int thread_index = caller_thread_count(); thread_index < m_thread_count; thread_index++)
+			{
+				m_threads.emplace_back(
+					[this, thread_index, pass_index = m_pass_index]() mutable
+					{
+						if (m_NUMA_aware)
+						{
+							NUMATopology::Get().PinThisThreadToNode(m_thread_node_indices[thread_index]);
+							s_node_index_of_this_thread = m_thread_node_indices[thread_index];
+						}
+						while (true)
+						{
+							const std::function<void(const Tile&)>* shade_tile;
+							{
+								std::unique_lock<std::mutex> lock(m_mutex);
+								m_pass_started.wait(lock, [&] { return m_stopping || (m_pass_index != pass_index); });
+								if (m_stopping)
+								{
+									return;
+								}
+								pass_index = m_pass_index;
+								shade_tile = m_shade_tile;
+							}
+							work_through_tiles(thread_index, *shade_tile);
+							std::lock_guard<std::mutex> lock(m_mutex);
+							if (--m_busy_thread_count == 0)
+							{
+								m_pass_finished.notify_one();
+							}
+						}
+					}
+				);
+			}
+		}
+
+		void stop_threads()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stopping = true;
+			}
+			m_pass_started.notify_all();
+			for (std::thread& thread : m_threads)
+			{
+				thread.join();
+			}
+			m_threads.clear();
+		}
+
+		static uint32_t Hilbert_index_of(uint32_t n, uint32_t x, uint32_t y)
+		// The position of cell (x, y) along the Hilbert curve through an n x n grid, n a power of two
+		// (see https://en.wikipedia.org/wiki/Hilbert_curve#Applications_and_mapping_algorithms).
+		{
+			uint32_t index = 0;
+			for (uint32_t s = n / 2; s > 0; s /= 2)
+			{
+				uint32_t rx = (x & s) > 0;
+				uint32_t ry = (y & s) > 0;
+				index += s * s * ((3 * rx) ^ ry);
+				if (ry == 0)	// rotate the quadrant, so that the curve through it connects to the neighbouring quadrants
+				{
+					if (rx == 1)
+					{
+						x = n - 1 - x;
+						y = n - 1 - y;
+					}
+					std::swap(x, y);
+				}
+			}
+			return index;
+		}
+
+		void order_tiles()
+		{
+			m_tiles.clear();
+			uint32_t tile_column_count = (m_width + m_tile_size - 1) / m_tile_size;
+			uint32_t tile_row_count = (m_height + m_tile_size - 1) / m_tile_size;
+			uint32_t n = 1;
+			while ((n < tile_column_count) || (n < tile_row_count))
+			{
+				n *= 2;
+			}
+
+			std::vector<std::pair<uint32_t, Tile>> tiles_along_curve;
+			for (uint32_t tile_row = 0; tile_row < tile_row_count; tile_row++)
+			{
+				for (uint32_t tile_column = 0; tile_column < tile_column_count; tile_column++)
+				{
+					uint32_t x = tile_column * m_tile_size;
+					uint32_t y = tile_row * m_tile_size;
+					tiles_along_curve.emplace_back(Hilbert_index_of(n, tile_column, tile_row), Tile{ x, y, std::min(m_tile_size, m_width - x), std::min(m_tile_size, m_height - y) });
+				}
+			}
+			std::sort(tiles_along_curve.begin(), tiles_along_curve.end(),
+				[](const std::pair<uint32_t, Tile>& a, const std::pair<uint32_t, Tile>& b)
+				{
+					return a.first < b.first;
+				}
+			);
+			for (const auto& [Hilbert_index, tile] : tiles_along_curve)
+			{
+				m_tiles.push_back(tile);
+			}
+		}
+
+	private:
+
+		int m_thread_count = 0;
+		bool m_NUMA_aware = false;
+		int m_node_count = 1;
+		std::vector<int> m_thread_node_indices;		// per thread
+		std::vector<std::vector<int>> m_steal_orders;	// per thread: the threads to steal from, in order
+		uint32_t m_tile_size = 0;
+		uint32_t m_width = 0;
+		uint32_t m_height = 0;
+		std::vector<Tile> m_tiles;		// along the Hilbert curve
+		std::unique_ptr<TileRun[]> m_tile_runs;		// one per thread
+
+		std::vector<std::thread> m_threads;
+		std::mutex m_mutex;		// guards the members below
+		std::condition_variable m_pass_started;
+		std::condition_variable m_pass_finished;
+		const std::function<void(const Tile&)>* m_shade_tile = nullptr;
+		uint64_t m_pass_index = 0;
+		int m_busy_thread_count = 0;
+		bool m_stopping = false;
+
+		static inline thread_local int s_node_index_of_this_thread = 0;
+	};
+}
+
+#endif // !TILESCHEDULER_H
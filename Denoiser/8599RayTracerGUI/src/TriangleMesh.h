@@ -10,6 +10,7 @@
 #define TRIANGLEMESH_H
 
 #include <cassert>
+#include <map>
 
 #include "OBJ_Loader.h"
 #include "BVH.h"
@@ -22,7 +23,8 @@ namespace Whitted
 		const glm::vec3& vertice_3,
 		const glm::vec3& ray_origin,
 		const glm::vec3& ray_direction,
-		double& t_intersection
+		double& t_intersection,
+		glm::vec2& barycentric_coordinates		// of vertice_2 and vertice_3
 		)
 	// implemented using Moller-Trumbore algorithm (TODO: get a pen and a paper to derive the math behind this algorithm!!!)
 	{
@@ -38,13 +40,253 @@ namespace Whitted
 		double barycentric_coordinate_2 = glm::dot(S_1, S) * inverse_denominator;
 		double barycentric_coordinate_3 = glm::dot(S_2, ray_direction) * inverse_denominator;
 		// Note: barycentric_coordinate_1 = 1 - barycentric_coordinate_2 - barycentric_coordinate_3
+		barycentric_coordinates = glm::vec2{ (float)barycentric_coordinate_2, (float)barycentric_coordinate_3 };
 		return ((t_intersection > 0.0) && 
 			(barycentric_coordinate_2 > 0.0) && 
 			(barycentric_coordinate_3 > 0.0) && 
 			((1.0 - barycentric_coordinate_2 - barycentric_coordinate_3) > 0.0));	// TODO: add epsilon to account for floating point precision error?
 	}
 
-	class TrianglePrimitive : public Entity
+	inline bool RayTriangleIntersection(
+		const glm::vec3& vertice_1,
+		const glm::vec3& vertice_2,
+		const glm::vec3& vertice_3,
+		const glm::vec3& ray_origin,
+		const glm::vec3& ray_direction,
+		double& t_intersection
+	)
+	{
+		glm::vec2 barycentric_coordinates;
+		return RayTriangleIntersection(vertice_1, vertice_2, vertice_3, ray_origin, ray_direction, t_intersection, barycentric_coordinates);
+	}
+
+	template <int Width>
+	class TriangleBlock_SoA
+	// Up to Width triangles of a BVH leaf stored as structure-of-arrays, with their edges and (unnormalized) normals precomputed,
+	// so that one ray can be tested against all of them with one SIMD Moller-Trumbore test in float arithmetic only.
+	// Compared with RayTriangleIntersection (float products, divided in double), t differs by at most 1e-4 of the larger of t and the
+	// distance from the ray origin to the first vertex (both are within 1e-5 of that distance of the exact value, it's the float
+	// products that differ), and a hit can only turn into a miss (or vice versa) for a ray passing within that tolerance of an edge.
+	{
+	public:
+		static_assert(Width == 4 || Width == 8, "a SIMD register holds 4 (SSE) or 8 (AVX) floats");
+
+		TriangleBlock_SoA()		// Width empty lanes
+		{
+			for (int lane = 0; lane < Width; lane++)
+			{
+				set(lane, -1, glm::vec3{ 0.0f }, glm::vec3{ 0.0f }, glm::vec3{ 0.0f });
+			}
+		}
+
+		void set(int lane, int index, const glm::vec3& vertice_1, const glm::vec3& vertice_2, const glm::vec3& vertice_3)
+		{
+			glm::vec3 E_1 = vertice_2 - vertice_1;
+			glm::vec3 E_2 = vertice_3 - vertice_1;
+			glm::vec3 N = glm::cross(E_1, E_2);
+			vertice_x[lane] = vertice_1.x;
+			vertice_y[lane] = vertice_1.y;
+			vertice_z[lane] = vertice_1.z;
+			edge_1_x[lane] = E_1.x;
+			edge_1_y[lane] = E_1.y;
+			edge_1_z[lane] = E_1.z;
+			edge_2_x[lane] = E_2.x;
+			edge_2_y[lane] = E_2.y;
+			edge_2_z[lane] = E_2.z;
+			normal_x[lane] = N.x;
+			normal_y[lane] = N.y;
+			normal_z[lane] = N.z;
+			triangle_index[lane] = index;
+		}
+
+		struct Intersections
+		{
+			std::array<float, Width> t;
+			std::array<float, Width> barycentric_coordinate_2;	// see RayTriangleIntersection
+			std::array<float, Width> barycentric_coordinate_3;
+		};
+
+		int intersects_with_ray(const AccelerationStructure::Ray& ray, int lane_mask, float t_min, float t_max, Intersections& intersections) const
+		// Returns a bit mask with bit i set if triangle i (one of the lanes in lane_mask) is hit with t in [t_min, t_max), and writes t and the barycentric coordinates of every lane.
+		{
+			/*
+			The Moller-Trumbore terms rewritten around the precomputed normal N = E_1 x E_2, with S = origin - vertice_1 and C = S x direction:
+			the denominator S_1 . E_1 = -direction . N, t = S . N / denominator, and the barycentric coordinates are E_2 . C and -E_1 . C over the denominator.
+			That is one cross product per triangle instead of two.
+			*/
+
+#if defined(BOUNDINGVOLUME_HAS_AVX)
+			if constexpr (Width == 8)
+			{
+				__m256 direction_x = _mm256_set1_ps(ray.m_direction.x);
+				__m256 direction_y = _mm256_set1_ps(ray.m_direction.y);
+				__m256 direction_z = _mm256_set1_ps(ray.m_direction.z);
+				__m256 S_x = _mm256_sub_ps(_mm256_set1_ps(ray.m_origin.x), _mm256_load_ps(vertice_x.data()));
+				__m256 S_y = _mm256_sub_ps(_mm256_set1_ps(ray.m_origin.y), _mm256_load_ps(vertice_y.data()));
+				__m256 S_z = _mm256_sub_ps(_mm256_set1_ps(ray.m_origin.z), _mm256_load_ps(vertice_z.data()));
+				__m256 N_x = _mm256_load_ps(normal_x.data());
+				__m256 N_y = _mm256_load_ps(normal_y.data());
+				__m256 N_z = _mm256_load_ps(normal_z.data());
+				__m256 C_x = _mm256_sub_ps(_mm256_mul_ps(S_y, direction_z), _mm256_mul_ps(S_z, direction_y));
+				__m256 C_y = _mm256_sub_ps(_mm256_mul_ps(S_z, direction_x), _mm256_mul_ps(S_x, direction_z));
+				__m256 C_z = _mm256_sub_ps(_mm256_mul_ps(S_x, direction_y), _mm256_mul_ps(S_y, direction_x));
+
+				__m256 denominator = _mm256_sub_ps(_mm256_setzero_ps(),
+					_mm256_add_ps(_mm256_mul_ps(direction_x, N_x), _mm256_add_ps(_mm256_mul_ps(direction_y, N_y), _mm256_mul_ps(direction_z, N_z))));
+				__m256 inverse_denominator = _mm256_div_ps(_mm256_set1_ps(1.0f), denominator);	// a parallel triangle gives inf, and the NaNs below fail every test
+				__m256 t = _mm256_mul_ps(inverse_denominator,
+					_mm256_add_ps(_mm256_mul_ps(S_x, N_x), _mm256_add_ps(_mm256_mul_ps(S_y, N_y), _mm256_mul_ps(S_z, N_z))));
+				__m256 barycentric_coordinate_2 = _mm256_mul_ps(inverse_denominator,
+					_mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(edge_2_x.data()), C_x), _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(edge_2_y.data()), C_y), _mm256_mul_ps(_mm256_load_ps(edge_2_z.data()), C_z))));
+				__m256 barycentric_coordinate_3 = _mm256_mul_ps(_mm256_sub_ps(_mm256_setzero_ps(), inverse_denominator),
+					_mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(edge_1_x.data()), C_x), _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(edge_1_y.data()), C_y), _mm256_mul_ps(_mm256_load_ps(edge_1_z.data()), C_z))));
+
+				__m256 zero = _mm256_setzero_ps();
+				__m256 hit = _mm256_and_ps(
+					_mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ), _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(t_min), _CMP_GE_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_LT_OQ))),
+					_mm256_and_ps(
+						_mm256_and_ps(_mm256_cmp_ps(barycentric_coordinate_2, zero, _CMP_GT_OQ), _mm256_cmp_ps(barycentric_coordinate_3, zero, _CMP_GT_OQ)),
+						_mm256_cmp_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), barycentric_coordinate_2), barycentric_coordinate_3), zero, _CMP_GT_OQ)));
+				_mm256_storeu_ps(intersections.t.data(), t);
+				_mm256_storeu_ps(intersections.barycentric_coordinate_2.data(), barycentric_coordinate_2);
+				_mm256_storeu_ps(intersections.barycentric_coordinate_3.data(), barycentric_coordinate_3);
+				return _mm256_movemask_ps(hit) & lane_mask;
+			}
+#endif
+#if defined(BOUNDINGVOLUME_HAS_SSE)
+			if constexpr (Width == 4)
+			{
+				__m128 direction_x = _mm_set1_ps(ray.m_direction.x);
+				__m128 direction_y = _mm_set1_ps(ray.m_direction.y);
+				__m128 direction_z = _mm_set1_ps(ray.m_direction.z);
+				__m128 S_x = _mm_sub_ps(_mm_set1_ps(ray.m_origin.x), _mm_load_ps(vertice_x.data()));
+				__m128 S_y = _mm_sub_ps(_mm_set1_ps(ray.m_origin.y), _mm_load_ps(vertice_y.data()));
+				__m128 S_z = _mm_sub_ps(_mm_set1_ps(ray.m_origin.z), _mm_load_ps(vertice_z.data()));
+				__m128 N_x = _mm_load_ps(normal_x.data());
+				__m128 N_y = _mm_load_ps(normal_y.data());
+				__m128 N_z = _mm_load_ps(normal_z.data());
+				__m128 C_x = _mm_sub_ps(_mm_mul_ps(S_y, direction_z), _mm_mul_ps(S_z, direction_y));
+				__m128 C_y = _mm_sub_ps(_mm_mul_ps(S_z, direction_x), _mm_mul_ps(S_x, direction_z));
+				__m128 C_z = _mm_sub_ps(_mm_mul_ps(S_x, direction_y), _mm_mul_ps(S_y, direction_x));
+
+				__m128 denominator = _mm_sub_ps(_mm_setzero_ps(),
+					_mm_add_ps(_mm_mul_ps(direction_x, N_x), _mm_add_ps(_mm_mul_ps(direction_y, N_y), _mm_mul_ps(direction_z, N_z))));
+				__m128 inverse_denominator = _mm_div_ps(_mm_set1_ps(1.0f), denominator);
+				__m128 t = _mm_mul_ps(inverse_denominator,
+					_mm_add_ps(_mm_mul_ps(S_x, N_x), _mm_add_ps(_mm_mul_ps(S_y, N_y), _mm_mul_ps(S_z, N_z))));
+				__m128 barycentric_coordinate_2 = _mm_mul_ps(inverse_denominator,
+					_mm_add_ps(_mm_mul_ps(_mm_load_ps(edge_2_x.data()), C_x), _mm_add_ps(_mm_mul_ps(_mm_load_ps(edge_2_y.data()), C_y), _mm_mul_ps(_mm_load_ps(edge_2_z.data()), C_z))));
+				__m128 barycentric_coordinate_3 = _mm_mul_ps(_mm_sub_ps(_mm_setzero_ps(), inverse_denominator),
+					_mm_add_ps(_mm_mul_ps(_mm_load_ps(edge_1_x.data()), C_x), _mm_add_ps(_mm_mul_ps(_mm_load_ps(edge_1_y.data()), C_y), _mm_mul_ps(_mm_load_ps(edge_1_z.data()), C_z))));
+
+				__m128 zero = _mm_setzero_ps();
+				__m128 hit = _mm_and_ps(
+					_mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_and_ps(_mm_cmpge_ps(t, _mm_set1_ps(t_min)), _mm_cmplt_ps(t, _mm_set1_ps(t_max)))),
+					_mm_and_ps(
+						_mm_and_ps(_mm_cmpgt_ps(barycentric_coordinate_2, zero), _mm_cmpgt_ps(barycentric_coordinate_3, zero)),
+						_mm_cmpgt_ps(_mm_sub_ps(_mm_sub_ps(_mm_set1_ps(1.0f), barycentric_coordinate_2), barycentric_coordinate_3), zero)));
+				_mm_storeu_ps(intersections.t.data(), t);
+				_mm_storeu_ps(intersections.barycentric_coordinate_2.data(), barycentric_coordinate_2);
+				_mm_storeu_ps(intersections.barycentric_coordinate_3.data(), barycentric_coordinate_3);
+				return _mm_movemask_ps(hit) & lane_mask;
+			}
+#endif
+			// scalar fallback (e.g. 8 triangles without AVX), the same arithmetic lane by lane:
+			int hit_mask = 0;
+			for (int lane = 0; lane < Width; lane++)
+			{
+				if (!(lane_mask & (1 << lane)))
+				{
+					continue;
+				}
+				glm::vec3 S = ray.m_origin - glm::vec3{ vertice_x[lane], vertice_y[lane], vertice_z[lane] };
+				glm::vec3 N{ normal_x[lane], normal_y[lane], normal_z[lane] };
+				glm::vec3 C = glm::cross(S, ray.m_direction);
+				float inverse_denominator = 1.0f / (-glm::dot(ray.m_direction, N));
+				float t = glm::dot(S, N) * inverse_denominator;
+				float barycentric_coordinate_2 = glm::dot(glm::vec3{ edge_2_x[lane], edge_2_y[lane], edge_2_z[lane] }, C) * inverse_denominator;
+				float barycentric_coordinate_3 = -glm::dot(glm::vec3{ edge_1_x[lane], edge_1_y[lane], edge_1_z[lane] }, C) * inverse_denominator;
+				intersections.t[lane] = t;
+				intersections.barycentric_coordinate_2[lane] = barycentric_coordinate_2;
+				intersections.barycentric_coordinate_3[lane] = barycentric_coordinate_3;
+				if ((t > 0.0f) && (t >= t_min) && (t < t_max) &&
+					(barycentric_coordinate_2 > 0.0f) && (barycentric_coordinate_3 > 0.0f) && ((1.0f - barycentric_coordinate_2 - barycentric_coordinate_3) > 0.0f))
+				{
+					hit_mask |= (1 << lane);
+				}
+			}
+			return hit_mask;
+		}
+
+	public:		// Data members (aligned for the SIMD loads):
+		alignas(sizeof(float) * Width) std::array<float, Width> vertice_x;
+		alignas(sizeof(float) * Width) std::array<float, Width> vertice_y;
+		alignas(sizeof(float) * Width) std::array<float, Width> vertice_z;
+		alignas(sizeof(float) * Width) std::array<float, Width> edge_1_x;
+		alignas(sizeof(float) * Width) std::array<float, Width> edge_1_y;
+		alignas(sizeof(float) * Width) std::array<float, Width> edge_1_z;
+		alignas(sizeof(float) * Width) std::array<float, Width> edge_2_x;
+		alignas(sizeof(float) * Width) std::array<float, Width> edge_2_y;
+		alignas(sizeof(float) * Width) std::array<float, Width> edge_2_z;
+		alignas(sizeof(float) * Width) std::array<float, Width> normal_x;
+		alignas(sizeof(float) * Width) std::array<float, Width> normal_y;
+		alignas(sizeof(float) * Width) std::array<float, Width> normal_z;
+		std::array<int, Width> triangle_index;	// -1: empty lane
+	};
+
+	inline AccelerationStructure::AABB_3D ClippedTriangleAABB(
+		const glm::vec3& vertice_1,
+		const glm::vec3& vertice_2,
+		const glm::vec3& vertice_3,
+		const AccelerationStructure::AABB_3D& box
+	)
+	// The bounding volume of the part of the triangle inside the box: clip the triangle against the six slabs of the box
+	// one by one (Sutherland-Hodgman), every slab adds at most one vertex to the polygon.
+	{
+		constexpr int maximum_vertex_count = 3 + 6;
+		std::array<glm::vec3, maximum_vertex_count> polygon{ vertice_1, vertice_2, vertice_3 };
+		std::array<glm::vec3, maximum_vertex_count> clipped_polygon;
+		int vertex_count = 3;
+
+		for (int plane = 0; (plane < 6) && (vertex_count > 0); plane++)
+		{
+			int axis = plane % 3;
+			bool keep_above = (plane < 3);		// the first three planes are the min slabs, the other three are the max slabs
+			float plane_value = box[keep_above ? 0 : 1][axis];
+			auto is_inside = [&](const glm::vec3& point)
+			{
+				return keep_above ? (point[axis] >= plane_value) : (point[axis] <= plane_value);
+			};
+
+			int clipped_vertex_count = 0;
+			for (int i = 0; i < vertex_count; i++)
+			{
+				const glm::vec3& from = polygon[i];
+				const glm::vec3& to = polygon[(i + 1) % vertex_count];
+				if (is_inside(from))
+				{
+					clipped_polygon[clipped_vertex_count++] = from;
+				}
+				if (is_inside(from) != is_inside(to))	// the edge crosses the plane
+				{
+					glm::vec3 crossing = from + (to - from) * ((plane_value - from[axis]) / (to[axis] - from[axis]));
+					crossing[axis] = plane_value;	// exactly on the plane despite the rounding above
+					clipped_polygon[clipped_vertex_count++] = crossing;
+				}
+			}
+			polygon = clipped_polygon;
+			vertex_count = clipped_vertex_count;
+		}
+
+		AccelerationStructure::AABB_3D clipped_AABB;	// contains nothing
+		for (int i = 0; i < vertex_count; i++)
+		{
+			clipped_AABB = clipped_AABB.Union_with_point(polygon[i]);
+		}
+		return clipped_AABB;
+	}
+
+	class TrianglePrimitive final : public TypedEntity<TrianglePrimitive>
 	/*
 	Assumptions:
 	The vertices are declared in anti-clockwise order.
@@ -101,6 +343,11 @@ namespace Whitted
 			return (AccelerationStructure::AABB_3D{vertice_a, vertice_b}).Union_with_point(vertice_c);
 		}
 
+		virtual AccelerationStructure::AABB_3D GetClippedAABB(const AccelerationStructure::AABB_3D& box) override
+		{
+			return ClippedTriangleAABB(vertice_a, vertice_b, vertice_c, box);
+		}
+
 		virtual glm::vec3 GetDiffuseColor(const glm::vec2&) const override
 		{
 			return glm::vec3{0.5f, 0.5f, 0.5f};		// TODO: whenever possible, use material information instead?
@@ -137,6 +384,50 @@ namespace Whitted
 			return record;
 		}
 
+		virtual bool GetClosestHit(const AccelerationStructure::Ray& ray, Hit& hit) override
+		{
+			double t;
+			glm::vec2 barycentric_coordinates;
+			if (RayTriangleIntersection(vertice_a, vertice_b, vertice_c, ray.m_origin, ray.m_direction, t, barycentric_coordinates) && (t >= ray.t_min) && ((float)t < ray.t_max))
+			{
+				hit.t = (float)t;
+				hit.primitive_index = 0;
+				hit.barycentric_coordinates = barycentric_coordinates;
+				return true;
+			}
+			return false;
+		}
+
+		virtual IntersectionRecord GetSurfaceInteraction(const AccelerationStructure::Ray& ray, const Hit& hit) override
+		{
+			IntersectionRecord record;
+			record.has_intersection = true;
+			record.t = hit.t;
+			record.hitted_entity_material = material;
+			record.hitted_entity = this;
+			record.surface_normal = m_surface_normal;
+			record.location = ray(record.t);
+			record.primitive_id = this->id;
+			return record;
+		}
+
+		virtual bool IntersectsWithin(AccelerationStructure::Ray ray, double maximum_t) override
+		{
+			double t;
+			return RayTriangleIntersection(vertice_a, vertice_b, vertice_c, ray.m_origin, ray.m_direction, t) && (t >= ray.t_min) && (t < maximum_t);
+		}
+
+		void SetVertices(const glm::vec3& _vertice_a, const glm::vec3& _vertice_b, const glm::vec3& _vertice_c)
+		// Move the triangle (e.g. for a deforming mesh), the BVH that contains it has to be refitted or rebuilt afterwards.
+		{
+			vertice_a = _vertice_a;
+			vertice_b = _vertice_b;
+			vertice_c = _vertice_c;
+			glm::vec3 cross_product = glm::cross(vertice_b - vertice_a, vertice_c - vertice_a);
+			area = 0.5f * glm::length(cross_product);
+			m_surface_normal = Whitted::normalize(cross_product);
+		}
+
 	public:		// Data members:
 		float area;
 		glm::vec3 vertice_a;
@@ -146,15 +437,25 @@ namespace Whitted
 		WhittedMaterial* material;
 	};
 
-	class TriangleMesh : public Entity
+	class TriangleMesh final : public TypedEntity<TriangleMesh>, private AccelerationStructure::BVH_PrimitiveSet
+	/*
+	The triangles are stored as indices into shared vertex buffers (three per triangle, in the order of the OBJ file), and the BVH
+	of the mesh refers to them by their index. The leaves are tested right here, so a ray query never goes through an Entity per triangle.
+	Assumptions:
+	The vertices of every triangle are declared in anti-clockwise order.
+	*/
 	{
 	public:
-		TriangleMesh(int& id_count, const std::string& file_path, WhittedMaterial* m)
+		TriangleMesh(
+			int& id_count, 
+			const std::string& file_path, 
+			WhittedMaterial* m, 
+			AccelerationStructure::BVH::DividingMethod dividing_method = AccelerationStructure::BVH::DividingMethod::Surface_Area_Heuristic,
+			float mesh_scale = 1.0f		// baked into the vertices, 1 keeps the OBJ coordinates (the Renderer scales and places the meshes with MeshInstances)
+		)
 		{
-			constexpr float mesh_scale = 0.01f;
-
 			unified_material = m;
-			total_area = 0.0f;
+			first_primitive_id = id_count;
 
 			objl::Loader Robert_Smith_Loader;
 			Robert_Smith_Loader.LoadFile(file_path);
@@ -162,31 +463,89 @@ namespace Whitted
 			assert(Robert_Smith_Loader.LoadedMeshes.size() == 1);
 
 			objl::Mesh loaded_mesh = Robert_Smith_Loader.LoadedMeshes[0];
-			
-			glm::vec3 mesh_range_min = glm::vec3{ std::numeric_limits<float>::infinity(),std::numeric_limits<float>::infinity(),std::numeric_limits<float>::infinity() };
-			glm::vec3 mesh_range_max = glm::vec3{ -std::numeric_limits<float>::infinity(),-std::numeric_limits<float>::infinity(),-std::numeric_limits<float>::infinity() };
 
-			for (int i = 0; i < loaded_mesh.Vertices.size(); i += 3)	// one loop for each triangle
+			// The loader repeats the vertices of every face, so merge the ones with the same position and texture coordinates:
+			std::map<std::array<float, 5>, uint32_t> vertex_indices;
+			std::vector<glm::vec3> vertices;
+			std::vector<glm::vec2> texture_coordinates;
+			m_triangle_count = (int)loaded_mesh.Indices.size() / 3;
+			m_vertices_indices = std::make_unique<uint32_t[]>(m_triangle_count * 3);
+			for (int i = 0; i < m_triangle_count * 3; i++)
 			{
-				std::array<glm::vec3, 3> current_triangle;
-				for (int j = 0; j < 3; j++)
+				const objl::Vertex& loaded_vertex = loaded_mesh.Vertices[loaded_mesh.Indices[i]];
+				glm::vec3 scaled_vertice = mesh_scale * glm::vec3{ loaded_vertex.Position.X, loaded_vertex.Position.Y, loaded_vertex.Position.Z };
+				glm::vec2 vertice_texture_coordinates{ loaded_vertex.TextureCoordinate.X, loaded_vertex.TextureCoordinate.Y };
+				auto inserted = vertex_indices.insert({ { scaled_vertice.x, scaled_vertice.y, scaled_vertice.z, vertice_texture_coordinates.x, vertice_texture_coordinates.y }, (uint32_t)vertices.size() });
+				if (inserted.second)	// a new vertex
 				{
-					glm::vec3 scaled_vertice = mesh_scale * glm::vec3{loaded_mesh.Vertices[i + j].Position.X, loaded_mesh.Vertices[i + j].Position.Y, loaded_mesh.Vertices[i + j].Position.Z };
-					current_triangle[j] = scaled_vertice;
-
-					mesh_range_min = glm::vec3{ std::min(mesh_range_min.x, scaled_vertice.x), std::min(mesh_range_min.y, scaled_vertice.y), std::min(mesh_range_min.z, scaled_vertice.z) };
-					mesh_range_max = glm::vec3{ std::max(mesh_range_max.x, scaled_vertice.x), std::max(mesh_range_max.y, scaled_vertice.y), std::max(mesh_range_max.z, scaled_vertice.z) };
+					vertices.push_back(scaled_vertice);
+					texture_coordinates.push_back(vertice_texture_coordinates);
 				}
-				triangle_primitives.emplace_back(id_count, current_triangle[0], current_triangle[1], current_triangle[2], unified_material);	// implicitly calls TrianglePrimitive's constructor
-			}
-			bounding_AABB = AccelerationStructure::AABB_3D{ mesh_range_min,mesh_range_max };
-			std::vector<Entity*> entity_pointers;
-			for (TrianglePrimitive& triangle : triangle_primitives)
-			{
-				total_area += triangle.area;
-				entity_pointers.push_back(&triangle);
+				m_vertices_indices[i] = inserted.first->second;
 			}
-			bvh = new AccelerationStructure::BVH{ entity_pointers };
+			m_vertex_count = (int)vertices.size();
+			m_vertices = std::make_unique<glm::vec3[]>(m_vertex_count);
+			m_texture_coordinates = std::make_unique<glm::vec2[]>(m_vertex_count);
+			std::copy(vertices.begin(), vertices.end(), m_vertices.get());
+			std::copy(texture_coordinates.begin(), texture_coordinates.end(), m_texture_coordinates.get());
+			id_count += m_triangle_count;
+
+			update_area_and_bounding_volume();
+			bvh = new AccelerationStructure::BVH{ this, dividing_method };
+			build_triangle_blocks();
+		}
+
+		TriangleMesh(
+			int _first_primitive_id,
+			WhittedMaterial* m,
+			const glm::vec3* vertices,
+			const glm::vec2* texture_coordinates,	// one per vertex
+			int vertex_count,
+			const uint32_t* vertices_indices,		// three per triangle
+			int triangle_count,
+			AccelerationStructure::BVH_Hierarchy hierarchy,		// of the BVH built over these triangles before
+			AccelerationStructure::BVH::DividingMethod dividing_method	// what hierarchy was built with
+		)
+		// A mesh that was loaded before, e.g. from a scene snapshot: the buffers are copied, and the BVH is restored instead of built.
+		{
+			unified_material = m;
+			first_primitive_id = _first_primitive_id;
+			m_vertex_count = vertex_count;
+			m_triangle_count = triangle_count;
+			m_vertices = std::make_unique<glm::vec3[]>(m_vertex_count);
+			m_texture_coordinates = std::make_unique<glm::vec2[]>(m_vertex_count);
+			m_vertices_indices = std::make_unique<uint32_t[]>(m_triangle_count * 3);
+			std::copy(vertices, vertices + m_vertex_count, m_vertices.get());
+			std::copy(texture_coordinates, texture_coordinates + m_vertex_count, m_texture_coordinates.get());
+			std::copy(vertices_indices, vertices_indices + m_triangle_count * 3, m_vertices_indices.get());
+
+			update_area_and_bounding_volume();
+			bvh = new AccelerationStructure::BVH{ this, std::move(hierarchy), dividing_method };
+			build_triangle_blocks();
+		}
+
+		TriangleMesh(const TriangleMesh& mesh)
+		// A copy allocated by the calling thread, e.g. for a NUMA replica of the scene. The BVH is restored from the hierarchy of the
+		// BVH of mesh, so it comes back uncompressed and depth-first, with the float vertices (snapped, if mesh quantizes them).
+			: TriangleMesh(
+				mesh.first_primitive_id,
+				mesh.unified_material,
+				mesh.m_vertices.get(),
+				mesh.m_texture_coordinates.get(),
+				mesh.m_vertex_count,
+				mesh.m_vertices_indices.get(),
+				mesh.m_triangle_count,
+				mesh.bvh->GetHierarchy(),
+				mesh.bvh->GetDividingMethod()
+			)
+		{
+		}
+
+		TriangleMesh& operator=(const TriangleMesh&) = delete;
+
+		~TriangleMesh()
+		{
+			delete bvh;
 		}
 
 		virtual float GetArea() override
@@ -194,10 +553,168 @@ namespace Whitted
 			return total_area;
 		}
 
+		float GetTransformedArea(const glm::mat4x3& transform) const
+		// The area the mesh would have if all its vertices were transformed (not just scaled) by the given affine transform.
+		{
+			float transformed_area = 0.0f;
+			for (int triangle_index = 0; triangle_index < m_triangle_count; triangle_index++)
+			{
+				std::array<glm::vec3, 3> vertices = GetTriangleVertices(triangle_index);
+				glm::vec3 a = transform * glm::vec4{ vertices[0], 1.0f };
+				glm::vec3 b = transform * glm::vec4{ vertices[1], 1.0f };
+				glm::vec3 c = transform * glm::vec4{ vertices[2], 1.0f };
+				transformed_area += 0.5f * glm::length(glm::cross(b - a, c - a));
+			}
+			return transformed_area;
+		}
+
+		int GetFirstPrimitiveId() const
+		{
+			return first_primitive_id;
+		}
+
+		int GetTriangleCount() const
+		{
+			return m_triangle_count;
+		}
+
+		int GetVertexCount() const
+		{
+			return m_vertex_count;
+		}
+
+		std::array<glm::vec3, 3> GetTriangleVertices(int triangle_index) const
+		{
+			return { m_vertices[m_vertices_indices[triangle_index * 3]], m_vertices[m_vertices_indices[triangle_index * 3 + 1]], m_vertices[m_vertices_indices[triangle_index * 3 + 2]] };
+		}
+
+		glm::vec3 GetTriangleNormal(int triangle_index) const
+		{
+			std::array<glm::vec3, 3> vertices = GetTriangleVertices(triangle_index);
+			return Whitted::normalize(glm::cross(vertices[1] - vertices[0], vertices[2] - vertices[0]));
+		}
+
+		float GetTriangleArea(int triangle_index) const
+		{
+			std::array<glm::vec3, 3> vertices = GetTriangleVertices(triangle_index);
+			return 0.5f * glm::length(glm::cross(vertices[1] - vertices[0], vertices[2] - vertices[0]));
+		}
+
+		const glm::vec3& GetVertex(int vertex_index) const
+		{
+			return m_vertices[vertex_index];
+		}
+
+		const glm::vec2& GetTextureCoordinates(int vertex_index) const
+		{
+			return m_texture_coordinates[vertex_index];
+		}
+
+		std::array<uint32_t, 3> GetTriangleVertexIndices(int triangle_index) const
+		{
+			return { m_vertices_indices[triangle_index * 3], m_vertices_indices[triangle_index * 3 + 1], m_vertices_indices[triangle_index * 3 + 2] };
+		}
+
+		void SetVertex(int vertex_index, const glm::vec3& position)
+		// For deforming meshes: move the vertices with this (every triangle sharing the vertex follows), then call RefitBVH() once before tracing rays again.
+		{
+			m_vertices[vertex_index] = position;
+		}
+
+		void RefitBVH(float rebuild_ratio = 2.0f)
+		// Refit the mesh BVH to the moved triangles, and fall back to a full rebuild once refitting
+		// has made the tree rebuild_ratio times as expensive (in SAH cost) as it was when last built.
+		// The scene BVH containing this mesh has to be refitted afterwards, since the box of the mesh changes.
+		{
+			update_area_and_bounding_volume();
+			bvh->Refit();
+			if (bvh->GetSAHCost() > rebuild_ratio * bvh->GetSAHCostAtRebuild())
+			{
+				bvh->Rebuild();
+			}
+			if (m_quantize_vertices)	// the vertices have moved off the grid
+			{
+				snap_to_quantization_grid();
+			}
+			build_triangle_blocks();
+		}
+
+		void SetBVHCompression(bool compress_nodes, bool quantize_vertices)
+		// Trade a little traversal work for memory. compress_nodes stores the boxes in the nodes of the mesh BVH quantized
+		// to 8 bits (see AccelerationStructure::BVH_CompressedWideNode). quantize_vertices makes the traversal read the vertices
+		// as 16-bit coordinates on a grid spanning the box of the mesh, one at a time, instead of the SIMD triangle blocks
+		// (see TriangleBlock_SoA, 52 bytes per triangle against 6 per vertex). This one is lossy: the vertices
+		// are snapped to the grid (moving each by at most half a grid step, i.e. 1/131070 of the extent of the mesh per axis),
+		// and the BVH is refitted to the snapped triangles so that the traversal still finds every hit.
+		{
+			bvh->SetNodeCompression(compress_nodes);
+			m_quantize_vertices = quantize_vertices;
+			if (quantize_vertices)
+			{
+				snap_to_quantization_grid();
+			}
+			else
+			{
+				m_quantized_vertices.clear();
+				m_quantized_vertices.shrink_to_fit();
+			}
+			build_triangle_blocks();
+		}
+
+		bool IsQuantizingVertices() const
+		{
+			return m_quantize_vertices;
+		}
+
+		void SetBVHNodeLayout(AccelerationStructure::BVH::NodeLayout node_layout, const std::vector<AccelerationStructure::Ray>& sample_rays = {})
+		// see AccelerationStructure::BVH::SetNodeLayout(), the sample rays are in the space of the vertices (see MeshInstance::ToObjectSpace())
+		{
+			bvh->SetNodeLayout(node_layout, sample_rays,
+				[&](int first_primitive_index, int primitive_count, AccelerationStructure::Ray& bounded_ray)
+				{
+					Hit hit;
+					intersect_leaf(first_primitive_index, primitive_count, bounded_ray, hit);
+				}
+			);
+		}
+
+		size_t GetTraversalMemoryInBytes() const
+		// What a ray query through this mesh reads: the BVH nodes, and either the triangle blocks of its leaves,
+		// or (quantized) the triangle indices of its leaves, the vertex indices of the triangles and the vertices.
+		{
+			if (!m_quantize_vertices)
+			{
+				return bvh->GetNodeMemoryInBytes() + m_triangle_blocks.size() * sizeof(TriangleBlock);
+			}
+			size_t index_bytes = bvh->GetPrimitiveIndices().size() * sizeof(int) + m_triangle_count * 3 * sizeof(uint32_t);
+			return bvh->GetNodeMemoryInBytes() + index_bytes + m_quantized_vertices.size() * sizeof(QuantizedVertex);
+		}
+
+		const AccelerationStructure::BVH& GetBVH() const
+		{
+			return *bvh;
+		}
+
+		AccelerationStructure::BVH& GetBVH()
+		{
+			return *bvh;
+		}
+
+		WhittedMaterial* GetMaterial() const
+		{
+			return unified_material;
+		}
+
 		virtual void Sampling(IntersectionRecord& sample, float& PDF) override
 		{
 			sample.emission = unified_material->GetEmission();
-			bvh->Sampling_from_root(sample, PDF);
+			int triangle_index = bvh->SamplePrimitive(PDF);
+			std::array<glm::vec3, 3> vertices = GetTriangleVertices(triangle_index);
+			// a uniform point on the triangle, see TrianglePrimitive::Sampling():
+			float x = 1 - std::sqrt(get_random_float_0_1());
+			float y = get_random_float_0_1();
+			sample.location = (x)*vertices[0] + ((1.0f - x) * (y)) * vertices[1] + ((1.0f - x) * (1.0f - y)) * vertices[2];
+			sample.surface_normal = GetTriangleNormal(triangle_index);
 		}
 
 		virtual bool IsEmissive() override
@@ -210,21 +727,120 @@ namespace Whitted
 			return bounding_AABB;
 		}
 
+		virtual AccelerationStructure::AABB_3D GetClippedAABB(const AccelerationStructure::AABB_3D& box) override
+		{
+			return bvh->GetClippedBoundingVolume(box);
+		}
+
 		virtual IntersectionRecord GetIntersectionRecord(AccelerationStructure::Ray ray) override
+		// Find the closest triangle first, then fill in the record once for that triangle only.
 		{
-			IntersectionRecord record;
-			if (bvh)
+			Hit hit;
+			if (!GetClosestHit(ray, hit))
 			{
-				record = bvh->traverse_BVH_from_root(ray);
+				return IntersectionRecord{};
 			}
+			return GetSurfaceInteraction(ray, hit);
+		}
+
+		virtual bool GetClosestHit(const AccelerationStructure::Ray& ray, Hit& hit) override
+		// hit.primitive_index is the index of the triangle
+		{
+			if (!bvh)
+			{
+				return false;
+			}
+			bool is_hit = false;
+			bvh->closest_hit_with(ray,
+				[&](int first_primitive_index, int primitive_count, AccelerationStructure::Ray& bounded_ray)
+				{
+					is_hit |= intersect_leaf(first_primitive_index, primitive_count, bounded_ray, hit);
+				}
+			);
+			return is_hit;
+		}
+
+		virtual uint64_t GetClosestHitsInPacket(AccelerationStructure::RayPacket& packet, int first_ray_index, int last_ray_index, Hit* hits) override
+		{
+			uint64_t hit_mask = 0;
+			if (!bvh)
+			{
+				return hit_mask;
+			}
+			bvh->closest_hits_with(packet, first_ray_index, last_ray_index,
+				[&](int first_primitive_index, int primitive_count, int first_active_ray_index, int last_active_ray_index)
+				{
+					for (int i = first_active_ray_index; i < last_active_ray_index; i++)
+					{
+						if (intersect_leaf(first_primitive_index, primitive_count, packet.rays[i], hits[i]))
+						{
+							hit_mask |= uint64_t{ 1 } << i;
+						}
+					}
+				}
+			);
+			return hit_mask;
+		}
+
+		virtual IntersectionRecord GetSurfaceInteraction(const AccelerationStructure::Ray& ray, const Hit& hit) override
+		{
+			IntersectionRecord record;
+			record.has_intersection = true;
+			record.t = hit.t;
+			record.hitted_entity_material = unified_material;
+			record.hitted_entity = this;
+			record.surface_normal = GetTriangleNormal(hit.primitive_index);
+			record.location = ray(record.t);
+			record.primitive_id = first_primitive_id + hit.primitive_index;
 			return record;
 		}
 
+		virtual bool IntersectsWithin(AccelerationStructure::Ray ray, double maximum_t) override
+		{
+			if (!bvh)
+			{
+				return false;
+			}
+			if (!m_quantize_vertices)
+			{
+				return bvh->any_hit_with(ray, maximum_t,
+					[&](int first_primitive_index, int primitive_count)
+					{
+						for (int block_index = first_primitive_index / triangle_block_width; block_index * triangle_block_width < first_primitive_index + primitive_count; block_index++)
+						{
+							TriangleBlock::Intersections intersections;
+							if (m_triangle_blocks[block_index].intersects_with_ray(ray, get_lane_mask(block_index, first_primitive_index, primitive_count), (float)ray.t_min, (float)maximum_t, intersections) != 0)
+							{
+								return true;
+							}
+						}
+						return false;
+					}
+				);
+			}
+			const int* triangle_indices = bvh->GetPrimitiveIndices().data();
+			return bvh->any_hit_with(ray, maximum_t,
+				[&](int first_primitive_index, int primitive_count)
+				{
+					for (int i = first_primitive_index; i < first_primitive_index + primitive_count; i++)
+					{
+						std::array<glm::vec3, 3> vertices = get_traversed_triangle_vertices(triangle_indices[i]);
+						double t;
+						if (RayTriangleIntersection(vertices[0], vertices[1], vertices[2], ray.m_origin, ray.m_direction, t) && (t >= ray.t_min) && (t < maximum_t))
+						{
+							return true;
+						}
+					}
+					return false;
+				}
+			);
+		}
+
 		virtual glm::vec3 GetDiffuseColor(const glm::vec2& texture_coordinates) const override
 		{
 			// A procedural texture algorithm generating chessboard-like pattern for the floor
 			float frequency = 5;
-			float pattern = (std::fmodf(texture_coordinates.x * frequency, 1) > 0.5) ^ (std::fmodf(texture_coordinates.y * frequency, 1) > 0.5);
+			float pattern = (std::fmod(texture_coordinates.x * frequency, 1.0f) > 0.5) ^ (std::fmod(texture_coordinates.y * frequency, 1.0f) > 0.5);
 			// See https://learn.microsoft.com/en-us/cpp/cpp/bitwise-exclusive-or-operator-hat?view=msvc-170
 			return Whitted::lerp(glm::vec3(0.815, 0.235, 0.031), glm::vec3(0.937, 0.937, 0.231), pattern);
 		}
@@ -261,14 +877,182 @@ namespace Whitted
 		}
 
 	private:
+		using QuantizedVertex = std::array<uint16_t, 3>;	// the grid coordinates of a vertex
+
+		static constexpr int triangle_block_width = 4;	// the leaves hold 1 to 4 triangles (the BVH default), 8-wide (AVX) blocks measured a little slower
+		using TriangleBlock = TriangleBlock_SoA<triangle_block_width>;
+
+		// The triangles, as the BVH_PrimitiveSet the mesh BVH is built over:
+
+		virtual int GetPrimitiveCount() const override
+		{
+			return m_triangle_count;
+		}
+
+		virtual AccelerationStructure::AABB_3D GetPrimitiveAABB(int triangle_index) const override
+		{
+			std::array<glm::vec3, 3> vertices = GetTriangleVertices(triangle_index);
+			return (AccelerationStructure::AABB_3D{ vertices[0], vertices[1] }).Union_with_point(vertices[2]);
+		}
+
+		virtual float GetPrimitiveArea(int triangle_index) const override
+		{
+			return GetTriangleArea(triangle_index);
+		}
+
+		virtual AccelerationStructure::AABB_3D GetClippedPrimitiveAABB(int triangle_index, const AccelerationStructure::AABB_3D& box) const override
+		{
+			std::array<glm::vec3, 3> vertices = GetTriangleVertices(triangle_index);
+			return ClippedTriangleAABB(vertices[0], vertices[1], vertices[2], box);
+		}
+
+		bool intersect_leaf(int first_primitive_index, int primitive_count, AccelerationStructure::Ray& bounded_ray, Hit& hit) const
+		// Test the triangles of a leaf, and if any is hit before bounded_ray.t_max, overwrite hit with the closest one and shrink bounded_ray.t_max to it.
+		{
+			bool is_hit = false;
+			if (!m_quantize_vertices)
+			{
+				for (int block_index = first_primitive_index / triangle_block_width; block_index * triangle_block_width < first_primitive_index + primitive_count; block_index++)
+				{
+					const TriangleBlock& block = m_triangle_blocks[block_index];
+					TriangleBlock::Intersections intersections;
+					int hit_mask = block.intersects_with_ray(bounded_ray, get_lane_mask(block_index, first_primitive_index, primitive_count), (float)bounded_ray.t_min, (float)bounded_ray.t_max, intersections);
+					for (int lane = 0; hit_mask != 0; lane++, hit_mask >>= 1)
+					{
+						if ((hit_mask & 1) && (intersections.t[lane] < bounded_ray.t_max))
+						{
+							hit.t = intersections.t[lane];
+							hit.primitive_index = block.triangle_index[lane];
+							hit.barycentric_coordinates = glm::vec2{ intersections.barycentric_coordinate_2[lane], intersections.barycentric_coordinate_3[lane] };
+							bounded_ray.t_max = hit.t;
+							is_hit = true;
+						}
+					}
+				}
+				return is_hit;
+			}
+
+			const int* triangle_indices = bvh->GetPrimitiveIndices().data();
+			for (int i = first_primitive_index; i < first_primitive_index + primitive_count; i++)
+			{
+				std::array<glm::vec3, 3> vertices = get_traversed_triangle_vertices(triangle_indices[i]);
+				double t;
+				glm::vec2 barycentric_coordinates;
+				if (RayTriangleIntersection(vertices[0], vertices[1], vertices[2], bounded_ray.m_origin, bounded_ray.m_direction, t, barycentric_coordinates) && (t >= bounded_ray.t_min) && ((float)t < bounded_ray.t_max))
+				{
+					hit.t = (float)t;
+					hit.primitive_index = triangle_indices[i];
+					hit.barycentric_coordinates = barycentric_coordinates;
+					bounded_ray.t_max = hit.t;
+					is_hit = true;
+				}
+			}
+			return is_hit;
+		}
+
+		std::array<glm::vec3, 3> get_traversed_triangle_vertices(int triangle_index) const
+		// the vertices as the ray queries read them: from the 16-bit grid when quantized (the same values as m_vertices, which are snapped to it)
+		{
+			if (!m_quantize_vertices)
+			{
+				return GetTriangleVertices(triangle_index);
+			}
+			return {
+				dequantize_vertex(m_quantized_vertices[m_vertices_indices[triangle_index * 3]]),
+				dequantize_vertex(m_quantized_vertices[m_vertices_indices[triangle_index * 3 + 1]]),
+				dequantize_vertex(m_quantized_vertices[m_vertices_indices[triangle_index * 3 + 2]])
+			};
+		}
+
+		void build_triangle_blocks()
+		// Pack the triangles into blocks in the order the leaves refer to them, GetPrimitiveIndices()[i] going to lane i % triangle_block_width
+		// of block i / triangle_block_width. A leaf may share its first and last block with its neighbours (padding every leaf to whole blocks
+		// would waste most of the lanes, since most leaves hold one or two triangles). Only used with float vertices.
+		{
+			m_triangle_blocks.clear();
+			if (m_quantize_vertices)
+			{
+				m_triangle_blocks.shrink_to_fit();
+				return;
+			}
+			const std::vector<int>& triangle_indices = bvh->GetPrimitiveIndices();
+			m_triangle_blocks.resize((triangle_indices.size() + triangle_block_width - 1) / triangle_block_width);
+			for (int i = 0; i < (int)triangle_indices.size(); i++)
+			{
+				std::array<glm::vec3, 3> vertices = GetTriangleVertices(triangle_indices[i]);
+				m_triangle_blocks[i / triangle_block_width].set(i % triangle_block_width, triangle_indices[i], vertices[0], vertices[1], vertices[2]);
+			}
+		}
+
+		static int get_lane_mask(int block_index, int first_primitive_index, int primitive_count)
+		// the lanes of the block that belong to the leaf [first_primitive_index, first_primitive_index + primitive_count)
+		{
+			int first_lane = std::max(first_primitive_index - block_index * triangle_block_width, 0);
+			int end_lane = std::min(first_primitive_index + primitive_count - block_index * triangle_block_width, triangle_block_width);
+			return ((1 << end_lane) - 1) & ~((1 << first_lane) - 1);
+		}
+
+		void update_area_and_bounding_volume()
+		{
+			total_area = 0.0f;
+			bounding_AABB = AccelerationStructure::AABB_3D{};
+			for (int triangle_index = 0; triangle_index < m_triangle_count; triangle_index++)
+			{
+				total_area += GetTriangleArea(triangle_index);
+			}
+			for (int vertex_index = 0; vertex_index < m_vertex_count; vertex_index++)
+			{
+				bounding_AABB = bounding_AABB.Union_with_point(m_vertices[vertex_index]);
+			}
+		}
+
+		glm::vec3 dequantize_vertex(const QuantizedVertex& grid_coordinates) const
+		// Also used to snap the vertices, so the traversal sees exactly m_vertices.
+		{
+			return m_quantization_origin + glm::vec3{ (float)grid_coordinates[0], (float)grid_coordinates[1], (float)grid_coordinates[2] } * m_quantization_step;
+		}
+
+		QuantizedVertex quantize_vertex(const glm::vec3& vertex) const
+		{
+			QuantizedVertex grid_coordinates;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				float grid_coordinate = (m_quantization_step[axis] > 0.0f) ? ((vertex[axis] - m_quantization_origin[axis]) / m_quantization_step[axis]) : (0.0f);
+				grid_coordinates[axis] = (uint16_t)std::clamp((int)std::lround(grid_coordinate), 0, (int)std::numeric_limits<uint16_t>::max());
+			}
+			return grid_coordinates;
+		}
+
+		void snap_to_quantization_grid()
+		// Snap the vertices to a 16-bit grid over the current box of the mesh, keep their grid coordinates, and refit the BVH to the snapped triangles.
+		{
+			m_quantization_origin = bounding_AABB.min_slab_values;
+			m_quantization_step = (bounding_AABB.max_slab_values - bounding_AABB.min_slab_values) / (float)std::numeric_limits<uint16_t>::max();
+			m_quantized_vertices.resize(m_vertex_count);
+			for (int vertex_index = 0; vertex_index < m_vertex_count; vertex_index++)
+			{
+				m_quantized_vertices[vertex_index] = quantize_vertex(m_vertices[vertex_index]);
+				m_vertices[vertex_index] = dequantize_vertex(m_quantized_vertices[vertex_index]);
+			}
+			update_area_and_bounding_volume();
+			bvh->Refit();
+		}
+
 		float total_area;
+		int first_primitive_id;		// the triangles have the ids [first_primitive_id, first_primitive_id + GetTriangleCount())
 		WhittedMaterial* unified_material = nullptr;	// Now we want all the triangles in one mesh to have the same material
-		std::vector<TrianglePrimitive> triangle_primitives;
-		std::unique_ptr<glm::vec3[]> m_vertices;
-		std::unique_ptr<glm::vec2[]> m_texture_coordinates;
-		std::unique_ptr<uint32_t[]> m_vertices_indices;
+		int m_vertex_count = 0;
+		int m_triangle_count = 0;
+		std::unique_ptr<glm::vec3[]> m_vertices;				// shared by the triangles
+		std::unique_ptr<glm::vec2[]> m_texture_coordinates;		// one per vertex
+		std::unique_ptr<uint32_t[]> m_vertices_indices;			// three per triangle
 		AccelerationStructure::AABB_3D bounding_AABB;
-		AccelerationStructure::BVH* bvh;
+		AccelerationStructure::BVH* bvh = nullptr;
+		bool m_quantize_vertices = false;
+		std::vector<QuantizedVertex> m_quantized_vertices;	// empty unless m_quantize_vertices, indexed like m_vertices
+		std::vector<TriangleBlock> m_triangle_blocks;		// empty if m_quantize_vertices, see build_triangle_blocks()
+		glm::vec3 m_quantization_origin{ 0.0f };
+		glm::vec3 m_quantization_step{ 0.0f };
 	};
 }
 
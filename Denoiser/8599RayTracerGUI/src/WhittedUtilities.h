@@ -10,7 +10,7 @@
 #define WHITTEDUTILITIES_H
 
 #include <utility>
-#include "Walnut/Random.h"
+#include "RandomStream.h"
 #include <cmath>
 
 namespace Whitted
@@ -21,8 +21,9 @@ namespace Whitted
 	constexpr float positive_infinity = std::numeric_limits<float>::max();
 
 	inline float get_random_float_0_1()
+	// The next number of the sample being shaded on this thread, see RandomStream.
 	{
-		return Walnut::Random::Float();
+		return this_thread_random_stream.Float();
 	}
 
 	inline float clamp_float(const float& value, const float& lower_bound, const float& upper_bound)
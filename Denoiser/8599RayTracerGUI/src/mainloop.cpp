@@ -22,11 +22,19 @@ class CSC8599Layer : public Walnut::Layer
 	Camera camera{ 35.0f, 0.1f, 100.0f };
 	uint32_t viewport_width = 0;
 	uint32_t viewport_height = 0;
+	size_t uncompressed_BVH_memory_in_bytes = 0;
+	std::array<float, 3> BVH_node_layout_durations{ 0.0f, 0.0f, 0.0f };	// milliseconds per layout, from the last benchmark
+	std::array<float, 2> integrator_durations{ 0.0f, 0.0f };	// milliseconds per frame of shading() and of the wavefront integrator, from the last benchmark
+	std::array<float, 2> ray_batch_durations{ 0.0f, 0.0f };		// milliseconds for the primary rays one at a time and in batches, from the last benchmark
+	std::array<float, 2> scene_replica_durations{ 0.0f, 0.0f };	// milliseconds per frame with a shared scene and with a copy per NUMA node, from the last benchmark
+	std::vector<std::pair<std::string, AccelerationStructure::BVH_Statistics>> BVH_statistics;	// walking all the BVHs every frame would be too slow, so refreshed on demand
+	bool counting_BVH_traversals = false;
 
 public:
 	CSC8599Layer()
 	{
-		
+		uncompressed_BVH_memory_in_bytes = renderer.GetBVHMemoryInBytes();
+		BVH_statistics = renderer.GetBVHStatistics();
 	}
 
 	virtual void OnUpdate(float dt) override
@@ -93,6 +101,31 @@ public:
 		ImGui::Text("Current_Frame_Weighting_0.1    %.0f", (float)renderer.GetSettings().using_temporal_current_frame_weighting_10);
 		ImGui::Text("Current_Frame_Weighting_0.2    %.0f", (float)renderer.GetSettings().using_temporal_current_frame_weighting_20);
 		ImGui::Text("Current_Frame_Weighting_0.5    %.0f", (float)renderer.GetSettings().using_temporal_current_frame_weighting_50);
+		ImGui::Text("Rebuild_BVH_Every_Frame    %.0f", (float)renderer.GetSettings().rebuild_BVH_every_frame);
+		ImGui::Text("Refit_BVH_Every_Frame    %.0f", (float)renderer.GetSettings().refit_BVH_every_frame);
+		ImGui::Text("Primary_Ray_Packets    %.0f", (float)renderer.GetSettings().trace_primary_ray_packets);
+		ImGui::Text("Wavefront_Path_Tracing    %.0f", (float)renderer.GetSettings().wavefront_path_tracing);
+		ImGui::Text("Render_Threads    %d (0: one per hardware thread), tile size %u", renderer.GetSettings().render_thread_count, renderer.GetSettings().render_tile_size);
+		ImGui::Text("NUMA_Scene_Replicas    %.0f (%d nodes, %d replicas)", (float)renderer.GetSettings().NUMA_scene_replicas, Scheduling::NUMATopology::Get().GetNodeCount(), renderer.GetSceneReplicaCount());
+		ImGui::Text("Adaptive_Sampling    %.0f, error %.0f%%, frames %u, paths per pixel %.1f, converged %.1f%%", (float)renderer.GetSettings().adaptive_sampling, 100.0f * renderer.GetSettings().adaptive_relative_error,
+			renderer.GetAdaptiveSamplingStatistics().frame_count, renderer.GetAdaptiveSamplingStatistics().paths_per_pixel, 100.0f * renderer.GetAdaptiveSamplingStatistics().converged_pixel_fraction);
+		ImGui::Text("Scene_Replicas_ms    shared %.2f, replicated %.2f (speedup %.2f)", scene_replica_durations[0], scene_replica_durations[1], (scene_replica_durations[1] > 0.0f) ? (scene_replica_durations[0] / scene_replica_durations[1]) : (0.0f));
+		ImGui::Text("Integrator_ms    recursive %.2f, wavefront %.2f", integrator_durations[0], integrator_durations[1]);
+		ImGui::Text("Primary_Rays_ms    one at a time %.2f, interleaved batches %.2f", ray_batch_durations[0], ray_batch_durations[1]);
+		ImGui::Text("BVH_Memory_KB    %.0f (%.0f saved)", renderer.GetBVHMemoryInBytes() / 1024.0f, ((float)uncompressed_BVH_memory_in_bytes - (float)renderer.GetBVHMemoryInBytes()) / 1024.0f);
+		ImGui::Text("BVH_Layout_Primary_Rays_ms    depth-first %.2f, van Emde Boas %.2f, treelets %.2f", BVH_node_layout_durations[0], BVH_node_layout_durations[1], BVH_node_layout_durations[2]);
+		for (const auto& [name, statistics] : BVH_statistics)
+		{
+			ImGui::Text("BVH_%s    nodes %d, leaves %d, depth %d, SAH %.2f, leaf size %.2f, duplication %.2f",
+				name.c_str(), statistics.node_count, statistics.leaf_count, statistics.maximum_depth, statistics.SAH_cost, statistics.average_leaf_size, statistics.reference_duplication);
+		}
+		if (counting_BVH_traversals)
+		{
+			AccelerationStructure::BVH_TraversalStatistics traversal_statistics = renderer.GetBVHTraversalStatistics();
+			float ray_count = (float)std::max(renderer.GetSceneBVHQueryCount(), (uint64_t)1);
+			ImGui::Text("BVH_Per_Ray    nodes visited %.1f, box tests %.1f, primitive tests %.1f",
+				traversal_statistics.nodes_visited / ray_count, traversal_statistics.box_tests / ray_count, traversal_statistics.primitive_tests / ray_count);
+		}
 
 		ImGui::Separator();
 
@@ -235,6 +268,150 @@ public:
 
 		ImGui::Separator();
 
+		ImGui::Text("Acceleration structure:");
+
+		if (ImGui::Button("Rebuild the scene BVH every frame"))
+		{
+			renderer.GetSettings().rebuild_BVH_every_frame = true;
+		}
+		if (ImGui::Button("Stop rebuilding the scene BVH"))
+		{
+			renderer.GetSettings().rebuild_BVH_every_frame = false;
+		}
+		if (ImGui::Button("Refit the scene BVH every frame"))
+		{
+			renderer.GetSettings().rebuild_BVH_every_frame = false;
+			renderer.GetSettings().refit_BVH_every_frame = true;
+		}
+		if (ImGui::Button("Stop refitting the scene BVH"))
+		{
+			renderer.GetSettings().refit_BVH_every_frame = false;
+		}
+		if (ImGui::Button("Trace the primary rays in 8x8 packets"))
+		{
+			renderer.GetSettings().trace_primary_ray_packets = true;
+		}
+		if (ImGui::Button("Trace the primary rays one at a time"))
+		{
+			renderer.GetSettings().trace_primary_ray_packets = false;
+		}
+		if (ImGui::Button("Trace the paths in wavefronts"))
+		{
+			renderer.GetSettings().wavefront_path_tracing = true;
+		}
+		if (ImGui::Button("Trace the paths one at a time"))
+		{
+			renderer.GetSettings().wavefront_path_tracing = false;
+		}
+		if (ImGui::Button("Render on every hardware thread"))
+		{
+			renderer.GetSettings().render_thread_count = 0;
+		}
+		if (ImGui::Button("Render on one thread"))
+		{
+			renderer.GetSettings().render_thread_count = 1;
+		}
+		if (ImGui::Button("Render in 8x8 tiles"))
+		{
+			renderer.GetSettings().render_tile_size = 8;
+		}
+		if (ImGui::Button("Render in 32x32 tiles"))
+		{
+			renderer.GetSettings().render_tile_size = 32;
+		}
+		if (ImGui::Button("Render in 64x64 tiles"))
+		{
+			renderer.GetSettings().render_tile_size = 64;
+		}
+		if (ImGui::Button("Sample adaptively"))
+		{
+			renderer.GetSettings().adaptive_sampling = true;
+		}
+		if (ImGui::Button("Sample every pixel once per frame"))
+		{
+			renderer.GetSettings().adaptive_sampling = false;
+		}
+		if (ImGui::Button("Adaptive sampling to 2% error"))
+		{
+			renderer.GetSettings().adaptive_relative_error = 0.02f;
+		}
+		if (ImGui::Button("Adaptive sampling to 5% error"))
+		{
+			renderer.GetSettings().adaptive_relative_error = 0.05f;
+		}
+		if (ImGui::Button("Adaptive sampling to 10% error"))
+		{
+			renderer.GetSettings().adaptive_relative_error = 0.1f;
+		}
+		if (ImGui::Button("Copy the scene to every NUMA node"))
+		{
+			renderer.GetSettings().NUMA_scene_replicas = true;
+		}
+		if (ImGui::Button("Share one copy of the scene"))
+		{
+			renderer.GetSettings().NUMA_scene_replicas = false;
+		}
+		if (ImGui::Button("Benchmark the NUMA scene replicas"))
+		{
+			scene_replica_durations = renderer.BenchmarkSceneReplicas(camera);
+		}
+		if (ImGui::Button("Benchmark the integrators"))
+		{
+			integrator_durations = renderer.BenchmarkIntegrators(camera);
+		}
+		if (ImGui::Button("Benchmark the interleaved ray batches"))
+		{
+			ray_batch_durations = renderer.BenchmarkRayBatches(camera);
+		}
+		if (ImGui::Button("Compress the BVH nodes"))
+		{
+			renderer.SetBVHCompression(true, false);
+		}
+		if (ImGui::Button("Compress the BVH nodes and quantize the mesh vertices"))
+		{
+			renderer.SetBVHCompression(true, true);
+		}
+		if (ImGui::Button("Stop compressing the BVHs"))
+		{
+			renderer.SetBVHCompression(false, false);
+		}
+		if (ImGui::Button("Lay out the BVH nodes depth-first"))
+		{
+			renderer.SetBVHNodeLayout(AccelerationStructure::BVH::NodeLayout::Depth_First, camera);
+		}
+		if (ImGui::Button("Lay out the BVH nodes in van Emde Boas order"))
+		{
+			renderer.SetBVHNodeLayout(AccelerationStructure::BVH::NodeLayout::Van_Emde_Boas, camera);
+		}
+		if (ImGui::Button("Lay out the BVH nodes in treelets"))
+		{
+			renderer.SetBVHNodeLayout(AccelerationStructure::BVH::NodeLayout::Treelets, camera);
+		}
+		if (ImGui::Button("Benchmark the BVH node layouts (keeps the fastest)"))
+		{
+			BVH_node_layout_durations = renderer.BenchmarkBVHNodeLayouts(camera);
+		}
+		if (ImGui::Button("Refresh the BVH statistics"))
+		{
+			BVH_statistics = renderer.GetBVHStatistics();
+		}
+		if (ImGui::Button("Count the BVH traversals"))
+		{
+			counting_BVH_traversals = true;
+			renderer.SetBVHTraversalCounting(true);
+		}
+		if (ImGui::Button("Stop counting the BVH traversals"))
+		{
+			counting_BVH_traversals = false;
+			renderer.SetBVHTraversalCounting(false);
+		}
+		if (ImGui::Button("Write the BVH statistics to bvh_statistics.json"))
+		{
+			renderer.WriteBVHStatistics("bvh_statistics.json");
+		}
+
+		ImGui::Separator();
+
 		if (ImGui::Button("Render Offline"))
 		{
 			real_time = false;